@@ -15,7 +15,11 @@
 #include "task_depthmap_inpaint.hh"
 #include "task_background_removal.hh"
 #include "task_3dpreview.hh"
+#include "task_tile.hh"
+#include "task_preview.hh"
+#include "imageloader.hh"
 #include <thread>
+#include <chrono>
 #include <opencv2/core/ocl.hpp>
 
 using namespace focusstack;
@@ -35,12 +39,23 @@ FocusStack::FocusStack():
   m_3dviewpoint(1,1,1),
   m_3dzscale(1),
   m_threads(std::thread::hardware_concurrency() + 1), // +1 to have extra thread to give tasks for GPU
+  m_scheduler(SCHEDULER_SHARED),
+  m_max_memory(0),
+  m_reassign_memory(0),
+  m_reassign_index(false),
+  m_load_threads(0),
+  m_trace(""),
+  m_save_alignment_file(""),
+  m_load_alignment_file(""),
   m_batchsize(8),
+  m_merge_tree(false),
+  m_tile_size(0),
   m_reference(-1),
   m_consistency(0),
   m_jpgquality(95),
   m_denoise(0),
-  m_wait_images(0.0f)
+  m_wait_images(0.0f),
+  m_preview_size(0)
 {
   m_logger = std::make_shared<Logger>();
 
@@ -61,11 +76,18 @@ void FocusStack::set_log_callback(std::function<void(log_level_t level, std::str
   m_logger->set_callback(callback);
 }
 
+void FocusStack::set_preview(int max_size, std::function<void(const cv::Mat &preview)> callback)
+{
+  m_preview_size = max_size;
+  m_preview_callback = callback;
+}
+
 bool FocusStack::run()
 {
   reset();
   start();
   do_final_merge();
+  finish_scheduling(-1);
 
   // All temporaries except results can be released now.
   // Anything that is needed is held on by shared_ptrs in the tasks.
@@ -79,7 +101,22 @@ bool FocusStack::run()
 
 void FocusStack::start()
 {
-  m_worker = std::make_unique<Worker>(m_threads, m_logger);
+  m_worker = std::make_unique<Worker>(m_threads, m_logger, m_scheduler);
+  m_worker->set_max_memory((size_t)m_max_memory * 1000000);
+  m_worker->set_trace(!m_trace.empty());
+
+  if (m_load_threads > 0 && m_wait_images <= 0)
+  {
+    // Decoded images are taken into use as soon as they are ready
+    Worker *worker = m_worker.get();
+    m_loader = std::make_shared<ImageLoader>(m_load_threads, 2 * m_load_threads,
+                                             [worker]() { worker->poll_deferred(); });
+  }
+
+  if (m_preview_size > 0)
+  {
+    m_preview = std::make_shared<PreviewPublisher>(m_preview_callback);
+  }
 
   m_have_opencl = false;
   if (m_disable_opencl)
@@ -148,7 +185,8 @@ void FocusStack::add_image(const cv::Mat &image)
 void FocusStack::do_final_merge()
 {
   schedule_queue_processing();
-  schedule_final_merge();
+  m_final_merge_pending = true;
+  schedule_deferred();
 }
 
 void FocusStack::get_status(int &total_tasks, int &completed_tasks, std::string &running_task_name)
@@ -160,6 +198,7 @@ void FocusStack::get_status(int &total_tasks, int &completed_tasks, std::string
   }
   else
   {
+    schedule_deferred();
     m_worker->get_status(total_tasks, completed_tasks, running_task_name);
   }
 }
@@ -173,6 +212,11 @@ bool FocusStack::wait_done(bool &status, std::string &errmsg, int timeout_ms)
     return true;
   }
 
+  if (!finish_scheduling(timeout_ms))
+  {
+    return false;
+  }
+
   if (m_worker->wait_all(timeout_ms))
   {
     status = !m_worker->failed();
@@ -181,6 +225,28 @@ bool FocusStack::wait_done(bool &status, std::string &errmsg, int timeout_ms)
       errmsg = m_worker->error();
     }
 
+    if (!m_trace.empty() && !m_worker->write_trace(m_trace))
+    {
+      if (status)
+      {
+        errmsg = "Could not write trace file " + m_trace;
+      }
+      status = false;
+    }
+
+    if (m_save_alignment && !m_save_alignment_file.empty() && status)
+    {
+      try
+      {
+        m_save_alignment->save(m_save_alignment_file);
+      }
+      catch (std::exception &e)
+      {
+        errmsg = e.what();
+        status = false;
+      }
+    }
+
     return true;
   }
 
@@ -193,14 +259,19 @@ void FocusStack::reset(bool keep_results)
   m_scheduled_image_count = 0;
   m_refidx = -1;
   m_input_images.clear();
+  m_source_filenames.clear();
   m_grayscale_imgs.clear();
   m_aligned_imgs.clear();
   m_aligned_grayscales.clear();
   m_refcolor.reset();
   m_refgray.reset();
-  m_prev_merge.reset();
+  m_tiles.clear();
+  m_tiles_decided = false;
+  m_pending_images.clear();
+  m_final_merge_pending = false;
+  m_loaded_alignment.reset();
   m_latest_depthmap.reset();
-  m_merge_batch.clear();
+  m_merges.assign(1, merge_state_t());
   m_reassign_batch_grays.clear();
   m_reassign_batch_colors.clear();
   m_reassign_map.reset();
@@ -208,11 +279,26 @@ void FocusStack::reset(bool keep_results)
 
   if (!keep_results)
   {
+    m_loader.reset();
     m_worker.reset();
+    m_save_alignment.reset();
     m_result_image.reset();
     m_result_depthmap.reset();
     m_result_fg_mask.reset();
     m_result_3dview.reset();
+    m_preview.reset();
+  }
+}
+
+FocusStack::statistics_t FocusStack::get_statistics() const
+{
+  if (m_worker)
+  {
+    return m_worker->get_statistics();
+  }
+  else
+  {
+    return statistics_t{0, 0, {}};
   }
 }
 
@@ -252,6 +338,18 @@ const cv::Mat &FocusStack::get_result_mask() const
   }
 }
 
+cv::Mat FocusStack::get_preview_image() const
+{
+  if (m_preview)
+  {
+    return m_preview->latest();
+  }
+  else
+  {
+    return cv::Mat();
+  }
+}
+
 const cv::Mat &FocusStack::get_result_3dview() const
 {
   if (m_result_3dview)
@@ -270,6 +368,7 @@ void FocusStack::schedule_queue_processing()
   if (count <= m_scheduled_image_count) return; // No new images
 
   m_grayscale_imgs.resize(count);
+  m_source_filenames.resize(count);
   m_aligned_imgs.resize(count);
   m_aligned_grayscales.resize(count);
 
@@ -285,10 +384,23 @@ void FocusStack::schedule_queue_processing()
 
     m_refcolor = m_input_images.at(m_refidx);
     m_refgray = std::make_shared<Task_Grayscale>(m_refcolor);
+    if (m_loader) m_loader->add(m_refcolor);
     m_worker->add(m_refcolor);
     m_worker->add(m_refgray);
 
     m_grayscale_imgs.at(m_refidx) = m_refgray;
+
+    if (!m_load_alignment_file.empty())
+    {
+      m_loaded_alignment = std::make_shared<Task_LoadAlignment>(m_load_alignment_file, m_refidx);
+      m_worker->add(m_loaded_alignment);
+    }
+
+    // Index reassignment applies the same alignment again later
+    if (!m_save_alignment_file.empty() || m_reassign_index)
+    {
+      m_save_alignment = std::make_shared<AlignmentStore>(m_refidx);
+    }
   }
 
   // Construct list of indexes. Perform alignment from reference image outwards.
@@ -305,6 +417,7 @@ void FocusStack::schedule_queue_processing()
     if (i != m_refidx)
     {
       // Schedule image loading
+      if (m_loader) m_loader->add(m_input_images.at(i));
       m_worker->add(m_input_images.at(i));
 
       // Convert image to grayscale
@@ -317,6 +430,16 @@ void FocusStack::schedule_queue_processing()
     m_input_images.at(i)->set_index(i);
     m_grayscale_imgs.at(i)->set_index(i);
 
+    if (m_reassign_index && !m_align_only)
+    {
+      if (m_input_images.at(i)->is_memory_image())
+      {
+        throw std::runtime_error("Index based reassignment needs images that are added as files");
+      }
+
+      m_source_filenames.at(i) = m_input_images.at(i)->filename();
+    }
+
     if (m_save_steps)
     {
       m_worker->add(std::make_shared<Task_SaveImg>("grayscale_" + m_grayscale_imgs.at(i)->basename(),
@@ -339,20 +462,100 @@ void FocusStack::schedule_queue_processing()
                                                      m_aligned_imgs.at(i), m_jpgquality, true));
       }
 
-      schedule_single_image_processing(i);
-      schedule_depthmap_processing(i, false);
+      // Rest of the processing may depend on the tile layout
+      m_pending_images.push_back(i);
+    }
+  }
+
+  m_scheduled_image_count = m_input_images.size();
+  schedule_deferred();
+  release_temporaries();
+}
 
-      if (m_merge_batch.size() >= m_batchsize)
+void FocusStack::schedule_deferred()
+{
+  if (m_pending_images.empty() && !m_final_merge_pending) return;
+  if (!setup_tiles()) return;
+
+  for (int i: m_pending_images)
+  {
+    schedule_single_image_processing(i);
+    schedule_depthmap_processing(i, false);
+
+    if (m_reassign_batch_grays.size() >= m_batchsize)
+    {
+      schedule_batch_merge();
+
+      if (m_preview)
       {
-        schedule_batch_merge();
+        schedule_preview();
       }
     }
   }
+  m_pending_images.clear();
+
+  if (m_final_merge_pending)
+  {
+    m_final_merge_pending = false;
+    schedule_final_merge();
+  }
 
-  m_scheduled_image_count = m_input_images.size();
   release_temporaries();
 }
 
+bool FocusStack::finish_scheduling(int timeout_ms)
+{
+  auto start = std::chrono::steady_clock::now();
+  while (!m_pending_images.empty() || m_final_merge_pending)
+  {
+    if (m_worker->failed())
+    {
+      return true; // Reference image will not be loaded, error is reported by worker
+    }
+
+    // Wait in short steps to notice failures of other tasks
+    if (m_refcolor->wait(100))
+    {
+      schedule_deferred();
+    }
+    else if (timeout_ms >= 0 && std::chrono::steady_clock::now() - start > std::chrono::milliseconds(timeout_ms))
+    {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+bool FocusStack::setup_tiles()
+{
+  if (m_tiles_decided || m_tile_size <= 0 || m_align_only || !m_refcolor)
+  {
+    return true;
+  }
+
+  // Tile layout depends on the image size. Scheduling does not wait for the
+  // reference image, processing that depends on tiles is postponed instead.
+  if (!m_refcolor->is_completed())
+  {
+    return false;
+  }
+
+  m_tiles_decided = true;
+  cv::Size size = m_refcolor->img().size();
+  if (size.area() == 0) return true; // Load failed, error is reported by worker
+
+  std::vector<cv::Rect> tiles = Task_Tile::layout(size, m_tile_size);
+  if (tiles.size() > 1)
+  {
+    m_logger->verbose("Processing %dx%d image in %d tiles\n", size.width, size.height, (int)tiles.size());
+    m_tiles = tiles;
+    m_merges.assign(m_tiles.size(), merge_state_t());
+  }
+
+  return true;
+}
+
 void FocusStack::schedule_alignment(int i)
 {
   // Perform image alignment, against either the reference image or the neighbor image.
@@ -400,6 +603,22 @@ void FocusStack::schedule_alignment(int i)
     aligned = std::make_shared<Task_Align>(m_refgray, m_refcolor, m_refgray, m_refcolor);
   }
 
+  if (m_loaded_alignment && i != m_refidx)
+  {
+    aligned->set_loaded_alignment(m_loaded_alignment);
+  }
+
+  if (m_save_alignment)
+  {
+    aligned->set_save_alignment(m_save_alignment);
+  }
+
+  if (!m_align_only)
+  {
+    // Grayscale conversion of the aligned image is done in the same pass
+    aligned->set_grayscale(m_refgray);
+  }
+
   m_aligned_imgs.at(i) = aligned;
   m_worker->add(aligned);
 }
@@ -409,42 +628,125 @@ void FocusStack::schedule_single_image_processing(int i)
   // Convert aligned image to grayscale again.
   // We could also transform the grayscale images directly, but a new grayscale conversion is faster
   // and results in less difference between the color and grayscale versions.
-  m_aligned_grayscales.at(i) = std::make_shared<Task_Grayscale>(m_aligned_imgs.at(i), m_refgray);
+  // Task_Align does the conversion while the warped rows are still in cache.
+  m_aligned_grayscales.at(i) = std::make_shared<Task_AlignedGrayscale>(m_aligned_imgs.at(i));
   m_worker->add(m_aligned_grayscales.at(i));
   m_reassign_batch_grays.push_back(m_aligned_grayscales.at(i));
   m_reassign_batch_colors.push_back(m_aligned_imgs.at(i));
 
-  // Wavelet transform the image
-  std::shared_ptr<ImgTask> wavelet;
-  if (m_have_opencl)
+  // Wavelet transform the image, or each tile of it
+  for (size_t t = 0; t < m_merges.size(); t++)
   {
-    wavelet = std::make_shared<Task_Wavelet_OpenCL>(m_aligned_grayscales.at(i), false);
-  }
-  else
-  {
-    wavelet = std::make_shared<Task_Wavelet>(m_aligned_grayscales.at(i), false);
+    std::shared_ptr<ImgTask> input = m_aligned_grayscales.at(i);
+    if (!m_tiles.empty())
+    {
+      input = std::make_shared<Task_Tile>(input, m_tiles.at(t), m_tile_size);
+      m_worker->add(input);
+    }
+
+    std::shared_ptr<ImgTask> wavelet;
+    if (m_have_opencl)
+    {
+      wavelet = std::make_shared<Task_Wavelet_OpenCL>(input, false);
+    }
+    else
+    {
+      wavelet = std::make_shared<Task_Wavelet>(input, false);
+    }
+    m_worker->add(wavelet);
+    m_merges.at(t).batch.push_back(wavelet);
   }
-  m_worker->add(wavelet);
-  m_merge_batch.push_back(wavelet);
 }
 
 void FocusStack::schedule_batch_merge()
 {
   // Merge wavelet images accumulated so far
-  m_prev_merge = std::make_shared<Task_Merge>(m_prev_merge, m_merge_batch, m_consistency);
-  m_worker->add(m_prev_merge);
-  m_merge_batch.clear();
+  for (merge_state_t &state: m_merges)
+  {
+    if (!m_merge_tree)
+    {
+      state.prev_merge = std::make_shared<Task_Merge>(state.prev_merge, state.batch, m_consistency);
+      m_worker->add(state.prev_merge);
+    }
+    else if (!state.batch.empty())
+    {
+      std::shared_ptr<Task_Merge> merge = std::make_shared<Task_Merge>(nullptr, state.batch, m_consistency);
+      m_worker->add(merge);
+      state.tree_nodes.push_back(std::make_pair(0, merge));
+      schedule_merge_tree(state, false);
+    }
+    state.batch.clear();
+  }
 
   // And update reassignment map.
   // After this, the aligned images can be unloaded from RAM.
-  m_reassign_map = std::make_shared<Task_Reassign_Map>(m_reassign_batch_grays,
-                                                       m_reassign_batch_colors,
-                                                       m_reassign_map);
-  m_worker->add(m_reassign_map);
+  if (!m_reassign_index)
+  {
+    m_reassign_map = std::make_shared<Task_Reassign_Map>(m_reassign_batch_grays,
+                                                         m_reassign_batch_colors,
+                                                         m_reassign_map,
+                                                         (size_t)m_reassign_memory * 1000000);
+    m_worker->add(m_reassign_map);
+  }
   m_reassign_batch_colors.clear();
   m_reassign_batch_grays.clear();
 }
 
+void FocusStack::schedule_index_reassign()
+{
+  // Find source image candidates for each pixel from the merge results
+  std::vector<std::shared_ptr<ImgTask> > candidate_tiles;
+  for (merge_state_t &state: m_merges)
+  {
+    candidate_tiles.push_back(std::make_shared<Task_Reassign_Candidates>(state.prev_merge));
+    m_worker->add(candidate_tiles.back());
+  }
+
+  std::shared_ptr<ImgTask> candidates = candidate_tiles.front();
+  if (!m_tiles.empty())
+  {
+    candidates = std::make_shared<Task_Stitch>(candidate_tiles, m_tiles, m_tile_size);
+    m_worker->add(candidates);
+  }
+
+  // Decode the source images again one at a time and take the colors from them
+  std::shared_ptr<Task_Reassign_Index> reassign;
+  for (size_t i = 0; i < m_source_filenames.size(); i++)
+  {
+    std::shared_ptr<Task_LoadImg> source = std::make_shared<Task_LoadImg>(m_source_filenames.at(i));
+    source->set_index(i);
+    if (m_loader) m_loader->add(source);
+
+    reassign = std::make_shared<Task_Reassign_Index>(reassign, candidates, m_merged_gray, source,
+                                                     m_save_alignment, m_refgray, m_align_flags);
+    m_worker->add(reassign);
+  }
+
+  m_result_image = reassign;
+}
+
+void FocusStack::schedule_preview()
+{
+  // In tree merge mode, the first node has merged the most batches so far
+  std::vector<std::shared_ptr<ImgTask> > merges;
+  for (const merge_state_t &state: m_merges)
+  {
+    if (!m_merge_tree)
+    {
+      merges.push_back(state.prev_merge);
+    }
+    else if (!state.tree_nodes.empty())
+    {
+      merges.push_back(state.tree_nodes.front().second);
+    }
+  }
+
+  if (merges.size() == m_merges.size())
+  {
+    m_worker->add(std::make_shared<Task_Preview>(merges, m_tiles, m_tile_size, m_preview_size, m_preview));
+  }
+}
+
 void FocusStack::schedule_depthmap_processing(int i, bool is_final)
 {
   if (m_depthmap != "" || m_filename_3dview != "")
@@ -469,6 +771,11 @@ void FocusStack::schedule_depthmap_processing(int i, bool is_final)
 
 void FocusStack::release_temporaries()
 {
+  if (!m_pending_images.empty())
+  {
+    return; // Postponed processing still needs the aligned images
+  }
+
   for (int i = 0; i < m_scheduled_image_count; i++)
   {
     if (i == m_refidx)
@@ -491,6 +798,33 @@ void FocusStack::release_temporaries()
   }
 }
 
+// Batch merges are combined like a binary counter: whenever the two latest
+// results have the same tree level, they are merged to one on the next level.
+// This way the merge depth grows logarithmically with the number of batches.
+void FocusStack::schedule_merge_tree(merge_state_t &state, bool final)
+{
+  std::vector<std::pair<int, std::shared_ptr<Task_Merge> > > &nodes = state.tree_nodes;
+  while (nodes.size() >= 2)
+  {
+    auto right = nodes.back();
+    auto left = nodes.at(nodes.size() - 2);
+
+    if (!final && left.first != right.first)
+      break;
+
+    std::shared_ptr<Task_Merge> merge = std::make_shared<Task_Merge>(left.second, right.second, m_consistency);
+    m_worker->add(merge);
+    nodes.pop_back();
+    nodes.back() = std::make_pair(std::max(left.first, right.first) + 1, merge);
+  }
+
+  if (final && !nodes.empty())
+  {
+    state.prev_merge = nodes.front().second;
+    nodes.clear();
+  }
+}
+
 void FocusStack::schedule_final_merge()
 {
   if (m_align_only) return;
@@ -504,29 +838,50 @@ void FocusStack::schedule_final_merge()
   }
 
   // Merge the final batch of images
-  if (m_merge_batch.size() > 0 || m_reassign_batch_colors.size() > 0)
+  if (m_reassign_batch_colors.size() > 0)
   {
     schedule_batch_merge();
   }
 
-  // Denoise merged image
-  std::shared_ptr<ImgTask> denoised = m_prev_merge;
-  if (m_denoise > 0)
+  std::vector<std::shared_ptr<ImgTask> > merged_tiles;
+  for (merge_state_t &state: m_merges)
   {
-    denoised = std::make_shared<Task_Denoise>(m_prev_merge, m_denoise);
-    m_worker->add(denoised);
+    if (m_merge_tree)
+    {
+      schedule_merge_tree(state, true);
+    }
+
+    // Denoise merged image
+    std::shared_ptr<ImgTask> denoised = state.prev_merge;
+    if (m_denoise > 0)
+    {
+      denoised = std::make_shared<Task_Denoise>(state.prev_merge, m_denoise);
+      m_worker->add(denoised);
+    }
+
+    // Inverse-transform merged image
+    std::shared_ptr<ImgTask> merged;
+    if (!m_have_opencl)
+    {
+      merged = std::make_shared<Task_Wavelet>(denoised, true);
+    }
+    else
+    {
+      merged = std::make_shared<Task_Wavelet_OpenCL>(denoised, true);
+    }
+    m_worker->add(merged);
+    merged_tiles.push_back(merged);
   }
 
-  // Inverse-transform merged image
-  if (!m_have_opencl)
+  if (m_tiles.empty())
   {
-    m_merged_gray = std::make_shared<Task_Wavelet>(denoised, true);
+    m_merged_gray = merged_tiles.front();
   }
   else
   {
-    m_merged_gray = std::make_shared<Task_Wavelet_OpenCL>(denoised, true);
+    m_merged_gray = std::make_shared<Task_Stitch>(merged_tiles, m_tiles, m_tile_size);
+    m_worker->add(m_merged_gray);
   }
-  m_worker->add(m_merged_gray);
 
   if (m_save_steps)
   {
@@ -551,8 +906,15 @@ void FocusStack::schedule_final_merge()
   }
 
   // Reassign pixel values
-  m_result_image = std::make_shared<Task_Reassign>(m_reassign_map, m_merged_gray);
-  m_worker->add(m_result_image);
+  if (m_reassign_index)
+  {
+    schedule_index_reassign();
+  }
+  else
+  {
+    m_result_image = std::make_shared<Task_Reassign>(m_reassign_map, m_merged_gray);
+    m_worker->add(m_result_image);
+  }
 
   // Save 3D preview
   if (m_filename_3dview != "")
@@ -7,6 +7,7 @@
 #include <unordered_set>
 #include <memory>
 #include <functional>
+#include <cstdint>
 #include <opencv2/core/core.hpp>
 
 namespace focusstack {
@@ -17,6 +18,10 @@ class Task_Merge;
 class Task_Align;
 class Task_Reassign_Map;
 class Task_Depthmap;
+class Task_LoadAlignment;
+class AlignmentStore;
+class PreviewPublisher;
+class ImageLoader;
 class Worker;
 class ImgTask;
 class Logger;
@@ -34,6 +39,7 @@ public:
     ALIGN_FULL_RESOLUTION     = 0x04,
     ALIGN_GLOBAL              = 0x08,
     ALIGN_KEEP_SIZE           = 0x10,
+    ALIGN_PHASE_CORRELATION   = 0x20,
   };
 
   enum log_level_t
@@ -44,6 +50,34 @@ public:
       LOG_ERROR = 40
   };
 
+  enum scheduler_t
+  {
+    SCHEDULER_SHARED          = 0, // All threads share one queue of ready tasks
+    SCHEDULER_STEALING        = 1, // Per-thread work-stealing queues
+  };
+
+  // Performance statistics for one type of processing step
+  struct stage_statistics_t
+  {
+    std::string name;     // Task class name, e.g. Task_Align
+    int count;            // Number of tasks run
+    double wall_total;    // Total run time in seconds
+    double wall_max;      // Run time of the slowest task in seconds
+    double cpu_total;     // CPU time used by the threads running the tasks, in seconds
+    int64_t result_bytes; // Total size of the results
+    double megapixels;    // Total size of the result images
+
+    double wall_mean() const { return count ? wall_total / count : 0; }
+    double megapixels_per_s() const { return wall_total > 0 ? megapixels / wall_total : 0; }
+  };
+
+  struct statistics_t
+  {
+    double wall_time;     // Seconds from start until the last task finished
+    int64_t peak_memory;  // Peak memory used by task results, in bytes
+    std::vector<stage_statistics_t> stages; // Sorted by total run time, largest first
+  };
+
   void set_inputs(const std::vector<std::string> &files) { m_inputs = files; }
   void set_output(std::string output) { m_output = output; }
   std::string get_output() const { return m_output; }
@@ -62,13 +96,41 @@ public:
   void set_align_only(bool align_only) { m_align_only = align_only; }
   void set_verbose(bool verbose);
   void set_threads(int threads) { m_threads = threads; }
+  void set_scheduler(scheduler_t scheduler) { m_scheduler = scheduler; }
+  void set_max_memory(int megabytes) { m_max_memory = megabytes; }
+
+  // Limit the size of the color reassignment map, 0 for the default
+  // limit of entries per pixel.
+  void set_reassign_memory(int megabytes) { m_reassign_memory = megabytes; }
+
+  // Reassign colors by decoding the source images again at the end, instead
+  // of building the color reassignment map. Needs images added as files.
+  void set_reassign_index(bool reassign_index) { m_reassign_index = reassign_index; }
+
+  // Decode input images in separate threads, ahead of the processing.
+  // 0 loads them in the worker threads. Not used when waiting for images.
+  void set_load_threads(int threads) { m_load_threads = threads; }
+  void set_trace(std::string filename) { m_trace = filename; }
   void set_batchsize(int batchsize) { m_batchsize = batchsize; }
+  void set_merge_tree(bool merge_tree) { m_merge_tree = merge_tree; }
+
+  // Process images larger than tile_size in overlapping tiles, 0 to disable.
+  // The tiles are decided when the reference image has been loaded. Until
+  // then, processing of added images after alignment is postponed.
+  void set_tile_size(int tile_size) { m_tile_size = tile_size; }
   void set_reference(int refidx) { m_reference = refidx; }
   void set_jpgquality(int level) { m_jpgquality = level; }
   void set_consistency(int level) { m_consistency = level; }
   void set_denoise(float level) { m_denoise = level; }
   void set_wait_images(float seconds) { m_wait_images = seconds; }
   void set_align_flags(int flags) { m_align_flags = static_cast<align_flags_t>(flags); }
+
+  // Save alignment results to a file when processing is done, or load them from
+  // an earlier run instead of aligning again. Images that are missing from the
+  // loaded file are aligned normally. The file format is decided by the extension
+  // (.yml, .xml or .json) and the reference image must be the same in both runs.
+  void set_save_alignment(std::string filename) { m_save_alignment_file = filename; }
+  void set_load_alignment(std::string filename) { m_load_alignment_file = filename; }
   void set_3dviewpoint(float x, float y, float z, float zscale) { m_3dviewpoint = cv::Vec3f(x,y,z); m_3dzscale = zscale; }
   void set_3dviewpoint(std::string value) {
     std::istringstream is(value);
@@ -81,6 +143,13 @@ public:
     is >> m_3dzscale;
   }
 
+  // Generate a grayscale preview of the merge result after each merge batch,
+  // downscaled to at most max_size pixels. Previews have low priority and a
+  // preview is skipped if a newer one is scheduled before it starts.
+  // The callback is called from worker threads, but only one at a time.
+  // Call before start(), max_size 0 disables previews.
+  void set_preview(int max_size, std::function<void(const cv::Mat &preview)> callback = nullptr);
+
   // Set callback function to use for log messages.
   // Note that callbacks may come from any thread, but only one at a time.
   void set_log_callback(std::function<void(log_level_t level, std::string)> callback);
@@ -113,6 +182,12 @@ public:
   const cv::Mat &get_result_mask() const;
   const cv::Mat &get_result_3dview() const;
 
+  // Latest preview image, or empty image if none is available yet.
+  cv::Mat get_preview_image() const;
+
+  // Performance statistics of the tasks run so far
+  statistics_t get_statistics() const;
+
   // Regenerate some of the results with altered settings
   void regenerate_depthmap();
   void regenerate_mask();
@@ -139,31 +214,56 @@ private:
   float m_3dzscale;
 
   int m_threads;
+  scheduler_t m_scheduler;
+  int m_max_memory;
+  int m_reassign_memory;
+  bool m_reassign_index;
+  int m_load_threads;
+  std::string m_trace;
+  std::string m_save_alignment_file;
+  std::string m_load_alignment_file;
   int m_batchsize;
+  bool m_merge_tree;
+  int m_tile_size;
   int m_reference;
   int m_consistency;
   int m_jpgquality;
   float m_denoise;
   float m_wait_images;
+  int m_preview_size;
+  std::function<void(const cv::Mat &preview)> m_preview_callback;
 
   // Runtime variables
   bool m_have_opencl;
   int m_scheduled_image_count;
   int m_refidx;
   std::unique_ptr<Worker> m_worker;
+  std::shared_ptr<ImageLoader> m_loader; // Must be destroyed before m_worker
   std::vector<std::shared_ptr<Task_LoadImg> > m_input_images; // Queued input images
   std::vector<std::shared_ptr<ImgTask> > m_grayscale_imgs;
   std::vector<std::shared_ptr<Task_Align> > m_aligned_imgs;
   std::vector<std::shared_ptr<ImgTask> > m_aligned_grayscales;
+  std::vector<std::string> m_source_filenames; // For decoding again in index reassignment
   std::shared_ptr<Task_LoadImg> m_refcolor; // Alignment reference image
   std::shared_ptr<Task_Grayscale> m_refgray; // Grayscaled reference image
-  std::shared_ptr<Task_Merge> m_prev_merge;
+  std::vector<cv::Rect> m_tiles; // Tile areas, empty if not processing in tiles
+  bool m_tiles_decided; // Tile layout is known, set when the reference image has loaded
+  std::vector<int> m_pending_images; // Images waiting for the tile layout
+  bool m_final_merge_pending; // Final merge is waiting for the tile layout
+  std::shared_ptr<Task_LoadAlignment> m_loaded_alignment;
+  std::shared_ptr<AlignmentStore> m_save_alignment;
 
   // Depthmap building
   std::shared_ptr<Task_Depthmap> m_latest_depthmap;
 
-  // Final image merging
-  std::vector<std::shared_ptr<ImgTask> > m_merge_batch;
+  // Final image merging, separately for each tile
+  struct merge_state_t
+  {
+    std::vector<std::shared_ptr<ImgTask> > batch;
+    std::shared_ptr<Task_Merge> prev_merge;
+    std::vector<std::pair<int, std::shared_ptr<Task_Merge> > > tree_nodes; // Pairs of (tree level, merge)
+  };
+  std::vector<merge_state_t> m_merges; // One per tile, or one for whole image
   std::vector<std::shared_ptr<ImgTask> > m_reassign_batch_grays;
   std::vector<std::shared_ptr<ImgTask> > m_reassign_batch_colors;
   std::shared_ptr<Task_Reassign_Map> m_reassign_map;
@@ -174,12 +274,22 @@ private:
   std::shared_ptr<ImgTask> m_result_depthmap;
   std::shared_ptr<ImgTask> m_result_fg_mask;
   std::shared_ptr<ImgTask> m_result_3dview;
+  std::shared_ptr<PreviewPublisher> m_preview;
 
   // Queue worker tasks for new images in m_input_images
   void schedule_queue_processing();
+  bool setup_tiles(); // Returns false if the layout is not known yet
+  void schedule_deferred(); // Schedule processing that was waiting for the tile layout
+  bool finish_scheduling(int timeout_ms); // Wait until deferred processing is scheduled
   void schedule_alignment(int i);
   void schedule_single_image_processing(int i);
   void schedule_batch_merge();
+  void schedule_index_reassign();
+  void schedule_preview();
+
+  // Combine merge results pairwise when using tree merge.
+  // If final is true, combines everything to state.prev_merge.
+  void schedule_merge_tree(merge_state_t &state, bool final);
   void schedule_depthmap_processing(int i, bool is_final);
 
   // Release temporary images that are no longer needed
@@ -0,0 +1,129 @@
+#include <gtest/gtest.h>
+#include <cstdio>
+#include <fstream>
+#include <random>
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc.hpp>
+#include "focusstack.hh"
+#include "task_align.hh"
+
+namespace focusstack {
+
+// Random color texture, shifted by dx pixels
+static cv::Mat make_image(cv::Size size, float dx)
+{
+  std::mt19937 rng(1);
+  std::uniform_int_distribution<int> dist(0, 255);
+  cv::Mat noise(size, CV_8UC3);
+  for (int y = 0; y < size.height; y++)
+  {
+    for (int x = 0; x < size.width * 3; x++)
+    {
+      noise.ptr<uint8_t>(y)[x] = dist(rng);
+    }
+  }
+
+  cv::Mat img;
+  cv::GaussianBlur(noise, img, cv::Size(0, 0), 2);
+  cv::normalize(img, img, 0, 255, cv::NORM_MINMAX);
+
+  cv::Mat m(2, 3, CV_32F);
+  m = 0.0f;
+  m.at<float>(0, 0) = 1.0f;
+  m.at<float>(1, 1) = 1.0f;
+  m.at<float>(0, 2) = dx;
+  cv::Mat result;
+  cv::warpAffine(img, result, m, size, cv::INTER_CUBIC, cv::BORDER_REFLECT);
+  return result;
+}
+
+static void expect_same_alignment(const AlignmentStore &a, const AlignmentStore &b, int index)
+{
+  cv::Mat t1, c1, w1, t2, c2, w2;
+  ASSERT_TRUE(a.get(index, t1, c1, w1)) << "index " << index;
+  ASSERT_TRUE(b.get(index, t2, c2, w2)) << "index " << index;
+  EXPECT_EQ(cv::norm(t1, t2, cv::NORM_INF), 0.0) << "index " << index;
+  EXPECT_EQ(cv::norm(c1, c2, cv::NORM_INF), 0.0) << "index " << index;
+  EXPECT_EQ(cv::norm(w1, w2, cv::NORM_INF), 0.0) << "index " << index;
+}
+
+// The blocking run() should write the alignment file, and the file should load back.
+TEST(FocusStack, SaveAlignment) {
+  const int count = 3;
+  const char *alignment_file = "focusstack_tests_alignment.yml";
+  const char *copy_file = "focusstack_tests_alignment_copy.yml";
+  const char *output_file = "focusstack_tests_output.jpg";
+  std::vector<std::string> filenames;
+  for (int i = 0; i < count; i++)
+  {
+    filenames.push_back("focusstack_tests_" + std::to_string(i) + ".png");
+    cv::imwrite(filenames.back(), make_image(cv::Size(320, 240), 2.0f * i));
+  }
+  std::remove(alignment_file);
+
+  FocusStack stack;
+  stack.set_inputs(filenames);
+  stack.set_output(output_file);
+  stack.set_reference(0);
+  stack.set_save_alignment(alignment_file);
+  bool status = stack.run();
+
+  for (const std::string &filename: filenames)
+  {
+    std::remove(filename.c_str());
+  }
+  std::remove(output_file);
+  ASSERT_TRUE(status);
+  ASSERT_TRUE(std::ifstream(alignment_file).good());
+
+  AlignmentStore loaded(0);
+  loaded.load(alignment_file);
+  loaded.save(copy_file);
+  AlignmentStore reloaded(0);
+  reloaded.load(copy_file);
+  std::remove(alignment_file);
+  std::remove(copy_file);
+
+  // The reference image is not stored
+  cv::Mat transformation, contrast, whitebalance;
+  EXPECT_FALSE(loaded.get(0, transformation, contrast, whitebalance));
+  for (int i = 1; i < count; i++)
+  {
+    expect_same_alignment(loaded, reloaded, i);
+  }
+}
+
+// Index based reassignment decodes the images again, so they must be files.
+TEST(FocusStack, ReassignIndexNeedsFiles) {
+  cv::Size size(160, 120);
+  FocusStack memstack;
+  memstack.set_reassign_index(true);
+  memstack.add_image(make_image(size, 0.0f));
+  memstack.add_image(make_image(size, 2.0f));
+  EXPECT_THROW(memstack.start(), std::runtime_error);
+
+  const int count = 2;
+  const char *output_file = "focusstack_tests_output.jpg";
+  std::vector<std::string> filenames;
+  for (int i = 0; i < count; i++)
+  {
+    filenames.push_back("focusstack_tests_" + std::to_string(i) + ".png");
+    cv::imwrite(filenames.back(), make_image(size, 2.0f * i));
+  }
+
+  FocusStack filestack;
+  filestack.set_inputs(filenames);
+  filestack.set_output(output_file);
+  filestack.set_reassign_index(true);
+  bool status = false;
+  EXPECT_NO_THROW(status = filestack.run());
+
+  for (const std::string &filename: filenames)
+  {
+    std::remove(filename.c_str());
+  }
+  std::remove(output_file);
+  EXPECT_TRUE(status);
+}
+
+}
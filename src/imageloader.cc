@@ -0,0 +1,75 @@
+#include "imageloader.hh"
+#include "task_loadimg.hh"
+
+using namespace focusstack;
+
+ImageLoader::ImageLoader(int threads, int window, std::function<void()> on_ready):
+  m_window(window), m_pending(0), m_closed(false), m_on_ready(on_ready)
+{
+  for (int i = 0; i < threads; i++)
+  {
+    m_threads.emplace_back(&ImageLoader::thread_main, this);
+  }
+}
+
+ImageLoader::~ImageLoader()
+{
+  {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_closed = true;
+    m_wakeup.notify_all();
+  }
+
+  for (std::thread &thread: m_threads)
+  {
+    thread.join();
+  }
+}
+
+void ImageLoader::add(std::shared_ptr<Task_LoadImg> task)
+{
+  task->set_loader(shared_from_this());
+
+  std::unique_lock<std::mutex> lock(m_mutex);
+  m_queue.push_back(task);
+  m_wakeup.notify_one();
+}
+
+void ImageLoader::consumed()
+{
+  std::unique_lock<std::mutex> lock(m_mutex);
+  m_pending--;
+  m_wakeup.notify_one();
+}
+
+void ImageLoader::thread_main()
+{
+  while (true)
+  {
+    std::shared_ptr<Task_LoadImg> task;
+
+    {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      while (!m_closed && (m_queue.empty() || m_pending >= m_window))
+      {
+        m_wakeup.wait(lock);
+      }
+
+      if (m_closed)
+      {
+        return;
+      }
+
+      task = m_queue.front();
+      m_queue.pop_front();
+      m_pending++;
+    }
+
+    task->prefetch();
+
+    if (m_on_ready)
+    {
+      m_on_ready();
+    }
+  }
+}
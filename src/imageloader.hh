@@ -0,0 +1,46 @@
+// Decodes input images in dedicated threads, ahead of the processing.
+// This overlaps file reading and decoding with the computation in worker
+// threads, while limiting how many decoded images can wait to be used.
+
+#pragma once
+#include <memory>
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+namespace focusstack {
+
+class Task_LoadImg;
+
+class ImageLoader: public std::enable_shared_from_this<ImageLoader>
+{
+public:
+  // At most window images are decoded before their load task has run.
+  // The on_ready callback is called from loader threads after each image.
+  ImageLoader(int threads, int window, std::function<void()> on_ready);
+  ~ImageLoader();
+
+  // Add load task to the end of the queue. Images are decoded in the order
+  // they are added, which should be the order the processing needs them.
+  void add(std::shared_ptr<Task_LoadImg> task);
+
+  // Called by load task when it has taken the decoded image into use.
+  void consumed();
+
+private:
+  void thread_main();
+
+  std::mutex m_mutex;
+  std::condition_variable m_wakeup;
+  std::deque<std::shared_ptr<Task_LoadImg> > m_queue;
+  int m_window;
+  int m_pending; // Decoded or being decoded, but not yet consumed
+  bool m_closed;
+  std::function<void()> m_on_ready;
+  std::vector<std::thread> m_threads;
+};
+
+}
@@ -1,4 +1,5 @@
 #include <iostream>
+#include <cstdio>
 #include "options.hh"
 #include "focusstack.hh"
 #include <opencv2/core.hpp>
@@ -9,6 +10,51 @@
 
 using namespace focusstack;
 
+// Print per-stage performance statistics as a table
+static void print_statistics(const FocusStack::statistics_t &stats)
+{
+  std::printf("\n%-24s %6s %9s %9s %9s %9s %10s %9s\n",
+              "Stage", "Count", "Total s", "Mean s", "Max s", "CPU s", "Result MB", "MP/s");
+
+  for (const FocusStack::stage_statistics_t &stage: stats.stages)
+  {
+    std::printf("%-24s %6d %9.3f %9.3f %9.3f %9.3f %10.1f %9.1f\n",
+                stage.name.c_str(), stage.count, stage.wall_total, stage.wall_mean(), stage.wall_max,
+                stage.cpu_total, stage.result_bytes / 1e6, stage.megapixels_per_s());
+  }
+
+  std::printf("Total time %0.3f s, peak memory use %0.1f MB\n", stats.wall_time, stats.peak_memory / 1e6);
+}
+
+// Write per-stage performance statistics as JSON
+static bool write_statistics_json(const FocusStack::statistics_t &stats, std::string filename)
+{
+  FILE *f = std::fopen(filename.c_str(), "w");
+  if (!f)
+  {
+    return false;
+  }
+
+  std::fprintf(f, "{\n  \"wall_time\": %0.6f,\n  \"peak_memory\": %lld,\n  \"stages\": [",
+               stats.wall_time, (long long)stats.peak_memory);
+
+  for (size_t i = 0; i < stats.stages.size(); i++)
+  {
+    const FocusStack::stage_statistics_t &stage = stats.stages.at(i);
+    std::fprintf(f, "%s\n    {\"name\": \"%s\", \"count\": %d, \"wall_total\": %0.6f, \"wall_mean\": %0.6f, "
+                    "\"wall_max\": %0.6f, \"cpu_total\": %0.6f, \"result_bytes\": %lld, "
+                    "\"megapixels\": %0.3f, \"megapixels_per_s\": %0.3f}",
+                 i ? "," : "", stage.name.c_str(), stage.count, stage.wall_total, stage.wall_mean(),
+                 stage.wall_max, stage.cpu_total, (long long)stage.result_bytes,
+                 stage.megapixels, stage.megapixels_per_s());
+  }
+
+  std::fprintf(f, "\n  ]\n}\n");
+
+  bool ok = !std::ferror(f);
+  return (std::fclose(f) == 0) && ok;
+}
+
 int main(int argc, const char *argv[])
 {
   Options options(argc, argv);
@@ -63,6 +109,9 @@ int main(int argc, const char *argv[])
                  "  --reference=0                 Set index of image used as alignment reference (default middle one)\n"
                  "  --global-align                Align directly against reference (default with neighbour image)\n"
                  "  --full-resolution-align       Use full resolution images in alignment (default max 2048 px)\n"
+                 "  --phase-align                 Estimate large shifts with phase correlation before alignment\n"
+                 "  --save-alignment=align.yml    Save alignment results to a file for later runs\n"
+                 "  --load-alignment=align.yml    Use alignment results from an earlier run\n"
                  "  --no-whitebalance             Don't attempt to correct white balance differences\n"
                  "  --no-contrast                 Don't attempt to correct contrast and exposure differences\n"
                  "  --align-only                  Only align the input image stack and exit\n"
@@ -83,11 +132,21 @@ int main(int argc, const char *argv[])
     std::cerr << "Performance options:\n"
                  "  --threads=2                   Select number of threads to use (default number of CPUs + 1)\n"
                  "  --batchsize=8                 Images per merge batch (default 8)\n"
+                 "  --merge-tree                  Merge batches pairwise in parallel (default sequentially)\n"
+                 "  --tile-size=2048              Process large images in tiles of this size (default whole image)\n"
+                 "  --scheduler=shared            Task scheduler: shared or stealing (default shared)\n"
+                 "  --max-memory=4000             Limit memory used for image data in megabytes (default unlimited)\n"
+                 "  --reassign-index              Decode images again for color reassignment instead of keeping a color map\n"
+                 "  --reassign-memory=1000        Limit memory used for color reassignment map in megabytes (default 256 bytes per pixel)\n"
+                 "  --load-threads=2              Decode images in separate threads ahead of processing (default 0)\n"
                  "  --no-opencl                   Disable OpenCL GPU acceleration (default enabled)\n"
                  "  --wait-images=0.0             Wait for image files to appear (allows simultaneous capture and processing)\n";
     std::cerr << "\n";
     std::cerr << "Information options:\n"
                  "  --verbose                     Verbose output from steps\n"
+                 "  --trace=run.json              Save timeline of processing steps in Chrome trace format\n"
+                 "  --stats                       Print performance statistics of processing steps\n"
+                 "  --stats-json=stats.json       Save performance statistics of processing steps as JSON\n"
                  "  --version                     Show application version number\n"
                  "  --opencv-version              Show OpenCV library version and build info\n";
     return 1;
@@ -109,7 +168,10 @@ int main(int argc, const char *argv[])
   if (options.has_flag("--no-whitebalance"))          flags |= FocusStack::ALIGN_NO_WHITEBALANCE;
   if (options.has_flag("--no-contrast"))              flags |= FocusStack::ALIGN_NO_CONTRAST;
   if (options.has_flag("--align-keep-size"))          flags |= FocusStack::ALIGN_KEEP_SIZE;
+  if (options.has_flag("--phase-align"))              flags |= FocusStack::ALIGN_PHASE_CORRELATION;
   stack.set_align_flags(flags);
+  stack.set_save_alignment(options.get_arg("--save-alignment", ""));
+  stack.set_load_alignment(options.get_arg("--load-alignment", ""));
 
   if (options.has_flag("--reference"))
   {
@@ -145,11 +207,49 @@ int main(int argc, const char *argv[])
     stack.set_batchsize(std::stoi(options.get_arg("--batchsize")));
   }
 
+  stack.set_merge_tree(options.has_flag("--merge-tree"));
+
+  if (options.has_flag("--tile-size"))
+  {
+    stack.set_tile_size(std::stoi(options.get_arg("--tile-size")));
+  }
+
+  if (options.has_flag("--max-memory"))
+  {
+    stack.set_max_memory(std::stoi(options.get_arg("--max-memory")));
+  }
+
+  stack.set_reassign_index(options.has_flag("--reassign-index"));
+
+  if (options.has_flag("--reassign-memory"))
+  {
+    stack.set_reassign_memory(std::stoi(options.get_arg("--reassign-memory")));
+  }
+
+  if (options.has_flag("--load-threads"))
+  {
+    stack.set_load_threads(std::stoi(options.get_arg("--load-threads")));
+  }
+
+  std::string scheduler = options.get_arg("--scheduler", "shared");
+  if (scheduler == "stealing")
+  {
+    stack.set_scheduler(FocusStack::SCHEDULER_STEALING);
+  }
+  else if (scheduler != "shared")
+  {
+    std::cerr << "Unknown scheduler: " << scheduler << std::endl;
+    return 1;
+  }
+
   stack.set_disable_opencl(options.has_flag("--no-opencl"));
   stack.set_wait_images(std::stof(options.get_arg("--wait-images", "0.0")));
 
   // Information options (some are handled at beginning of this function)
   stack.set_verbose(options.has_flag("--verbose"));
+  stack.set_trace(options.get_arg("--trace", ""));
+  bool print_stats = options.has_flag("--stats");
+  std::string stats_json = options.get_arg("--stats-json", "");
 
   // Check for any unhandled options
   std::vector<std::string> unparsed = options.get_unparsed();
@@ -163,8 +263,20 @@ int main(int argc, const char *argv[])
     std::cerr << std::endl;
   }
 
+  bool status = stack.run();
+
+  if (print_stats)
+  {
+    print_statistics(stack.get_statistics());
+  }
+
+  if (stats_json != "" && !write_statistics_json(stack.get_statistics(), stats_json))
+  {
+    std::cerr << "Could not write statistics to " << stats_json << std::endl;
+    return 1;
+  }
 
-  if (!stack.run())
+  if (!status)
   {
     std::printf("\nError exit due to failed steps\n");
     return 1;
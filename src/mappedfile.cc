@@ -0,0 +1,70 @@
+#include "mappedfile.hh"
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+using namespace focusstack;
+
+#ifdef _WIN32
+
+MappedFile::MappedFile(const std::string &filename):
+  m_data(nullptr), m_size(0), m_file(INVALID_HANDLE_VALUE), m_mapping(nullptr)
+{
+  m_file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+                       OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+  if (m_file == INVALID_HANDLE_VALUE) return;
+
+  LARGE_INTEGER size;
+  if (!GetFileSizeEx(m_file, &size) || size.QuadPart == 0) return;
+
+  m_mapping = CreateFileMappingA(m_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+  if (!m_mapping) return;
+
+  m_data = static_cast<const uint8_t*>(MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0));
+  if (m_data) m_size = (size_t)size.QuadPart;
+}
+
+MappedFile::~MappedFile()
+{
+  if (m_data) UnmapViewOfFile(m_data);
+  if (m_mapping) CloseHandle(m_mapping);
+  if (m_file != INVALID_HANDLE_VALUE) CloseHandle(m_file);
+}
+
+#else
+
+MappedFile::MappedFile(const std::string &filename):
+  m_data(nullptr), m_size(0)
+{
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0) return;
+
+  struct stat st;
+  if (fstat(fd, &st) == 0 && st.st_size > 0)
+  {
+    void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p != MAP_FAILED)
+    {
+      madvise(p, st.st_size, MADV_SEQUENTIAL);
+      m_data = static_cast<const uint8_t*>(p);
+      m_size = st.st_size;
+    }
+  }
+
+  // Mapping stays valid after closing the descriptor
+  close(fd);
+}
+
+MappedFile::~MappedFile()
+{
+  if (m_data) munmap(const_cast<uint8_t*>(m_data), m_size);
+}
+
+#endif
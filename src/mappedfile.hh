@@ -0,0 +1,36 @@
+// Read-only memory mapping of a file.
+// Lets image data be decoded directly from the page cache without
+// first reading it into a separate buffer.
+
+#pragma once
+#include <string>
+#include <cstddef>
+#include <cstdint>
+
+namespace focusstack {
+
+class MappedFile
+{
+public:
+  // If the file cannot be opened or mapped, is_open() returns false.
+  MappedFile(const std::string &filename);
+  ~MappedFile();
+
+  MappedFile(const MappedFile&) = delete;
+  MappedFile &operator=(const MappedFile&) = delete;
+
+  bool is_open() const { return m_data != nullptr; }
+  const uint8_t *data() const { return m_data; }
+  size_t size() const { return m_size; }
+
+private:
+  const uint8_t *m_data;
+  size_t m_size;
+
+#ifdef _WIN32
+  void *m_file;
+  void *m_mapping;
+#endif
+};
+
+}
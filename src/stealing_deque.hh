@@ -0,0 +1,141 @@
+// Lock-free work-stealing deque (Chase & Lev, "Dynamic Circular Work-Stealing Deque").
+// The owner thread pushes and pops at the bottom, other threads steal from the top.
+// Memory ordering follows Le et al., "Correct and Efficient Work-Stealing for
+// Weak Memory Models", except that push() uses a release store instead of a
+// release fence, which is equivalent and understood by thread sanitizers.
+
+#pragma once
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <cstdint>
+
+namespace focusstack {
+
+template <typename T>
+class StealingDeque
+{
+public:
+  // Initial size must be a power of two
+  StealingDeque(int initial_size = 256):
+    m_top(0), m_bottom(0)
+  {
+    m_buffers.emplace_back(new Buffer(initial_size));
+    m_buffer.store(m_buffers.back().get(), std::memory_order_relaxed);
+  }
+
+  // Add item at the bottom. Only the owner thread may call this.
+  void push(T *item)
+  {
+    int64_t b = m_bottom.load(std::memory_order_relaxed);
+    int64_t t = m_top.load(std::memory_order_acquire);
+    Buffer *buf = m_buffer.load(std::memory_order_relaxed);
+
+    if (b - t > buf->size() - 1)
+    {
+      buf = grow(buf, t, b);
+    }
+
+    buf->put(b, item);
+    m_bottom.store(b + 1, std::memory_order_release);
+  }
+
+  // Take the most recently pushed item. Only the owner thread may call this.
+  // Returns nullptr if the deque is empty.
+  T *pop()
+  {
+    int64_t b = m_bottom.load(std::memory_order_relaxed) - 1;
+    Buffer *buf = m_buffer.load(std::memory_order_relaxed);
+    m_bottom.store(b, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t t = m_top.load(std::memory_order_relaxed);
+
+    T *item = nullptr;
+    if (t <= b)
+    {
+      item = buf->get(b);
+
+      if (t == b)
+      {
+        // Last item, race against stealers
+        if (!m_top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+        {
+          item = nullptr;
+        }
+        m_bottom.store(b + 1, std::memory_order_relaxed);
+      }
+    }
+    else
+    {
+      m_bottom.store(b + 1, std::memory_order_relaxed);
+    }
+
+    return item;
+  }
+
+  // Take the oldest item. Can be called from any thread.
+  // Returns nullptr if the deque is empty or another thread won the race.
+  T *steal()
+  {
+    int64_t t = m_top.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t b = m_bottom.load(std::memory_order_acquire);
+
+    if (t < b)
+    {
+      Buffer *buf = m_buffer.load(std::memory_order_acquire);
+      T *item = buf->get(t);
+
+      if (m_top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+      {
+        return item;
+      }
+    }
+
+    return nullptr;
+  }
+
+  // Check if deque is empty, can be called from any thread.
+  // The result may be outdated by the time it returns.
+  bool empty() const
+  {
+    int64_t b = m_bottom.load(std::memory_order_relaxed);
+    int64_t t = m_top.load(std::memory_order_relaxed);
+    return b <= t;
+  }
+
+private:
+  class Buffer
+  {
+  public:
+    Buffer(int64_t size): m_mask(size - 1), m_items(new std::atomic<T*>[size]) {}
+    int64_t size() const { return m_mask + 1; }
+    T *get(int64_t i) const { return m_items[i & m_mask].load(std::memory_order_relaxed); }
+    void put(int64_t i, T *item) { m_items[i & m_mask].store(item, std::memory_order_relaxed); }
+
+  private:
+    int64_t m_mask;
+    std::unique_ptr<std::atomic<T*>[]> m_items;
+  };
+
+  // Replace buffer with one twice the size. The old buffers are kept until
+  // the deque is destroyed, because stealers may still be reading them.
+  Buffer *grow(Buffer *old, int64_t t, int64_t b)
+  {
+    Buffer *buf = new Buffer(old->size() * 2);
+    for (int64_t i = t; i < b; i++)
+    {
+      buf->put(i, old->get(i));
+    }
+    m_buffers.emplace_back(buf);
+    m_buffer.store(buf, std::memory_order_release);
+    return buf;
+  }
+
+  std::atomic<int64_t> m_top;
+  std::atomic<int64_t> m_bottom;
+  std::atomic<Buffer*> m_buffer;
+  std::vector<std::unique_ptr<Buffer> > m_buffers; // Accessed only by owner thread
+};
+
+}
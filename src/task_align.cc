@@ -5,6 +5,8 @@
 #include <opencv2/video.hpp>
 #include <opencv2/core/utility.hpp>
 #include <opencv2/core/ocl.hpp>
+#include <opencv2/core/hal/intrin.hpp>
+#include "task_grayscale.hh"
 #include <cmath>
 #include <cstdio>
 
@@ -56,80 +58,64 @@ Task_Align::Task_Align(std::shared_ptr<ImgTask> refgray, std::shared_ptr<ImgTask
   m_whitebalance.at<float>(5, 0) = 1.0f;
 }
 
-void Task_Align::task()
+size_t Task_Align::estimate_result_bytes() const
 {
-  if (m_refcolor == m_srccolor)
+  const cv::Mat &src = m_srccolor->img();
+  return src.total() * src.elemSize();
+}
+
+void Task_Align::set_grayscale(std::shared_ptr<Task_Grayscale> weights)
+{
+  m_grayscale_weights = weights;
+  m_depends_on.push_back(weights);
+}
+
+cv::Mat Task_Align::release_grayscale()
+{
+  cv::Mat gray = m_grayscale;
+  m_grayscale.release();
+  return gray;
+}
+
+cv::Mat Task_Align::grayscale_weights() const
+{
+  if (m_grayscale_weights)
   {
-    m_result = m_srccolor->img();
+    return m_grayscale_weights->weights();
   }
   else
   {
-    if (m_initial_guess)
-    {
-      m_initial_guess->m_transformation.copyTo(m_transformation);
-    }
-
-    // Mask off the reflected borders generated by Task_LoadImg.
-    m_roi = m_srcgray->valid_area();
-
-    // Perform low resolution initial geometric alignment
-    match_transform(256, true);
-
-    // Perform grayscale brightness alignment
-    if (!(m_flags & FocusStack::ALIGN_NO_CONTRAST))
-    {
-      match_contrast();
-    }
+    return cv::Mat();
+  }
+}
 
-    // Perform color/whit balance alignment
-    if (!(m_flags & FocusStack::ALIGN_NO_WHITEBALANCE) && m_srccolor->img().channels() == 3)
-    {
-      match_whitebalance();
-    }
+void Task_Align::set_loaded_alignment(std::shared_ptr<Task_LoadAlignment> loaded)
+{
+  m_loaded_alignment = loaded;
+  m_depends_on.push_back(loaded);
+}
 
-    // Finally, do the high resolution geometric alignment step
-    if (m_flags & FocusStack::ALIGN_FULL_RESOLUTION)
-    {
-      int res = std::max(m_srccolor->img().cols, m_srccolor->img().rows);
-      match_transform(res, false);
-    }
-    else
+void Task_Align::task()
+{
+  if (m_refcolor == m_srccolor)
+  {
+    warp_and_correct(m_srccolor->img(), m_result, cv::Mat(), cv::Mat(), cv::Mat(),
+                     grayscale_weights(), m_grayscale_weights ? &m_grayscale : nullptr);
+  }
+  else
+  {
+    // Loaded alignment is only valid for the same image
+    std::string loaded_name = m_loaded_alignment ? m_loaded_alignment->alignment().name(m_index) : "";
+    if (!loaded_name.empty() && loaded_name != m_srccolor->basename())
     {
-      // By default limit image resolution used in alignment to 2k.
-      // Because this uses subpixel positioning, higher resolution provides little benefit.
-      match_transform(2048, false);
+      m_logger->info("Alignment file has %s instead of %s at index %d, computing alignment\n",
+                     loaded_name.c_str(), m_srccolor->basename().c_str(), m_index);
+      m_loaded_alignment.reset();
     }
 
-    // The image is now aligned against the neighbour image.
-    // Now we can compute the alignment against the global reference image.
-    if (m_stacked_transform)
+    if (!(m_loaded_alignment && m_loaded_alignment->alignment().get(m_index, m_transformation, m_contrast, m_whitebalance)))
     {
-      // At this point we need to know the stacked transform to apply it to the final image.
-      // Not putting this in m_depends_on gives better parallelism in the alignment phase.
-      m_stacked_transform->wait();
-      cv::Mat tmp = m_stacked_transform->m_transformation.clone();
-      tmp.resize(3, 0.0f);
-      tmp.at<float>(2, 2) = 1.0f;
-      m_transformation(cv::Rect(0, 0, 3, 2)) *= tmp;
-
-      // For contrast the stacking is not exact as x^3 and y^3 terms are not modelled,
-      // but close enough.
-      cv::Mat c = m_contrast.clone();
-      m_contrast *= m_stacked_transform->m_contrast.at<float>(0);
-      m_contrast.at<float>(1) += m_stacked_transform->m_contrast.at<float>(1) * c.at<float>(0);
-      m_contrast.at<float>(2) += m_stacked_transform->m_contrast.at<float>(2) * c.at<float>(0);
-      m_contrast.at<float>(2) += m_stacked_transform->m_contrast.at<float>(1) * c.at<float>(1);
-      m_contrast.at<float>(3) += m_stacked_transform->m_contrast.at<float>(3) * c.at<float>(0);
-      m_contrast.at<float>(4) += m_stacked_transform->m_contrast.at<float>(4) * c.at<float>(0);
-      m_contrast.at<float>(4) += m_stacked_transform->m_contrast.at<float>(3) * c.at<float>(3);
-
-      // For white balance, scale the brightness terms and multiply the contrast terms.
-      m_whitebalance.at<float>(0) += m_stacked_transform->m_whitebalance.at<float>(0) * m_whitebalance.at<float>(1);
-      m_whitebalance.at<float>(1) *= m_stacked_transform->m_whitebalance.at<float>(1);
-      m_whitebalance.at<float>(2) += m_stacked_transform->m_whitebalance.at<float>(2) * m_whitebalance.at<float>(3);
-      m_whitebalance.at<float>(3) *= m_stacked_transform->m_whitebalance.at<float>(3);
-      m_whitebalance.at<float>(4) += m_stacked_transform->m_whitebalance.at<float>(4) * m_whitebalance.at<float>(5);
-      m_whitebalance.at<float>(5) *= m_stacked_transform->m_whitebalance.at<float>(5);
+      compute_alignment();
     }
 
     if (m_logger->get_level() <= Logger::LOG_VERBOSE)
@@ -141,9 +127,8 @@ void Task_Align::task()
                   m_transformation.at<float>(1, 0), m_transformation.at<float>(1, 1), m_transformation.at<float>(1, 2));
     }
 
-    apply_transform(m_srccolor->img(), m_result, false);
-
-    if (!(m_flags & FocusStack::ALIGN_NO_CONTRAST) || !(m_flags & FocusStack::ALIGN_NO_WHITEBALANCE))
+    bool correct = !(m_flags & FocusStack::ALIGN_NO_CONTRAST) || !(m_flags & FocusStack::ALIGN_NO_WHITEBALANCE);
+    if (correct)
     {
       if (m_logger->get_level() <= Logger::LOG_VERBOSE)
       {
@@ -159,19 +144,107 @@ void Task_Align::task()
                     m_whitebalance.at<float>(3), m_whitebalance.at<float>(2),
                     m_whitebalance.at<float>(1), m_whitebalance.at<float>(0));
       }
-
-      apply_contrast_whitebalance(m_result);
     }
+
+    // Warp, correct and convert to grayscale in a single pass
+    warp_and_correct(m_srccolor->img(), m_result, m_transformation,
+                     correct ? m_contrast : cv::Mat(), correct ? m_whitebalance : cv::Mat(),
+                     grayscale_weights(), m_grayscale_weights ? &m_grayscale : nullptr);
   }
 
   compute_valid_area();
 
+  if (m_save_alignment && m_refcolor != m_srccolor)
+  {
+    m_save_alignment->set(m_index, m_srccolor->basename(), m_transformation, m_contrast, m_whitebalance);
+  }
+
   m_refgray.reset();
   m_refcolor.reset();
   m_srcgray.reset();
   m_srccolor.reset();
   m_initial_guess.reset();
   m_stacked_transform.reset();
+  m_loaded_alignment.reset();
+  m_save_alignment.reset();
+  m_grayscale_weights.reset();
+}
+
+void Task_Align::compute_alignment()
+{
+  if (m_initial_guess)
+  {
+    m_initial_guess->m_transformation.copyTo(m_transformation);
+  }
+
+  // Mask off the reflected borders generated by Task_LoadImg.
+  m_roi = m_srcgray->valid_area();
+
+  // Estimate the shift first, ECC can fail if it is large
+  if (m_flags & FocusStack::ALIGN_PHASE_CORRELATION)
+  {
+    match_phase_correlation(512);
+  }
+
+  // Perform low resolution initial geometric alignment
+  match_transform(256, true);
+
+  // Perform grayscale brightness alignment
+  if (!(m_flags & FocusStack::ALIGN_NO_CONTRAST))
+  {
+    match_contrast();
+  }
+
+  // Perform color/whit balance alignment
+  if (!(m_flags & FocusStack::ALIGN_NO_WHITEBALANCE) && m_srccolor->img().channels() == 3)
+  {
+    match_whitebalance();
+  }
+
+  // Finally, do the high resolution geometric alignment step
+  if (m_flags & FocusStack::ALIGN_FULL_RESOLUTION)
+  {
+    int res = std::max(m_srccolor->img().cols, m_srccolor->img().rows);
+    match_transform(res, false);
+  }
+  else
+  {
+    // By default limit image resolution used in alignment to 2k.
+    // Because this uses subpixel positioning, higher resolution provides little benefit.
+    match_transform(2048, false);
+  }
+
+  // The image is now aligned against the neighbour image.
+  // Now we can compute the alignment against the global reference image.
+  if (m_stacked_transform)
+  {
+    // At this point we need to know the stacked transform to apply it to the final image.
+    // Not putting this in m_depends_on gives better parallelism in the alignment phase.
+    m_stacked_transform->wait();
+    cv::Mat tmp = m_stacked_transform->m_transformation.clone();
+    tmp.resize(3, 0.0f);
+    tmp.at<float>(2, 2) = 1.0f;
+    m_transformation(cv::Rect(0, 0, 3, 2)) *= tmp;
+
+    // For contrast the stacking is not exact as x^3 and y^3 terms are not modelled,
+    // but close enough.
+    cv::Mat c = m_contrast.clone();
+    m_contrast *= m_stacked_transform->m_contrast.at<float>(0);
+    m_contrast.at<float>(1) += m_stacked_transform->m_contrast.at<float>(1) * c.at<float>(0);
+    m_contrast.at<float>(2) += m_stacked_transform->m_contrast.at<float>(2) * c.at<float>(0);
+    m_contrast.at<float>(2) += m_stacked_transform->m_contrast.at<float>(1) * c.at<float>(1);
+    m_contrast.at<float>(3) += m_stacked_transform->m_contrast.at<float>(3) * c.at<float>(0);
+    m_contrast.at<float>(4) += m_stacked_transform->m_contrast.at<float>(4) * c.at<float>(0);
+    m_contrast.at<float>(4) += m_stacked_transform->m_contrast.at<float>(3) * c.at<float>(3);
+
+    // For white balance, scale the brightness terms and multiply the contrast terms.
+    m_whitebalance.at<float>(0) += m_stacked_transform->m_whitebalance.at<float>(0) * m_whitebalance.at<float>(1);
+    m_whitebalance.at<float>(1) *= m_stacked_transform->m_whitebalance.at<float>(1);
+    m_whitebalance.at<float>(2) += m_stacked_transform->m_whitebalance.at<float>(2) * m_whitebalance.at<float>(3);
+    m_whitebalance.at<float>(3) *= m_stacked_transform->m_whitebalance.at<float>(3);
+    m_whitebalance.at<float>(4) += m_stacked_transform->m_whitebalance.at<float>(4) * m_whitebalance.at<float>(5);
+    m_whitebalance.at<float>(5) *= m_stacked_transform->m_whitebalance.at<float>(5);
+  }
 }
 
 // Collect samples and use them to predict contrast between images
@@ -231,24 +304,55 @@ void Task_Align::match_contrast()
   }
 }
 
-void Task_Align::match_transform(int max_resolution, bool rough)
+// Find translation between images using phase correlation.
+// This is fast and works for large shifts, but does not model the
+// scaling and rotation, which are left for match_transform().
+// The source is first warped with the current estimate, such as the
+// initial guess from the neighbour image, and the remaining shift is
+// added to it. This keeps the translation consistent with the scaling
+// and rotation of the estimate.
+void Task_Align::match_phase_correlation(int max_resolution)
 {
-  cv::Mat ref, src, mask;
-
-  int resolution = std::max(m_refgray->img().cols, m_refgray->img().rows);
   float scale_ratio = 1.0f;
+  cv::Mat ref, src, warped, window;
+  m_refgray->img_downscaled(max_resolution, &scale_ratio).convertTo(ref, CV_32F);
+  m_srcgray->img_downscaled(max_resolution).convertTo(src, CV_32F);
+  cv::createHanningWindow(window, ref.size(), CV_32F);
+
+  cv::Mat estimate = m_transformation.clone();
+  estimate.at<float>(0, 2) *= scale_ratio;
+  estimate.at<float>(1, 2) *= scale_ratio;
+  cv::warpAffine(src, warped, estimate, ref.size(), cv::INTER_LINEAR, cv::BORDER_REFLECT);
+  src = warped;
 
-  if (resolution <= max_resolution)
+  double response = 0;
+  cv::Point2d shift = cv::phaseCorrelate(src, ref, window, &response);
+
+  if (m_logger->get_level() <= Logger::LOG_VERBOSE)
   {
-    ref = m_refgray->img();
-    m_srcgray->img().copyTo(src);
+    std::string name = basename();
+    m_logger->verbose("%s phase correlation: residual shift %0.1f, %0.1f, response %0.3f\n",
+                name.c_str(), shift.x / scale_ratio, shift.y / scale_ratio, response);
   }
-  else
+
+  // Weak peak means that the images have too little in common,
+  // keep the previous estimate in that case.
+  if (response >= 0.05)
   {
-    scale_ratio = max_resolution / (float)resolution;
-    cv::resize(m_refgray->img(), ref, cv::Size(), scale_ratio, scale_ratio, cv::INTER_AREA);
-    cv::resize(m_srcgray->img(), src, cv::Size(), scale_ratio, scale_ratio, cv::INTER_AREA);
+    m_transformation.at<float>(0, 2) += shift.x / scale_ratio;
+    m_transformation.at<float>(1, 2) += shift.y / scale_ratio;
   }
+}
+
+void Task_Align::match_transform(int max_resolution, bool rough)
+{
+  cv::Mat ref, src, mask;
+
+  // The downscaled images are shared with the other alignment tasks
+  // that use the same images, so the source is copied before modifying.
+  float scale_ratio = 1.0f;
+  ref = m_refgray->img_downscaled(max_resolution, &scale_ratio);
+  m_srcgray->img_downscaled(max_resolution).copyTo(src);
 
   mask.create(ref.rows, ref.cols, CV_8U);
   mask = 0;
@@ -336,59 +440,253 @@ static inline int round_and_dither(float value, float &delta)
     return std::min(255, std::max(0, intval));
 }
 
-void Task_Align::apply_contrast_whitebalance(cv::Mat& img)
+#if CV_SIMD
+// Universal intrinsics API differs between OpenCV versions.
+#if CV_VERSION_MAJOR > 4 || (CV_VERSION_MAJOR == 4 && CV_VERSION_MINOR >= 8)
+static inline int align_vlanes() { return cv::VTraits<cv::v_float32>::vlanes(); }
+static inline cv::v_float32 align_add(const cv::v_float32 &a, const cv::v_float32 &b) { return cv::v_add(a, b); }
+static inline cv::v_float32 align_mul(const cv::v_float32 &a, const cv::v_float32 &b) { return cv::v_mul(a, b); }
+#else
+static inline int align_vlanes() { return cv::v_float32::nlanes; }
+static inline cv::v_float32 align_add(const cv::v_float32 &a, const cv::v_float32 &b) { return a + b; }
+static inline cv::v_float32 align_mul(const cv::v_float32 &a, const cv::v_float32 &b) { return a * b; }
+#endif
+#endif
+
+// Compute the adjusted values for one row before dithering.
+// The x terms of contrast and the white balance factors are given for each
+// channel value of the row. For grayscale images scale and offset are null.
+// Operations are done in the same order as in the scalar code, so that
+// the results are identical regardless of SIMD support.
+static void contrast_whitebalance_row(const uint8_t *src, float *dst, int count,
+                                      const float *xterms, float yterm,
+                                      const float *scale, const float *offset)
+{
+  int i = 0;
+
+#if CV_SIMD
+  const int N = align_vlanes();
+  cv::v_float32 vyterm = cv::vx_setall_f32(yterm);
+  for (; i + N <= count; i += N)
+  {
+    cv::v_float32 v = cv::v_cvt_f32(cv::v_reinterpret_as_s32(cv::vx_load_expand_q(src + i)));
+    cv::v_float32 c = align_add(cv::vx_load(xterms + i), vyterm);
+    cv::v_float32 f = align_mul(v, c);
+
+    if (scale)
+    {
+      f = align_add(align_mul(f, cv::vx_load(scale + i)), cv::vx_load(offset + i));
+    }
+
+    cv::v_store(dst + i, f);
+  }
+#endif
+
+  for (; i < count; i++)
+  {
+    float c = xterms[i] + yterm;
+    float f = src[i] * c;
+
+    if (scale)
+    {
+      f = f * scale[i] + offset[i];
+    }
+
+    dst[i] = f;
+  }
+}
+
+// Precomputed tables for contrast and white balance correction.
+// Contrast is a polynomial c0 + xd * (c1 + c2 * xd) + yd * (c3 + c4 * yd).
+// The x terms are the same for every row, so they are computed once for each
+// channel value, together with the white balance scale and offset.
+struct contrast_whitebalance_t
 {
-  if (img.channels() == 1)
+  int rows;
+  int cols;
+  int channels;
+  int count;
+  float cf[5];
+  std::vector<float> xterms;
+  std::vector<float> scale;
+  std::vector<float> offset;
+
+  contrast_whitebalance_t(cv::Size size, int img_channels, const cv::Mat &contrast, const cv::Mat &whitebalance):
+    rows(size.height), cols(size.width), channels((img_channels == 1) ? 1 : 3), count(cols * channels)
   {
-    // For grayscale images, apply contrast only
-    for (int y = 0; y < img.rows; y++)
+    for (int i = 0; i < 5; i++)
+    {
+      cf[i] = contrast.at<float>(i);
+    }
+
+    xterms.resize(count);
+    for (int x = 0; x < cols; x++)
     {
-      float delta = 0.0f;
-      for (int x = 0; x < img.cols; x++)
+      float xd = (x - cols/2.0f) / (float)cols;
+      float xterm = cf[0] + xd * (cf[1] + cf[2] * xd);
+
+      for (int ch = 0; ch < channels; ch++)
       {
-        float yd = (y - img.rows/2.0f) / (float)img.rows;
-        float xd = (x - img.cols/2.0f) / (float)img.cols;
-
-        float c = m_contrast.at<float>(0)
-                + xd * (m_contrast.at<float>(1) + m_contrast.at<float>(2) * xd)
-                + yd * (m_contrast.at<float>(3) + m_contrast.at<float>(4) * yd);
-
-        // Simple dithering reduces banding in result image
-        uint8_t v = img.at<uint8_t>(y, x);
-        float f = v * c;
-        v = round_and_dither(f, delta);
-        img.at<uint8_t>(y, x) = v;
+        xterms[x * channels + ch] = xterm;
+      }
+    }
+
+    // White balance is applied only to color images
+    if (channels == 3)
+    {
+      const float *wb = whitebalance.ptr<float>();
+      scale.resize(count);
+      offset.resize(count);
+      for (int i = 0; i < count; i++)
+      {
+        scale[i] = wb[2 * (i % 3) + 1];
+        offset[i] = wb[2 * (i % 3)];
       }
     }
   }
+
+  // Correct one row in place, values is temporary buffer of count floats.
+  void apply_row(uint8_t *row, int y, float *values) const
+  {
+    float yd = (y - rows/2.0f) / (float)rows;
+    float yterm = yd * (cf[3] + cf[4] * yd);
+
+    contrast_whitebalance_row(row, values, count, xterms.data(), yterm,
+                              scale.empty() ? nullptr : scale.data(),
+                              offset.empty() ? nullptr : offset.data());
+
+    // Simple dithering reduces banding in result image
+    float delta[3] = {0.0f, 0.0f, 0.0f};
+    for (int x = 0; x < cols; x++)
+    {
+      for (int ch = 0; ch < channels; ch++)
+      {
+        int i = x * channels + ch;
+        row[i] = round_and_dither(values[i], delta[ch]);
+      }
+    }
+  }
+};
+
+void Task_Align::apply_contrast_whitebalance(cv::Mat& img)
+{
+  apply_contrast_whitebalance(img, m_contrast, m_whitebalance);
+}
+
+void Task_Align::apply_contrast_whitebalance(cv::Mat &img, const cv::Mat &contrast, const cv::Mat &whitebalance)
+{
+  contrast_whitebalance_t correction(img.size(), img.channels(), contrast, whitebalance);
+
+  // Dithering error only propagates along the row, so rows can be
+  // processed in parallel.
+  cv::parallel_for_(cv::Range(0, img.rows), [&](const cv::Range &range) {
+    std::vector<float> values(correction.count);
+
+    for (int y = range.start; y < range.end; y++)
+    {
+      correction.apply_row(img.ptr<uint8_t>(y), y, values.data());
+    }
+  });
+}
+
+// Process in strips of rows that fit in cache, so that the warped
+// pixels are still there for the correction and grayscale conversion.
+const int Task_Align::warp_strip_rows = 32;
+
+void Task_Align::warp_and_correct(const cv::Mat &src, cv::Mat &dst,
+                                  const cv::Mat &transformation,
+                                  const cv::Mat &contrast, const cv::Mat &whitebalance,
+                                  const cv::Mat &weights, cv::Mat *gray,
+                                  const std::vector<bool> &strips)
+{
+  bool warp = !transformation.empty();
+  bool correct = !contrast.empty();
+  bool to_gray = gray && src.channels() == 3;
+
+  if (to_gray && weights.total() != 3)
+  {
+    throw std::logic_error("Grayscale weights are needed for color image");
+  }
+
+  if (!warp && !correct)
+  {
+    dst = src;
+  }
   else
   {
-    // For RGB images, apply contrast and white balance
-    for (int y = 0; y < img.rows; y++)
+    dst.create(src.rows, src.cols, src.type());
+  }
+
+  if (to_gray)
+  {
+    gray->create(src.rows, src.cols, CV_8U);
+  }
+  else if (gray)
+  {
+    *gray = dst;
+  }
+
+  if (!warp && !correct && !to_gray)
+  {
+    return;
+  }
+
+  cv::Mat inverse;
+  if (warp)
+  {
+    transformation.convertTo(inverse, CV_64F);
+    cv::invertAffineTransform(inverse, inverse);
+  }
+
+  std::unique_ptr<contrast_whitebalance_t> correction;
+  if (correct)
+  {
+    correction.reset(new contrast_whitebalance_t(src.size(), src.channels(), contrast, whitebalance));
+  }
+
+  const float *w = to_gray ? weights.ptr<float>() : nullptr;
+
+  int strip_count = (src.rows + warp_strip_rows - 1) / warp_strip_rows;
+  cv::parallel_for_(cv::Range(0, strip_count), [&](const cv::Range &range) {
+    std::vector<float> values(correct ? correction->count : 0);
+
+    for (int s = range.start; s < range.end; s++)
     {
-      float delta[3] = {0.0f, 0.0f, 0.0f};
+      if (!strips.empty() && !strips.at(s))
+      {
+        continue;
+      }
+
+      int y0 = s * warp_strip_rows;
+      int y1 = std::min(src.rows, y0 + warp_strip_rows);
 
-      for (int x = 0; x < img.cols; x++)
+      if (warp)
       {
-        float yd = (y - img.rows/2.0f) / (float)img.rows;
-        float xd = (x - img.cols/2.0f) / (float)img.cols;
-
-        float c = m_contrast.at<float>(0)
-                + xd * (m_contrast.at<float>(1) + m_contrast.at<float>(2) * xd)
-                + yd * (m_contrast.at<float>(3) + m_contrast.at<float>(4) * yd);
-
-
-        cv::Vec3b v = img.at<cv::Vec3b>(y, x);
-        float b = v[0] * c * m_whitebalance.at<float>(1) + m_whitebalance.at<float>(0);
-        float g = v[1] * c * m_whitebalance.at<float>(3) + m_whitebalance.at<float>(2);
-        float r = v[2] * c * m_whitebalance.at<float>(5) + m_whitebalance.at<float>(4);
-        v[0] = round_and_dither(b, delta[0]);
-        v[1] = round_and_dither(g, delta[1]);
-        v[2] = round_and_dither(r, delta[2]);
-        img.at<cv::Vec3b>(y, x) = v;
+        // Shift the inverse transform so that the strip starts at row 0
+        cv::Mat m = inverse.clone();
+        m.at<double>(0, 2) += m.at<double>(0, 1) * y0;
+        m.at<double>(1, 2) += m.at<double>(1, 1) * y0;
+
+        cv::Mat out = dst.rowRange(y0, y1);
+        cv::warpAffine(src, out, m, out.size(), cv::INTER_CUBIC | cv::WARP_INVERSE_MAP, cv::BORDER_REFLECT);
+      }
+
+      for (int y = y0; y < y1; y++)
+      {
+        uint8_t *row = dst.ptr<uint8_t>(y);
+
+        if (correct)
+        {
+          correction->apply_row(row, y, values.data());
+        }
+
+        if (to_gray)
+        {
+          Task_Grayscale::convert_row(row, gray->ptr<uint8_t>(y), src.cols, w);
+        }
       }
     }
-  }
+  });
 }
 
 void Task_Align::apply_transform(const cv::Mat &src, cv::Mat &dst, bool inverse)
@@ -431,4 +729,138 @@ void Task_Align::compute_valid_area()
     m_logger->verbose("%s valid area X %d, Y %d, W %d, H %d\n",
       m_filename.c_str(), m_valid_area.x, m_valid_area.y, m_valid_area.width, m_valid_area.height);
   }
-}
\ No newline at end of file
+}
+
+void AlignmentStore::set(int index, const std::string &name, const cv::Mat &transformation,
+                         const cv::Mat &contrast, const cv::Mat &whitebalance)
+{
+  std::unique_lock<std::mutex> lock(m_mutex);
+  alignment_t &a = m_alignments[index];
+  a.name = name;
+  a.transformation = transformation.clone();
+  a.contrast = contrast.clone();
+  a.whitebalance = whitebalance.clone();
+}
+
+bool AlignmentStore::get(int index, cv::Mat &transformation, cv::Mat &contrast, cv::Mat &whitebalance) const
+{
+  std::unique_lock<std::mutex> lock(m_mutex);
+  auto iter = m_alignments.find(index);
+  if (iter == m_alignments.end())
+  {
+    return false;
+  }
+
+  iter->second.transformation.copyTo(transformation);
+  iter->second.contrast.copyTo(contrast);
+  iter->second.whitebalance.copyTo(whitebalance);
+  return true;
+}
+
+std::string AlignmentStore::name(int index) const
+{
+  std::unique_lock<std::mutex> lock(m_mutex);
+  auto iter = m_alignments.find(index);
+  if (iter == m_alignments.end())
+  {
+    return "";
+  }
+
+  return iter->second.name;
+}
+
+void AlignmentStore::save(const std::string &filename) const
+{
+  std::unique_lock<std::mutex> lock(m_mutex);
+  cv::FileStorage fs(filename, cv::FileStorage::WRITE);
+  if (!fs.isOpened())
+  {
+    throw std::runtime_error("Could not write alignment file " + filename);
+  }
+
+  fs << "reference" << m_reference;
+  fs << "images" << "[";
+  for (const auto &item: m_alignments)
+  {
+    fs << "{";
+    fs << "index" << item.first;
+    fs << "name" << item.second.name;
+    fs << "transformation" << item.second.transformation;
+    fs << "contrast" << item.second.contrast;
+    fs << "whitebalance" << item.second.whitebalance;
+    fs << "}";
+  }
+  fs << "]";
+}
+
+void AlignmentStore::load(const std::string &filename)
+{
+  std::unique_lock<std::mutex> lock(m_mutex);
+  cv::FileStorage fs(filename, cv::FileStorage::READ);
+  if (!fs.isOpened())
+  {
+    throw std::runtime_error("Could not read alignment file " + filename);
+  }
+
+  int reference = -1;
+  fs["reference"] >> reference;
+  if (reference != m_reference)
+  {
+    throw std::runtime_error("Alignment file " + filename + " uses reference image " + std::to_string(reference)
+                             + ", but current reference is " + std::to_string(m_reference));
+  }
+
+  cv::FileNode images = fs["images"];
+  for (cv::FileNodeIterator iter = images.begin(); iter != images.end(); ++iter)
+  {
+    int index = -1;
+    alignment_t a;
+    (*iter)["index"] >> index;
+    (*iter)["name"] >> a.name;
+    (*iter)["transformation"] >> a.transformation;
+    (*iter)["contrast"] >> a.contrast;
+    (*iter)["whitebalance"] >> a.whitebalance;
+
+    if (a.transformation.rows != 2 || a.transformation.cols != 3 || a.transformation.type() != CV_32F ||
+        a.contrast.total() != 5 || a.contrast.type() != CV_32F ||
+        a.whitebalance.total() != 6 || a.whitebalance.type() != CV_32F)
+    {
+      throw std::runtime_error("Invalid alignment for image " + std::to_string(index) + " in " + filename);
+    }
+
+    m_alignments[index] = a;
+  }
+}
+
+Task_LoadAlignment::Task_LoadAlignment(std::string filename, int reference):
+  m_alignment(reference)
+{
+  m_filename = filename;
+  m_name = "Load alignment " + filename;
+}
+
+void Task_LoadAlignment::task()
+{
+  m_alignment.load(m_filename);
+}
+
+Task_AlignedGrayscale::Task_AlignedGrayscale(std::shared_ptr<Task_Align> aligned)
+{
+  m_filename = aligned->filename();
+  m_name = "Grayscale " + m_filename;
+  m_index = aligned->index();
+  m_aligned = aligned;
+  m_depends_on.push_back(aligned);
+}
+
+size_t Task_AlignedGrayscale::estimate_result_bytes() const
+{
+  return m_aligned->img().total();
+}
+
+void Task_AlignedGrayscale::task()
+{
+  m_result = m_aligned->release_grayscale();
+  m_valid_area = m_aligned->valid_area();
+  m_aligned.reset();
+}
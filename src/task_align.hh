@@ -7,9 +7,62 @@
 #include "worker.hh"
 #include "task_loadimg.hh"
 #include "focusstack.hh"
+#include <map>
 
 namespace focusstack {
 
+class Task_Grayscale;
+
+// Alignment results of a stack by image index, for reusing them in later runs.
+// The results are relative to the reference image, so they are valid only
+// with the same reference.
+class AlignmentStore
+{
+public:
+  AlignmentStore(int reference): m_reference(reference) {}
+
+  void set(int index, const std::string &name, const cv::Mat &transformation,
+           const cv::Mat &contrast, const cv::Mat &whitebalance);
+
+  // Returns false if there is no alignment for the image.
+  bool get(int index, cv::Mat &transformation, cv::Mat &contrast, cv::Mat &whitebalance) const;
+
+  // Name of the image the alignment was computed for, or empty if none.
+  std::string name(int index) const;
+
+  // Save or load in any format supported by cv::FileStorage, selected by
+  // file extension. Throws std::runtime_error on failure.
+  void save(const std::string &filename) const;
+  void load(const std::string &filename);
+
+private:
+  struct alignment_t
+  {
+    std::string name;
+    cv::Mat transformation;
+    cv::Mat contrast;
+    cv::Mat whitebalance;
+  };
+
+  int m_reference;
+  mutable std::mutex m_mutex;
+  std::map<int, alignment_t> m_alignments;
+};
+
+// Loads alignment results saved by an earlier run.
+class Task_LoadAlignment: public Task
+{
+public:
+  Task_LoadAlignment(std::string filename, int reference);
+
+  const AlignmentStore &alignment() const { return m_alignment; }
+
+private:
+  virtual void task();
+
+  AlignmentStore m_alignment;
+};
+
 class Task_Align: public ImgTask
 {
 public:
@@ -26,10 +79,45 @@ public:
              FocusStack::align_flags_t flags = FocusStack::ALIGN_DEFAULT
             );
 
+  virtual size_t estimate_result_bytes() const;
+
+  // Use loaded alignment instead of computing it, if it has this image.
+  void set_loaded_alignment(std::shared_ptr<Task_LoadAlignment> loaded);
+
+  // Store the resulting alignment for saving.
+  void set_save_alignment(std::shared_ptr<AlignmentStore> store) { m_save_alignment = store; }
+
+  // Also produce grayscale version of the aligned image in the same pass,
+  // using the conversion weights of the given task.
+  // The grayscale image is passed on with release_grayscale().
+  void set_grayscale(std::shared_ptr<Task_Grayscale> weights);
+  cv::Mat release_grayscale();
+
+  // Warp image with affine transformation, correct contrast and white balance
+  // and convert to grayscale in one pass over strips of rows, to avoid separate
+  // passes over the full image. Empty transformation or contrast skips that step
+  // and the grayscale conversion is done only if gray is given.
+  // If strips is not empty, only the strips of warp_strip_rows that are marked
+  // in it are processed, and the other rows are left uninitialized.
+  static void warp_and_correct(const cv::Mat &src, cv::Mat &dst,
+                               const cv::Mat &transformation,
+                               const cv::Mat &contrast, const cv::Mat &whitebalance,
+                               const cv::Mat &weights = cv::Mat(), cv::Mat *gray = nullptr,
+                               const std::vector<bool> &strips = std::vector<bool>());
+  static const int warp_strip_rows;
+
+  // Apply contrast and white balance correction to 8-bit image in place.
+  // White balance is only applied to 3-channel images.
+  static void apply_contrast_whitebalance(cv::Mat &img, const cv::Mat &contrast, const cv::Mat &whitebalance);
+
 private:
   virtual void task();
 
+  void compute_alignment();
+  cv::Mat grayscale_weights() const;
+
   void match_contrast();
+  void match_phase_correlation(int max_resolution);
   void match_transform(int max_resolution, bool rough);
   void match_whitebalance();
 
@@ -44,6 +132,10 @@ private:
   std::shared_ptr<ImgTask> m_srccolor;
   std::shared_ptr<Task_Align> m_initial_guess;
   std::shared_ptr<Task_Align> m_stacked_transform;
+  std::shared_ptr<Task_LoadAlignment> m_loaded_alignment;
+  std::shared_ptr<AlignmentStore> m_save_alignment;
+  std::shared_ptr<Task_Grayscale> m_grayscale_weights;
+  cv::Mat m_grayscale;
 
   FocusStack::align_flags_t m_flags;
   cv::Rect m_roi;
@@ -52,4 +144,18 @@ private:
   cv::Mat m_whitebalance;
 };
 
+// Grayscale image produced by Task_Align::set_grayscale().
+class Task_AlignedGrayscale: public ImgTask
+{
+public:
+  Task_AlignedGrayscale(std::shared_ptr<Task_Align> aligned);
+
+  virtual size_t estimate_result_bytes() const;
+
+private:
+  virtual void task();
+
+  std::shared_ptr<Task_Align> m_aligned;
+};
+
 }
@@ -0,0 +1,388 @@
+#include <gtest/gtest.h>
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <opencv2/imgproc.hpp>
+#include "task_align.hh"
+#include "task_grayscale.hh"
+#include "logger.hh"
+
+namespace focusstack {
+
+// Random texture with features of a few pixels in size
+static cv::Mat make_texture(cv::Size size, int seed)
+{
+  std::mt19937 rng(seed);
+  std::uniform_int_distribution<int> dist(0, 255);
+  cv::Mat noise(size, CV_8U);
+
+  for (int y = 0; y < size.height; y++)
+  {
+    for (int x = 0; x < size.width; x++)
+    {
+      noise.at<uint8_t>(y, x) = dist(rng);
+    }
+  }
+
+  cv::Mat img;
+  cv::GaussianBlur(noise, img, cv::Size(0, 0), 3);
+  cv::normalize(img, img, 0, 255, cv::NORM_MINMAX);
+  return img;
+}
+
+// Scale around image center and then shift
+static cv::Mat transform_image(const cv::Mat &img, float scale, float dx, float dy)
+{
+  cv::Mat m(2, 3, CV_32F);
+  m = 0.0f;
+  m.at<float>(0, 0) = scale;
+  m.at<float>(1, 1) = scale;
+  m.at<float>(0, 2) = (1 - scale) * img.cols / 2 + dx;
+  m.at<float>(1, 2) = (1 - scale) * img.rows / 2 + dy;
+
+  cv::Mat result;
+  cv::warpAffine(img, result, m, img.size(), cv::INTER_CUBIC, cv::BORDER_REFLECT);
+  return result;
+}
+
+// Mean absolute difference in the middle of the images
+static double middle_error(const cv::Mat &aligned, const cv::Mat &ref)
+{
+  cv::Rect middle(ref.cols / 4, ref.rows / 4, ref.cols / 2, ref.rows / 2);
+  cv::Mat diff;
+  cv::absdiff(aligned(middle), ref(middle), diff);
+  return cv::mean(diff)[0];
+}
+
+// Align src to ref, returns the mean absolute difference in the middle of
+// the images and stores the run time in seconds.
+static double align_error(const cv::Mat &ref, const cv::Mat &src, int flags, double *seconds = nullptr)
+{
+  std::shared_ptr<Logger> logger = std::make_shared<Logger>();
+  logger->set_level(Logger::LOG_INFO);
+
+  std::shared_ptr<ImgTask> refimg = std::make_shared<ImgTask>(ref);
+  std::shared_ptr<ImgTask> srcimg = std::make_shared<ImgTask>(src);
+  flags |= FocusStack::ALIGN_NO_CONTRAST | FocusStack::ALIGN_NO_WHITEBALANCE;
+  std::shared_ptr<Task_Align> align = std::make_shared<Task_Align>(refimg, refimg, srcimg, srcimg, nullptr, nullptr,
+                                                                   static_cast<FocusStack::align_flags_t>(flags));
+
+  auto start = std::chrono::steady_clock::now();
+  align->run(logger);
+  if (seconds)
+  {
+    *seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  }
+
+  return middle_error(align->img(), ref);
+}
+
+// Straightforward per-pixel implementation of contrast and white balance correction
+static void reference_contrast_whitebalance(cv::Mat &img, const cv::Mat &contrast, const cv::Mat &whitebalance)
+{
+  for (int y = 0; y < img.rows; y++)
+  {
+    float delta[3] = {0.0f, 0.0f, 0.0f};
+    for (int x = 0; x < img.cols; x++)
+    {
+      float yd = (y - img.rows/2.0f) / (float)img.rows;
+      float xd = (x - img.cols/2.0f) / (float)img.cols;
+      float c = contrast.at<float>(0)
+              + xd * (contrast.at<float>(1) + contrast.at<float>(2) * xd)
+              + yd * (contrast.at<float>(3) + contrast.at<float>(4) * yd);
+
+      for (int ch = 0; ch < img.channels(); ch++)
+      {
+        uint8_t &v = img.ptr<uint8_t>(y)[x * img.channels() + ch];
+        float f = v * c;
+        if (img.channels() == 3)
+        {
+          f = f * whitebalance.at<float>(2 * ch + 1) + whitebalance.at<float>(2 * ch);
+        }
+
+        int intval = (int)(f + delta[ch]);
+        delta[ch] += f - intval;
+        v = std::min(255, std::max(0, intval));
+      }
+    }
+  }
+}
+
+static cv::Mat make_color(cv::Size size, int seed)
+{
+  std::mt19937 rng(seed);
+  std::uniform_int_distribution<int> dist(0, 255);
+  cv::Mat img(size, CV_8UC3);
+  for (int y = 0; y < size.height; y++)
+  {
+    for (int x = 0; x < size.width * 3; x++)
+    {
+      img.ptr<uint8_t>(y)[x] = dist(rng);
+    }
+  }
+  return img;
+}
+
+static void make_correction(cv::Mat &contrast, cv::Mat &whitebalance)
+{
+  const float c[5] = {1.05f, 0.03f, -0.08f, -0.02f, 0.06f};
+  const float wb[6] = {-3.5f, 1.02f, 1.25f, 0.97f, 0.5f, 1.1f};
+  contrast = cv::Mat(5, 1, CV_32F);
+  whitebalance = cv::Mat(6, 1, CV_32F);
+  for (int i = 0; i < 5; i++) contrast.at<float>(i) = c[i];
+  for (int i = 0; i < 6; i++) whitebalance.at<float>(i) = wb[i];
+}
+
+// Optimized contrast and white balance must give identical result to the per-pixel version.
+TEST(Task_Align, ContrastWhitebalanceIdentical) {
+  cv::Mat contrast, whitebalance;
+  make_correction(contrast, whitebalance);
+
+  // Odd sizes exercise the non-vectorized tail of rows
+  for (int channels: {1, 3})
+  {
+    cv::Mat color = make_color(cv::Size(333, 77), channels);
+    cv::Mat img;
+    if (channels == 1)
+    {
+      cv::Mat parts[3];
+      cv::split(color, parts);
+      img = parts[0];
+    }
+    else
+    {
+      img = color;
+    }
+
+    cv::Mat expected = img.clone();
+    reference_contrast_whitebalance(expected, contrast, whitebalance);
+    Task_Align::apply_contrast_whitebalance(img, contrast, whitebalance);
+
+    for (int y = 0; y < img.rows; y++)
+    {
+      for (int x = 0; x < img.cols * channels; x++)
+      {
+        ASSERT_EQ(img.ptr<uint8_t>(y)[x], expected.ptr<uint8_t>(y)[x]) << "channels " << channels << " at " << x << "," << y;
+      }
+    }
+  }
+}
+
+// Compare contrast and white balance correction speed to the per-pixel version.
+TEST(Task_Align, DISABLED_ContrastWhitebalanceBenchmark) {
+  cv::Mat contrast, whitebalance;
+  make_correction(contrast, whitebalance);
+  cv::Mat img = make_color(cv::Size(6000, 4000), 3);
+  double megapixels = img.total() / 1e6;
+
+  cv::Mat tmp = img.clone();
+  auto start = std::chrono::steady_clock::now();
+  reference_contrast_whitebalance(tmp, contrast, whitebalance);
+  double reference = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  tmp = img.clone();
+  start = std::chrono::steady_clock::now();
+  Task_Align::apply_contrast_whitebalance(tmp, contrast, whitebalance);
+  double optimized = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  std::printf("per-pixel %0.1f MP/s, optimized %0.1f MP/s\n", megapixels / reference, megapixels / optimized);
+}
+
+static cv::Mat make_rotation(cv::Size size, float degrees)
+{
+  cv::Mat m;
+  cv::getRotationMatrix2D(cv::Point2f(size.width / 2.0f, size.height / 2.0f), degrees, 1.01).convertTo(m, CV_32F);
+  m.at<float>(0, 2) += 3.3f;
+  m.at<float>(1, 2) -= 5.7f;
+  return m;
+}
+
+// Fused warp, correction and grayscale conversion should match doing them separately.
+TEST(Task_Align, WarpAndCorrectMatchesSeparate) {
+  cv::Mat contrast, whitebalance;
+  make_correction(contrast, whitebalance);
+  cv::Mat src = make_color(cv::Size(301, 157), 4);
+  cv::Mat transformation = make_rotation(src.size(), 2.5f);
+
+  // Grayscale weights from the reference image like in FocusStack
+  std::shared_ptr<Logger> logger = std::make_shared<Logger>();
+  std::shared_ptr<Task_Grayscale> reference = std::make_shared<Task_Grayscale>(std::make_shared<ImgTask>(src));
+  reference->run(logger);
+  cv::Mat weights = reference->weights();
+
+  cv::Mat expected;
+  cv::warpAffine(src, expected, transformation, src.size(), cv::INTER_CUBIC, cv::BORDER_REFLECT);
+  Task_Align::apply_contrast_whitebalance(expected, contrast, whitebalance);
+
+  cv::Mat color, gray;
+  Task_Align::warp_and_correct(src, color, transformation, contrast, whitebalance, weights, &gray);
+  ASSERT_EQ(color.size(), src.size());
+  ASSERT_EQ(gray.size(), src.size());
+
+  // Strips can round the warp coordinates differently in rare cases
+  cv::Mat diff;
+  cv::absdiff(color, expected, diff);
+  double maxdiff;
+  cv::minMaxLoc(diff.reshape(1), nullptr, &maxdiff);
+  EXPECT_LE(maxdiff, 1.0);
+
+  // Grayscale must be identical to Task_Grayscale, which converts the reference image
+  Task_Grayscale expected_gray(std::make_shared<ImgTask>(color), reference);
+  expected_gray.run(logger);
+  for (int y = 0; y < src.rows; y++)
+  {
+    for (int x = 0; x < src.cols; x++)
+    {
+      ASSERT_EQ(gray.at<uint8_t>(y, x), expected_gray.img().at<uint8_t>(y, x)) << "at " << x << "," << y;
+    }
+  }
+}
+
+// Compare the fused pass against separate warp, correction and grayscale passes.
+TEST(Task_Align, DISABLED_WarpAndCorrectBenchmark) {
+  cv::Mat contrast, whitebalance;
+  make_correction(contrast, whitebalance);
+  cv::Mat src = make_color(cv::Size(6000, 4000), 5);
+  cv::Mat transformation = make_rotation(src.size(), 0.5f);
+  cv::Mat weights(1, 3, CV_32F);
+  weights.at<float>(0) = 0.3f;
+  weights.at<float>(1) = 0.5f;
+  weights.at<float>(2) = 0.2f;
+  double megapixels = src.total() / 1e6;
+
+  auto start = std::chrono::steady_clock::now();
+  cv::Mat color, gray, channels[3];
+  cv::warpAffine(src, color, transformation, src.size(), cv::INTER_CUBIC, cv::BORDER_REFLECT);
+  Task_Align::apply_contrast_whitebalance(color, contrast, whitebalance);
+  cv::split(color, channels);
+  gray = channels[0] * 0.3f + channels[1] * 0.5f + channels[2] * 0.2f;
+  double separate = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  start = std::chrono::steady_clock::now();
+  Task_Align::warp_and_correct(src, color, transformation, contrast, whitebalance, weights, &gray);
+  double fused = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  std::printf("separate passes %0.1f MP/s, fused %0.1f MP/s\n", megapixels / separate, megapixels / fused);
+}
+
+// Phase correlation should find shifts that are too large for ECC alone.
+TEST(Task_Align, PhaseCorrelationLargeShift) {
+  cv::Mat ref = make_texture(cv::Size(1024, 768), 1);
+  cv::Mat src = transform_image(ref, 1.0f, 150.0f, -90.0f);
+
+  EXPECT_LT(align_error(ref, src, FocusStack::ALIGN_PHASE_CORRELATION), 3.0);
+}
+
+// Phase correlation should refine the shift of a scaled initial guess from
+// the neighbour image, instead of replacing its translation.
+TEST(Task_Align, PhaseCorrelationScaledGuess) {
+  std::shared_ptr<Logger> logger = std::make_shared<Logger>();
+  logger->set_level(Logger::LOG_INFO);
+  cv::Mat ref = make_texture(cv::Size(1024, 768), 1);
+  cv::Mat neighbour = transform_image(ref, 1.05f, 100.0f, -60.0f);
+  cv::Mat src = transform_image(ref, 1.06f, 130.0f, -80.0f);
+
+  FocusStack::align_flags_t flags = static_cast<FocusStack::align_flags_t>(
+    FocusStack::ALIGN_PHASE_CORRELATION | FocusStack::ALIGN_NO_CONTRAST | FocusStack::ALIGN_NO_WHITEBALANCE);
+  std::shared_ptr<ImgTask> refimg = std::make_shared<ImgTask>(ref);
+  std::shared_ptr<ImgTask> neighbourimg = std::make_shared<ImgTask>(neighbour);
+  std::shared_ptr<ImgTask> srcimg = std::make_shared<ImgTask>(src);
+
+  std::shared_ptr<Task_Align> guess = std::make_shared<Task_Align>(refimg, refimg, neighbourimg, neighbourimg,
+                                                                   nullptr, nullptr, flags);
+  guess->run(logger);
+  ASSERT_LT(middle_error(guess->img(), ref), 3.0);
+
+  std::shared_ptr<Task_Align> align = std::make_shared<Task_Align>(refimg, refimg, srcimg, srcimg,
+                                                                   guess, nullptr, flags);
+  align->run(logger);
+  EXPECT_LT(middle_error(align->img(), ref), 3.0);
+}
+
+class NamedImg: public ImgTask
+{
+public:
+  NamedImg(cv::Mat img, std::string filename, int index): ImgTask(img)
+  {
+    m_filename = filename;
+    m_index = index;
+  }
+};
+
+// Loaded alignment should be used only for the image it was saved for.
+TEST(Task_Align, LoadedAlignmentName) {
+  std::shared_ptr<Logger> logger = std::make_shared<Logger>();
+  logger->set_level(Logger::LOG_ERROR);
+  cv::Mat ref = make_texture(cv::Size(512, 384), 1);
+  cv::Mat src = transform_image(ref, 1.0f, 5.0f, -3.0f);
+  const char *filename = "task_align_tests_alignment.yml";
+
+  // Stored transformation is far from the correct one
+  cv::Mat transformation(2, 3, CV_32F), contrast, whitebalance;
+  transformation = 0.0f;
+  transformation.at<float>(0, 0) = 1.0f;
+  transformation.at<float>(1, 1) = 1.0f;
+  transformation.at<float>(0, 2) = 40.0f;
+  transformation.at<float>(1, 2) = 40.0f;
+  make_correction(contrast, whitebalance);
+  AlignmentStore store(0);
+  store.set(1, "saved.png", transformation, contrast, whitebalance);
+  store.save(filename);
+
+  std::shared_ptr<Task_LoadAlignment> loaded = std::make_shared<Task_LoadAlignment>(filename, 0);
+  loaded->run(logger);
+  std::remove(filename);
+
+  FocusStack::align_flags_t flags = static_cast<FocusStack::align_flags_t>(
+    FocusStack::ALIGN_NO_CONTRAST | FocusStack::ALIGN_NO_WHITEBALANCE);
+  std::shared_ptr<ImgTask> refimg = std::make_shared<NamedImg>(ref, "ref.png", 0);
+
+  for (const char *name: {"saved.png", "other.png"})
+  {
+    std::shared_ptr<ImgTask> srcimg = std::make_shared<NamedImg>(src, name, 1);
+    std::shared_ptr<Task_Align> align = std::make_shared<Task_Align>(refimg, refimg, srcimg, srcimg,
+                                                                     nullptr, nullptr, flags);
+    align->set_loaded_alignment(loaded);
+    align->run(logger);
+
+    if (std::string(name) == "saved.png")
+    {
+      EXPECT_GT(middle_error(align->img(), ref), 10.0) << "stored alignment should be used";
+    }
+    else
+    {
+      EXPECT_LT(middle_error(align->img(), ref), 3.0) << "alignment should be computed";
+    }
+  }
+}
+
+// Compare alignment time per image with and without the phase correlation pre-pass.
+TEST(Task_Align, DISABLED_Benchmark) {
+  const int count = 3;
+  cv::Mat ref = make_texture(cv::Size(3072, 2048), 2);
+  std::vector<cv::Mat> srcs;
+  for (int i = 0; i < count; i++)
+  {
+    srcs.push_back(transform_image(ref, 1.0f + 0.002f * i, 10.0f * i - 12.0f, 25.0f - 7.0f * i));
+  }
+
+  const struct { const char *name; int flags; } modes[] = {
+    {"ecc",                   FocusStack::ALIGN_DEFAULT},
+    {"phase correlation+ecc", FocusStack::ALIGN_PHASE_CORRELATION},
+  };
+
+  for (auto mode: modes)
+  {
+    double total = 0;
+    for (const cv::Mat &src: srcs)
+    {
+      double seconds = 0;
+      EXPECT_LT(align_error(ref, src, mode.flags, &seconds), 3.0) << mode.name;
+      total += seconds;
+    }
+
+    std::printf("%-22s %0.3f s per image\n", mode.name, total / count);
+  }
+}
+
+}
@@ -36,7 +36,7 @@ void Task_Denoise::task()
   m_result.create(src.rows, src.cols, CV_32FC2);
   src.copyTo(m_result);
 
-  int levels = Task_Wavelet::levels_for_size(src.size());
+  int levels = Task_Wavelet::levels_for_image(*m_input);
   int lowest_w = src.cols >> levels;
   int lowest_h = src.rows >> levels;
 
@@ -73,6 +73,7 @@ void Task_Denoise::task()
   }
 
   m_valid_area = m_input->valid_area();
+  m_wavelet_levels = m_input->wavelet_levels();
   m_input.reset();
 }
 
@@ -10,6 +10,8 @@ class Task_Denoise: public ImgTask
 public:
   Task_Denoise(std::shared_ptr<ImgTask> input, float level);
 
+  virtual size_t estimate_result_bytes() const { return m_input->img().total() * m_input->img().elemSize(); }
+
 private:
   virtual void task();
 
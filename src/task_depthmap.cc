@@ -4,7 +4,10 @@
 #include "task_merge.hh"
 #include "histogrampercentile.hh"
 #include <opencv2/imgcodecs.hpp>
+#include <opencv2/core/hal/hal.hpp>
+#include <opencv2/core/hal/intrin.hpp>
 #include <stdio.h>
+#include <cmath>
 
 using namespace focusstack;
 
@@ -49,22 +52,23 @@ void Task_Depthmap::task()
     cv::Mat input = m_input->img();
     m_valid_area = m_input->valid_area();
     m_noiselevel = 10.0f; // estimate_noise_level(input);
-    m_guo.create(input.rows, input.cols, CV_32FC(8));
-    m_guo = 0;
+    m_guo.resize(8);
+    for (cv::Mat &sums: m_guo)
+    {
+      sums.create(input.rows, input.cols, CV_32F);
+      sums = 0;
+    }
   }
   m_previous.reset();
 
   // Process input image from Task_FocusMeasure
   if (m_input)
   {
-    cv::Mat input = m_input->img().clone();
+    const cv::Mat &input = m_input->img();
     limit_valid_area(m_input->valid_area());
-    assert(m_guo.size() == input.size());
+    assert(m_guo.at(0).size() == input.size());
 
-    cv::Mat y_nobias = input - m_noiselevel;
-    y_nobias.setTo(1, y_nobias < 1);
-
-    add_to_guo(y_nobias, m_depth);
+    add_to_guo(input, m_depth);
 
     m_input.reset();
   }
@@ -73,7 +77,7 @@ void Task_Depthmap::task()
   if (m_last)
   {
     compute_result();
-    m_guo.release();
+    m_guo.clear();
   }
 }
 
@@ -85,32 +89,204 @@ float Task_Depthmap::estimate_noise_level(const cv::Mat &data)
   return noisefloor;
 }
 
-void Task_Depthmap::add_to_guo(const cv::Mat &y_values, float x)
+#if CV_SIMD
+// Universal intrinsics API differs between OpenCV versions.
+#if CV_VERSION_MAJOR > 4 || (CV_VERSION_MAJOR == 4 && CV_VERSION_MINOR >= 8)
+static inline int depthmap_vlanes() { return cv::VTraits<cv::v_float32>::vlanes(); }
+static inline cv::v_float32 depthmap_add(const cv::v_float32 &a, const cv::v_float32 &b) { return cv::v_add(a, b); }
+static inline cv::v_float32 depthmap_sub(const cv::v_float32 &a, const cv::v_float32 &b) { return cv::v_sub(a, b); }
+static inline cv::v_float32 depthmap_mul(const cv::v_float32 &a, const cv::v_float32 &b) { return cv::v_mul(a, b); }
+#else
+static inline int depthmap_vlanes() { return cv::v_float32::nlanes; }
+static inline cv::v_float32 depthmap_add(const cv::v_float32 &a, const cv::v_float32 &b) { return a + b; }
+static inline cv::v_float32 depthmap_sub(const cv::v_float32 &a, const cv::v_float32 &b) { return a - b; }
+static inline cv::v_float32 depthmap_mul(const cv::v_float32 &a, const cv::v_float32 &b) { return a * b; }
+#endif
+
+static inline void depthmap_accumulate(float *sum, const cv::v_float32 &value)
 {
-  cv::Mat y_log;
-  cv::log(y_values, y_log);
+  cv::v_store(sum, depthmap_add(cv::vx_load(sum), value));
+}
+#endif
 
-  // Refer to "A Simple Algorithm for Fitting a Gaussian Function" by Hongwei Guo:
-  // https://www.researchgate.net/publication/252062037_A_Simple_Algorithm_for_Fitting_a_Gaussian_Function_DSP_Tips_and_Tricks
-  for (int yi = 0; yi < m_guo.rows; yi++)
+// Subtract noise level from one row of focus measures and accumulate the
+// Guo sums. Values are limited to at least 1 so that the logarithm is positive.
+// The y_nobias and y_log buffers hold intermediate values for the row.
+// Operations are done in the same order as in the scalar code, so that
+// the results are identical regardless of SIMD support.
+static void add_row_to_guo(const float *input, float *const guo[8], int count,
+                           float noiselevel, float x, float *y_nobias, float *y_log)
+{
+  int i = 0;
+
+#if CV_SIMD
+  const int N = depthmap_vlanes();
+  cv::v_float32 vnoise = cv::vx_setall_f32(noiselevel);
+  cv::v_float32 vone = cv::vx_setall_f32(1.0f);
+  for (; i + N <= count; i += N)
+  {
+    cv::v_store(y_nobias + i, cv::v_max(depthmap_sub(cv::vx_load(input + i), vnoise), vone));
+  }
+#endif
+
+  for (; i < count; i++)
+  {
+    y_nobias[i] = std::max(input[i] - noiselevel, 1.0f);
+  }
+
+  cv::hal::log32f(y_nobias, y_log, count);
+
+  float x2 = x * x;
+  float x3 = x2 * x;
+  float x4 = x3 * x;
+  i = 0;
+
+#if CV_SIMD
+  cv::v_float32 vx = cv::vx_setall_f32(x);
+  cv::v_float32 vx2 = cv::vx_setall_f32(x2);
+  cv::v_float32 vx3 = cv::vx_setall_f32(x3);
+  cv::v_float32 vx4 = cv::vx_setall_f32(x4);
+  for (; i + N <= count; i += N)
+  {
+    cv::v_float32 y = cv::vx_load(y_nobias + i);
+    cv::v_float32 lny = cv::vx_load(y_log + i);
+    cv::v_float32 y2 = depthmap_mul(y, y);
+    cv::v_float32 xy2 = depthmap_mul(vx, y2);
+    cv::v_float32 x2y2 = depthmap_mul(vx2, y2);
+
+    depthmap_accumulate(guo[0] + i, y2);
+    depthmap_accumulate(guo[1] + i, xy2);
+    depthmap_accumulate(guo[2] + i, x2y2);
+    depthmap_accumulate(guo[3] + i, depthmap_mul(vx3, y2));
+    depthmap_accumulate(guo[4] + i, depthmap_mul(vx4, y2));
+    depthmap_accumulate(guo[5] + i, depthmap_mul(y2, lny));
+    depthmap_accumulate(guo[6] + i, depthmap_mul(xy2, lny));
+    depthmap_accumulate(guo[7] + i, depthmap_mul(x2y2, lny));
+  }
+#endif
+
+  for (; i < count; i++)
+  {
+    float y2 = y_nobias[i] * y_nobias[i];
+    float lny = y_log[i];
+    float xy2 = x * y2;
+    float x2y2 = x2 * y2;
+
+    guo[0][i] += y2;
+    guo[1][i] += xy2;
+    guo[2][i] += x2y2;
+    guo[3][i] += x3 * y2;
+    guo[4][i] += x4 * y2;
+    guo[5][i] += y2 * lny;
+    guo[6][i] += xy2 * lny;
+    guo[7][i] += x2y2 * lny;
+  }
+}
+
+#if CV_SIMD && CV_SIMD_64F
+#if CV_VERSION_MAJOR > 4 || (CV_VERSION_MAJOR == 4 && CV_VERSION_MINOR >= 8)
+static inline cv::v_float64 depthmap_add(const cv::v_float64 &a, const cv::v_float64 &b) { return cv::v_add(a, b); }
+static inline cv::v_float64 depthmap_sub(const cv::v_float64 &a, const cv::v_float64 &b) { return cv::v_sub(a, b); }
+static inline cv::v_float64 depthmap_mul(const cv::v_float64 &a, const cv::v_float64 &b) { return cv::v_mul(a, b); }
+static inline cv::v_float64 depthmap_div(const cv::v_float64 &a, const cv::v_float64 &b) { return cv::v_div(a, b); }
+#else
+static inline cv::v_float64 depthmap_add(const cv::v_float64 &a, const cv::v_float64 &b) { return a + b; }
+static inline cv::v_float64 depthmap_sub(const cv::v_float64 &a, const cv::v_float64 &b) { return a - b; }
+static inline cv::v_float64 depthmap_mul(const cv::v_float64 &a, const cv::v_float64 &b) { return a * b; }
+static inline cv::v_float64 depthmap_div(const cv::v_float64 &a, const cv::v_float64 &b) { return a / b; }
+#endif
+#endif
+
+static inline double depthmap_add(double a, double b) { return a + b; }
+static inline double depthmap_sub(double a, double b) { return a - b; }
+static inline double depthmap_mul(double a, double b) { return a * b; }
+static inline double depthmap_div(double a, double b) { return a / b; }
+
+// Solve the Guo equations A * C = B, where the symmetric matrix A is formed
+// from the sums 0 to 4 and the vector B from the sums 5 to 7.
+// Cramer's rule is used in double precision, because A is badly conditioned
+// when the stack has many layers. Singular systems give non-finite values.
+// T is either double or a vector of doubles.
+template <typename T>
+static inline void solve_guo(const T s[8], T &a, T &b, T &c)
+{
+  T c00 = depthmap_sub(depthmap_mul(s[2], s[4]), depthmap_mul(s[3], s[3]));
+  T c01 = depthmap_sub(depthmap_mul(s[2], s[3]), depthmap_mul(s[1], s[4]));
+  T c02 = depthmap_sub(depthmap_mul(s[1], s[3]), depthmap_mul(s[2], s[2]));
+  T c11 = depthmap_sub(depthmap_mul(s[0], s[4]), depthmap_mul(s[2], s[2]));
+  T c12 = depthmap_sub(depthmap_mul(s[1], s[2]), depthmap_mul(s[0], s[3]));
+  T c22 = depthmap_sub(depthmap_mul(s[0], s[2]), depthmap_mul(s[1], s[1]));
+  T det = depthmap_add(depthmap_add(depthmap_mul(s[0], c00), depthmap_mul(s[1], c01)), depthmap_mul(s[2], c02));
+
+  a = depthmap_div(depthmap_add(depthmap_add(depthmap_mul(c00, s[5]), depthmap_mul(c01, s[6])), depthmap_mul(c02, s[7])), det);
+  b = depthmap_div(depthmap_add(depthmap_add(depthmap_mul(c01, s[5]), depthmap_mul(c11, s[6])), depthmap_mul(c12, s[7])), det);
+  c = depthmap_div(depthmap_add(depthmap_add(depthmap_mul(c02, s[5]), depthmap_mul(c12, s[6])), depthmap_mul(c22, s[7])), det);
+}
+
+// Solve the Gaussian coefficients a, b and c for one row of Guo sums.
+static void solve_guo_row(const float *const guo[8], float *a, float *b, float *c, int count)
+{
+  int i = 0;
+
+#if CV_SIMD && CV_SIMD_64F
+  const int N = depthmap_vlanes();
+  for (; i + N <= count; i += N)
   {
-    for (int xi = 0; xi < m_guo.cols; xi++)
+    cv::v_float64 lo[8], hi[8];
+    for (int k = 0; k < 8; k++)
     {
-      float y = y_values.at<float>(yi, xi);
-      float y2 = y * y;
-      float lny = y_log.at<float>(yi, xi);
-      cv::Vec<float, 8> &guo = m_guo.at<cv::Vec<float, 8> >(yi, xi);
-
-      guo[0] += y2;
-      guo[1] += x * y2;
-      guo[2] += x * x * y2;
-      guo[3] += x * x * x * y2;
-      guo[4] += x * x * x * x * y2;
-      guo[5] += y2 * lny;
-      guo[6] += (x * y2) * lny;
-      guo[7] += (x * x * y2) * lny;
+      cv::v_float32 v = cv::vx_load(guo[k] + i);
+      lo[k] = cv::v_cvt_f64(v);
+      hi[k] = cv::v_cvt_f64_high(v);
     }
+
+    cv::v_float64 a_lo, b_lo, c_lo, a_hi, b_hi, c_hi;
+    solve_guo(lo, a_lo, b_lo, c_lo);
+    solve_guo(hi, a_hi, b_hi, c_hi);
+    cv::v_store(a + i, cv::v_cvt_f32(a_lo, a_hi));
+    cv::v_store(b + i, cv::v_cvt_f32(b_lo, b_hi));
+    cv::v_store(c + i, cv::v_cvt_f32(c_lo, c_hi));
   }
+#endif
+
+  for (; i < count; i++)
+  {
+    double s[8];
+    for (int k = 0; k < 8; k++)
+    {
+      s[k] = guo[k][i];
+    }
+
+    double da, db, dc;
+    solve_guo(s, da, db, dc);
+    a[i] = (float)da;
+    b[i] = (float)db;
+    c[i] = (float)dc;
+  }
+}
+
+void Task_Depthmap::add_to_guo(const cv::Mat &input, float x)
+{
+  // Refer to "A Simple Algorithm for Fitting a Gaussian Function" by Hongwei Guo:
+  // https://www.researchgate.net/publication/252062037_A_Simple_Algorithm_for_Fitting_a_Gaussian_Function_DSP_Tips_and_Tricks
+  // Row stripes are processed in parallel.
+  int cols = input.cols;
+  cv::parallel_for_(cv::Range(0, input.rows), [&](const cv::Range &range) {
+    std::vector<float> y_nobias(cols);
+    std::vector<float> y_log(cols);
+    float *guo[8];
+
+    for (int yi = range.start; yi < range.end; yi++)
+    {
+      for (int i = 0; i < 8; i++)
+      {
+        guo[i] = m_guo[i].ptr<float>(yi);
+      }
+
+      add_row_to_guo(input.ptr<float>(yi), guo, cols, m_noiselevel, x,
+                     y_nobias.data(), y_log.data());
+    }
+  });
 }
 
 cv::Mat Task_Depthmap::mask(int halo_radius) const
@@ -136,11 +312,6 @@ cv::Mat Task_Depthmap::mask(int halo_radius) const
 
 void Task_Depthmap::compute_result()
 {
-  // For each pixel we solve equation of form A * C = B
-  cv::Mat A(3, 3, CV_32FC1);
-  cv::Mat B(3, 1, CV_32FC1);
-  cv::Mat C(3, 1, CV_32FC1);
-
   // Scale results to 1-255, level 0 is left for unknown depth.
   float scaler, offset;
   if (m_maxdepth < 254)
@@ -154,50 +325,60 @@ void Task_Depthmap::compute_result()
     offset = 1;
   }
 
-  m_gauss_mean.create(m_guo.rows, m_guo.cols, CV_32FC1);
-  m_gauss_dev.create(m_guo.rows, m_guo.cols, CV_32FC1);
-  m_gauss_amp.create(m_guo.rows, m_guo.cols, CV_32FC1);
+  int rows = m_guo.at(0).rows;
+  int cols = m_guo.at(0).cols;
+  m_gauss_mean.create(rows, cols, CV_32FC1);
+  m_gauss_dev.create(rows, cols, CV_32FC1);
+  m_gauss_amp.create(rows, cols, CV_32FC1);
 
-  for (int yi = 0; yi < m_guo.rows; yi++)
-  {
-    for (int xi = 0; xi < m_guo.cols; xi++)
+  // For each pixel we solve equation of form A * C = B.
+  // Row stripes are processed in parallel.
+  cv::parallel_for_(cv::Range(0, rows), [&](const cv::Range &range) {
+    std::vector<float> coeffs_a(cols);
+    std::vector<float> coeffs_b(cols);
+    std::vector<float> coeffs_c(cols);
+    const float *guo[8];
+
+    for (int yi = range.start; yi < range.end; yi++)
     {
-      cv::Vec<float, 8> &guo = m_guo.at<cv::Vec<float, 8> >(yi, xi);
-      A.at<float>(0, 0) = guo[0];
-      A.at<float>(0, 1) = A.at<float>(1, 0) = guo[1];
-      A.at<float>(0, 2) = A.at<float>(1, 1) = A.at<float>(2, 0) = guo[2];
-      A.at<float>(2, 1) = A.at<float>(1, 2) = guo[3];
-      A.at<float>(2, 2) = guo[4];
-      B.at<float>(0, 0) = guo[5];
-      B.at<float>(1, 0) = guo[6];
-      B.at<float>(2, 0) = guo[7];
-
-      cv::solve(A, B, C, cv::DECOMP_QR);
-
-      // Compute gaussian parameters
-      // Equations (5) to (7)
-      float a = C.at<float>(0, 0);
-      float b = C.at<float>(1, 0);
-      float c = C.at<float>(2, 0);
-      float mean = -b / (2 * c);
-      float dev = sqrtf(-1 / (2 * c));
-      float amp = expf(a - (b * b) / (4 * c));
-
-      // c should always be negative for valid gaussians.
-      if (c < -0.00001f && mean >= 0 && mean <= m_maxdepth)
+      for (int i = 0; i < 8; i++)
       {
-        m_gauss_mean.at<float>(yi, xi) = mean * scaler + offset;
-        m_gauss_dev.at<float>(yi, xi) = dev * scaler;
-        m_gauss_amp.at<float>(yi, xi) = amp;
+        guo[i] = m_guo[i].ptr<float>(yi);
       }
-      else
+
+      solve_guo_row(guo, coeffs_a.data(), coeffs_b.data(), coeffs_c.data(), cols);
+
+      float *gauss_mean = m_gauss_mean.ptr<float>(yi);
+      float *gauss_dev = m_gauss_dev.ptr<float>(yi);
+      float *gauss_amp = m_gauss_amp.ptr<float>(yi);
+
+      for (int xi = 0; xi < cols; xi++)
       {
-        m_gauss_mean.at<float>(yi, xi) = 0;
-        m_gauss_dev.at<float>(yi, xi) = 255;
-        m_gauss_amp.at<float>(yi, xi) = 0;
+        // Compute gaussian parameters
+        // Equations (5) to (7)
+        float a = coeffs_a[xi];
+        float b = coeffs_b[xi];
+        float c = coeffs_c[xi];
+        float mean = -b / (2 * c);
+
+        // c should always be negative for valid gaussians.
+        // Singular systems give non-finite coefficients.
+        if (std::isfinite(a) && std::isfinite(b) && std::isfinite(c) &&
+            c < -0.00001f && mean >= 0 && mean <= m_maxdepth)
+        {
+          gauss_mean[xi] = mean * scaler + offset;
+          gauss_dev[xi] = sqrtf(-1 / (2 * c)) * scaler;
+          gauss_amp[xi] = expf(a - (b * b) / (4 * c));
+        }
+        else
+        {
+          gauss_mean[xi] = 0;
+          gauss_dev[xi] = 255;
+          gauss_amp[xi] = 0;
+        }
       }
     }
-  }
+  });
 
   m_gauss_mean.convertTo(m_result, CV_8UC1);
   
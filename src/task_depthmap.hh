@@ -19,6 +19,16 @@ public:
 
   const cv::Mat &depthmap() const { return m_result; }
 
+  // Accumulated sums of Guo's algorithm, see m_guo below.
+  // Released after the last layer has been processed.
+  const std::vector<cv::Mat> &guo_sums() const { return m_guo; }
+
+  // Fitted Gaussian for each pixel, available after the last layer.
+  // Mean is scaled to the depthmap range, pixels without a fit have zero amplitude.
+  const cv::Mat &gauss_mean() const { return m_gauss_mean; }
+  const cv::Mat &gauss_dev() const { return m_gauss_dev; }
+  const cv::Mat &gauss_amp() const { return m_gauss_amp; }
+
   int maxdepth() const { return m_maxdepth; }
 
   // Form a rough mask of known depth values.
@@ -31,8 +41,8 @@ private:
   // Estimate the background noise level (camera noise level)
   float estimate_noise_level(const cv::Mat &data);
 
-  // Add one depth level to m_guo estimation matrix.
-  void add_to_guo(const cv::Mat &y_values, float x);
+  // Add one depth level of focus measures to m_guo estimation matrices.
+  void add_to_guo(const cv::Mat &input, float x);
 
   // Compute the final fitted Gaussian function for each pixel
   void compute_result();
@@ -42,7 +52,8 @@ private:
   // https://www.researchgate.net/publication/252062037_A_Simple_Algorithm_for_Fitting_a_Gaussian_Function_DSP_Tips_and_Tricks
   // The noiselevel is a constant background level of the data,
   // estimated from the first image in the stack.
-  // The matrix m_guo is image-sized matrix with 8 channels:
+  // The m_guo vector has 8 image-sized matrices, stored separately
+  // so that the sums can be updated with vector instructions:
   // 0: sum(y²)
   // 1: sum(x y²)
   // 2: sum(x² y²)
@@ -53,7 +64,7 @@ private:
   // 7: sum(x² y² ln y)
   int m_maxdepth;
   float m_noiselevel;
-  cv::Mat m_guo;
+  std::vector<cv::Mat> m_guo;
 
   cv::Mat m_gauss_mean;
   cv::Mat m_gauss_dev;
@@ -0,0 +1,279 @@
+#include <gtest/gtest.h>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include "task_depthmap.hh"
+#include "logger.hh"
+
+namespace focusstack {
+
+// Focus measures of a stack where the sharpest layer changes across the image.
+// The left edge has only a constant background level, which gives no valid depth.
+static std::vector<cv::Mat> make_focus_measures(cv::Size size, int layers, int seed)
+{
+  std::mt19937 rng(seed);
+  std::uniform_real_distribution<float> noise(0.0f, 5.0f);
+  std::vector<cv::Mat> result;
+
+  for (int layer = 0; layer < layers; layer++)
+  {
+    cv::Mat img(size, CV_32F);
+    for (int y = 0; y < size.height; y++)
+    {
+      for (int x = 0; x < size.width; x++)
+      {
+        float mean = 1.0f + (layers - 2.0f) * x / size.width;
+        float dev = 1.0f + 2.0f * y / size.height;
+        float d = (layer - mean) / dev;
+        float v = 8.0f;
+        if (x >= 4) v += noise(rng) + 200.0f * std::exp(-0.5f * d * d);
+        img.at<float>(y, x) = v;
+      }
+    }
+    result.push_back(img);
+  }
+
+  return result;
+}
+
+static std::shared_ptr<Task_Depthmap> run_depthmap(const std::vector<cv::Mat> &layers)
+{
+  std::shared_ptr<Logger> logger = std::make_shared<Logger>();
+  std::shared_ptr<Task_Depthmap> depthmap;
+
+  for (size_t i = 0; i < layers.size(); i++)
+  {
+    std::shared_ptr<ImgTask> input = std::make_shared<ImgTask>(layers.at(i));
+    depthmap = std::make_shared<Task_Depthmap>(input, i, i == layers.size() - 1, depthmap);
+    depthmap->run(logger);
+  }
+
+  return depthmap;
+}
+
+// Straightforward per-pixel accumulation of the Guo sums, as 8-channel matrix.
+static void reference_add_to_guo(cv::Mat &guo, const cv::Mat &input, float noiselevel, float x)
+{
+  cv::Mat y_values = input - noiselevel;
+  y_values.setTo(1, y_values < 1);
+  cv::Mat y_log;
+  cv::log(y_values, y_log);
+
+  for (int yi = 0; yi < guo.rows; yi++)
+  {
+    for (int xi = 0; xi < guo.cols; xi++)
+    {
+      float y = y_values.at<float>(yi, xi);
+      float y2 = y * y;
+      float lny = y_log.at<float>(yi, xi);
+      cv::Vec<float, 8> &g = guo.at<cv::Vec<float, 8> >(yi, xi);
+
+      g[0] += y2;
+      g[1] += x * y2;
+      g[2] += x * x * y2;
+      g[3] += x * x * x * y2;
+      g[4] += x * x * x * x * y2;
+      g[5] += y2 * lny;
+      g[6] += (x * y2) * lny;
+      g[7] += (x * x * y2) * lny;
+    }
+  }
+}
+
+// Per-pixel Gaussian fit with cv::solve(). Double precision is used for the
+// reference, because single precision QR decomposition has large rounding
+// errors of its own when the stack has many layers.
+static void reference_fit(const cv::Mat &guo, int maxdepth, int type, cv::Mat &mean, cv::Mat &dev, cv::Mat &amp)
+{
+  float scaler = 255.0f / (maxdepth + 1);
+  float offset = scaler;
+
+  mean.create(guo.size(), CV_32F);
+  dev.create(guo.size(), CV_32F);
+  amp.create(guo.size(), CV_32F);
+  cv::Mat A(3, 3, type), B(3, 1, type), C;
+  cv::Mat A32(3, 3, CV_32F), B32(3, 1, CV_32F);
+  for (int yi = 0; yi < guo.rows; yi++)
+  {
+    for (int xi = 0; xi < guo.cols; xi++)
+    {
+      cv::Vec<float, 8> g = guo.at<cv::Vec<float, 8> >(yi, xi);
+      A32.at<float>(0, 0) = g[0];
+      A32.at<float>(0, 1) = A32.at<float>(1, 0) = g[1];
+      A32.at<float>(0, 2) = A32.at<float>(1, 1) = A32.at<float>(2, 0) = g[2];
+      A32.at<float>(2, 1) = A32.at<float>(1, 2) = g[3];
+      A32.at<float>(2, 2) = g[4];
+      B32.at<float>(0) = g[5];
+      B32.at<float>(1) = g[6];
+      B32.at<float>(2) = g[7];
+      A32.convertTo(A, type);
+      B32.convertTo(B, type);
+      cv::solve(A, B, C, cv::DECOMP_QR);
+      C.convertTo(C, CV_32F);
+
+      float a = C.at<float>(0), b = C.at<float>(1), c = C.at<float>(2);
+      float m = -b / (2 * c);
+      if (c < -0.00001f && m >= 0 && m <= maxdepth)
+      {
+        mean.at<float>(yi, xi) = m * scaler + offset;
+        dev.at<float>(yi, xi) = sqrtf(-1 / (2 * c)) * scaler;
+        amp.at<float>(yi, xi) = expf(a - (b * b) / (4 * c));
+      }
+      else
+      {
+        mean.at<float>(yi, xi) = 0;
+        dev.at<float>(yi, xi) = 255;
+        amp.at<float>(yi, xi) = 0;
+      }
+    }
+  }
+}
+
+static cv::Mat reference_guo(const std::vector<cv::Mat> &layers)
+{
+  cv::Mat guo(layers.front().size(), CV_32FC(8));
+  guo = 0;
+  for (size_t i = 0; i < layers.size(); i++)
+  {
+    reference_add_to_guo(guo, layers.at(i), 10.0f, i);
+  }
+  return guo;
+}
+
+static void expect_near_relative(const cv::Mat &result, const cv::Mat &expected, const char *name)
+{
+  ASSERT_EQ(result.size(), expected.size()) << name;
+  for (int y = 0; y < result.rows; y++)
+  {
+    for (int x = 0; x < result.cols; x++)
+    {
+      float e = expected.at<float>(y, x);
+      ASSERT_NEAR(result.at<float>(y, x), e, 1e-4f * std::max(1.0f, std::abs(e))) << name << " at " << x << "," << y;
+    }
+  }
+}
+
+// Vectorized accumulation must give identical sums to the per-pixel version.
+TEST(Task_Depthmap, AccumulationIdentical) {
+  // Odd width exercises the non-vectorized tail of rows
+  std::vector<cv::Mat> layers = make_focus_measures(cv::Size(101, 37), 10, 1);
+  std::shared_ptr<Logger> logger = std::make_shared<Logger>();
+  std::shared_ptr<Task_Depthmap> task;
+  for (size_t i = 0; i < layers.size(); i++)
+  {
+    std::shared_ptr<ImgTask> input = std::make_shared<ImgTask>(layers.at(i));
+    task = std::make_shared<Task_Depthmap>(input, i, false, task);
+    task->run(logger);
+  }
+
+  cv::Mat expected = reference_guo(layers);
+  ASSERT_EQ(task->guo_sums().size(), 8u);
+  for (int k = 0; k < 8; k++)
+  {
+    const cv::Mat &sums = task->guo_sums().at(k);
+    ASSERT_EQ(sums.size(), expected.size());
+    for (int y = 0; y < sums.rows; y++)
+    {
+      for (int x = 0; x < sums.cols; x++)
+      {
+        ASSERT_EQ(sums.at<float>(y, x), (expected.at<cv::Vec<float, 8> >(y, x)[k])) << "sum " << k << " at " << x << "," << y;
+      }
+    }
+  }
+}
+
+// Closed-form fit must match the per-pixel version.
+TEST(Task_Depthmap, MatchesPerPixelFit) {
+  // Odd width exercises the non-vectorized tail of rows
+  for (int count: {3, 10, 40})
+  {
+    std::vector<cv::Mat> layers = make_focus_measures(cv::Size(101, 37), count, count);
+    std::shared_ptr<Task_Depthmap> task = run_depthmap(layers);
+
+    cv::Mat mean, dev, amp;
+    reference_fit(reference_guo(layers), count - 1, CV_64F, mean, dev, amp);
+    expect_near_relative(task->gauss_mean(), mean, "mean");
+    expect_near_relative(task->gauss_dev(), dev, "dev");
+    expect_near_relative(task->gauss_amp(), amp, "amp");
+
+    // Background without a focus peak should have unknown depth
+    for (int y = 0; y < mean.rows; y++)
+    {
+      ASSERT_EQ(task->depthmap().at<uint8_t>(y, 0), 0);
+    }
+  }
+}
+
+// A stack with two layers can not be fitted, so depth should be unknown everywhere.
+TEST(Task_Depthmap, SingularSystem) {
+  std::vector<cv::Mat> layers = make_focus_measures(cv::Size(40, 20), 2, 3);
+  std::shared_ptr<Task_Depthmap> task = run_depthmap(layers);
+  ASSERT_EQ(cv::countNonZero(task->depthmap()), 0);
+  ASSERT_EQ(cv::countNonZero(task->gauss_amp()), 0);
+}
+
+// Compare accumulation speed per layer against the per-pixel version.
+TEST(Task_Depthmap, DISABLED_AccumulationBenchmark) {
+  const int count = 4;
+  cv::Size size(3000, 2000);
+  std::vector<cv::Mat> layers = make_focus_measures(size, count, 2);
+  double megapixels = size.area() * count / 1e6;
+  std::shared_ptr<Logger> logger = std::make_shared<Logger>();
+
+  cv::Mat guo(size, CV_32FC(8));
+  guo = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < count; i++)
+  {
+    reference_add_to_guo(guo, layers.at(i), 10.0f, i);
+  }
+  double reference = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  guo.release();
+
+  std::shared_ptr<Task_Depthmap> depthmap;
+  start = std::chrono::steady_clock::now();
+  for (int i = 0; i < count; i++)
+  {
+    std::shared_ptr<ImgTask> input = std::make_shared<ImgTask>(layers.at(i));
+    depthmap = std::make_shared<Task_Depthmap>(input, i, false, depthmap);
+    depthmap->run(logger);
+  }
+  double optimized = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  std::printf("per-pixel %0.1f MP/s, optimized %0.1f MP/s\n", megapixels / reference, megapixels / optimized);
+}
+
+// Compare Gaussian fit speed against per-pixel cv::solve().
+TEST(Task_Depthmap, DISABLED_FitBenchmark) {
+  const int count = 10;
+  cv::Size size(1500, 1000);
+  std::vector<cv::Mat> layers = make_focus_measures(size, count, 4);
+  std::shared_ptr<Logger> logger = std::make_shared<Logger>();
+
+  cv::Mat guo = reference_guo(layers);
+  cv::Mat mean, dev, amp;
+  auto start = std::chrono::steady_clock::now();
+  reference_fit(guo, count - 1, CV_32F, mean, dev, amp);
+  double reference = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  guo.release();
+
+  std::shared_ptr<Task_Depthmap> depthmap;
+  for (int i = 0; i < count; i++)
+  {
+    std::shared_ptr<ImgTask> input = std::make_shared<ImgTask>(layers.at(i));
+    depthmap = std::make_shared<Task_Depthmap>(input, i, false, depthmap);
+    depthmap->run(logger);
+  }
+
+  // Final task without input only computes the fit
+  depthmap = std::make_shared<Task_Depthmap>(nullptr, count - 1, true, depthmap);
+  start = std::chrono::steady_clock::now();
+  depthmap->run(logger);
+  double optimized = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  std::printf("cv::solve() %0.1f Mpixels/s, closed form %0.1f Mpixels/s\n",
+              size.area() / reference / 1e6, size.area() / optimized / 1e6);
+}
+
+}
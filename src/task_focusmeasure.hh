@@ -11,6 +11,8 @@ class Task_FocusMeasure: public ImgTask
 public:
     Task_FocusMeasure(std::shared_ptr<ImgTask> input, float radius = 0, float threshold = /*200*/0.0f);
 
+    virtual size_t estimate_result_bytes() const { return m_input->img().total() * sizeof(float); }
+
 private:
     virtual void task();
     std::shared_ptr<ImgTask> m_input;
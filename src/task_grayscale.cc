@@ -1,5 +1,6 @@
 #include "task_grayscale.hh"
 #include <opencv2/imgproc/imgproc.hpp>
+#include <opencv2/core/utility.hpp>
 #include <cstdio>
 
 using namespace focusstack;
@@ -21,6 +22,11 @@ Task_Grayscale::Task_Grayscale(std::shared_ptr<ImgTask> input, std::shared_ptr<T
   }
 }
 
+size_t Task_Grayscale::estimate_result_bytes() const
+{
+  return m_input->img().total();
+}
+
 void Task_Grayscale::task()
 {
   cv::Mat img = m_input->img();
@@ -41,11 +47,14 @@ void Task_Grayscale::task()
       do_pca();
     }
 
-    cv::Mat channels[3];
-    cv::split(img, channels);
-    m_result = channels[0] * m_weights.at<float>(0)
-             + channels[1] * m_weights.at<float>(1)
-             + channels[2] * m_weights.at<float>(2);
+    m_result.create(img.rows, img.cols, CV_8U);
+    const float *weights = m_weights.ptr<float>();
+    cv::parallel_for_(cv::Range(0, img.rows), [&](const cv::Range &range) {
+      for (int y = range.start; y < range.end; y++)
+      {
+        convert_row(img.ptr<uint8_t>(y), m_result.ptr<uint8_t>(y), img.cols, weights);
+      }
+    });
   }
 
   m_valid_area = m_input->valid_area();
@@ -53,6 +62,16 @@ void Task_Grayscale::task()
   m_reference.reset();
 }
 
+void Task_Grayscale::convert_row(const uint8_t *src, uint8_t *dst, int cols, const float *weights)
+{
+  for (int x = 0; x < cols; x++)
+  {
+    dst[x] = cv::saturate_cast<uint8_t>(src[3 * x] * weights[0]
+                                      + src[3 * x + 1] * weights[1]
+                                      + src[3 * x + 2] * weights[2]);
+  }
+}
+
 // Collect samples from image and do principal component analysis
 // to determine the best weights for grayscale conversion.
 void Task_Grayscale::do_pca()
@@ -14,6 +14,13 @@ public:
 
   const cv::Mat &weights() const { return m_weights; };
 
+  // Convert a row of 8-bit color pixels with the given weights, rounding once.
+  // Task_Align uses this also, so that reference and aligned grayscale images
+  // get identical values for identical pixels.
+  static void convert_row(const uint8_t *src, uint8_t *dst, int cols, const float *weights);
+
+  virtual size_t estimate_result_bytes() const;
+
 private:
   virtual void task();
 
@@ -1,12 +1,17 @@
 #include "task_loadimg.hh"
 #include "task_wavelet.hh"
+#include "mappedfile.hh"
+#include "imageloader.hh"
 #include <opencv2/core/core.hpp>
 #include <opencv2/imgcodecs.hpp>
 #include <fstream>
+#include <cctype>
+#include <cstring>
 
 using namespace focusstack;
 
-Task_LoadImg::Task_LoadImg(std::string filename, float wait_images)
+Task_LoadImg::Task_LoadImg(std::string filename, float wait_images):
+  m_memimg(false), m_padded(false), m_prefetched(false)
 {
   m_filename = filename;
   m_name = "Load " + filename;
@@ -15,7 +20,8 @@ Task_LoadImg::Task_LoadImg(std::string filename, float wait_images)
                       + std::chrono::milliseconds((int)(m_wait_images * 1000));
 }
 
-Task_LoadImg::Task_LoadImg(std::string name, const cv::Mat &img)
+Task_LoadImg::Task_LoadImg(std::string name, const cv::Mat &img):
+  m_memimg(true), m_padded(false), m_prefetched(false)
 {
   m_filename = name;
   m_name = "Memory image " + name;
@@ -32,6 +38,11 @@ bool Task_LoadImg::ready_to_run()
     return false;
   }
 
+  if (!m_prefetched && !m_loader.expired())
+  {
+    return false; // Image loader has not decoded the image yet
+  }
+
   // Wait for image files to appear.
   // This is useful for processing images as soon as they appear.
   if (m_wait_images > 0 && std::chrono::system_clock::now() < m_wait_images_until)
@@ -46,34 +57,169 @@ bool Task_LoadImg::ready_to_run()
   return true;
 }
 
-void Task_LoadImg::task()
+static bool is_pnm(const std::string &filename)
 {
-  if (!m_result.data)
+  size_t pos = filename.find_last_of('.');
+  if (pos == std::string::npos) return false;
+
+  std::string ext = filename.substr(pos + 1);
+  for (char &c: ext) c = std::tolower(c);
+  return ext == "pgm" || ext == "ppm" || ext == "pnm";
+}
+
+// Parse header of binary PGM (P5) or PPM (P6) file.
+// Returns offset of pixel data, or 0 if the header is not supported.
+static size_t parse_pnm_header(const uint8_t *data, size_t size,
+                               int &width, int &height, int &channels, int &maxval)
+{
+  if (size < 2 || data[0] != 'P' || (data[1] != '5' && data[1] != '6'))
   {
-    m_result = cv::imread(m_filename, cv::IMREAD_ANYCOLOR);
+    return 0;
   }
 
-  while (!m_result.data && std::chrono::system_clock::now() < m_wait_images_until)
+  channels = (data[1] == '5') ? 1 : 3;
+
+  size_t pos = 2;
+  int values[3];
+  for (int i = 0; i < 3; i++)
   {
-    std::this_thread::sleep_for(std::chrono::milliseconds(100));
-    m_result = cv::imread(m_filename, cv::IMREAD_ANYCOLOR);
+    // Skip whitespace and comments
+    while (pos < size && (std::isspace(data[pos]) || data[pos] == '#'))
+    {
+      if (data[pos] == '#')
+      {
+        while (pos < size && data[pos] != '\n') pos++;
+      }
+      else
+      {
+        pos++;
+      }
+    }
+
+    if (pos >= size || !std::isdigit(data[pos])) return 0;
+
+    int value = 0;
+    while (pos < size && std::isdigit(data[pos]))
+    {
+      value = value * 10 + (data[pos++] - '0');
+      if (value > 1000000) return 0;
+    }
+    values[i] = value;
   }
 
-  if (!m_result.data)
+  // Single whitespace character separates the header from pixel data
+  if (pos >= size || !std::isspace(data[pos])) return 0;
+  pos++;
+
+  width = values[0];
+  height = values[1];
+  maxval = values[2];
+  if (width <= 0 || height <= 0 || maxval <= 0 || maxval > 65535) return 0;
+
+  return pos;
+}
+
+// Fill the area outside valid area by reflecting it, like cv::copyMakeBorder() with BORDER_REFLECT.
+static void fill_reflect_border(cv::Mat &img, cv::Rect valid)
+{
+  size_t pixelsize = img.elemSize();
+
+  for (int y = valid.y; y < valid.y + valid.height; y++)
   {
-    throw std::runtime_error("Could not load " + m_filename);
+    uint8_t *row = img.ptr<uint8_t>(y);
+    for (int x = 0; x < img.cols; x++)
+    {
+      if (x == valid.x) x = valid.x + valid.width;
+      if (x >= img.cols) break;
+
+      int src = valid.x + cv::borderInterpolate(x - valid.x, valid.width, cv::BORDER_REFLECT);
+      std::memcpy(row + x * pixelsize, row + src * pixelsize, pixelsize);
+    }
+  }
+
+  for (int y = 0; y < img.rows; y++)
+  {
+    if (y == valid.y) y = valid.y + valid.height;
+    if (y >= img.rows) break;
+
+    int src = valid.y + cv::borderInterpolate(y - valid.y, valid.height, cv::BORDER_REFLECT);
+    std::memcpy(img.ptr<uint8_t>(y), img.ptr<uint8_t>(src), img.cols * pixelsize);
+  }
+}
+
+bool Task_LoadImg::load_pnm()
+{
+  MappedFile file(m_filename);
+  if (!file.is_open()) return false;
+
+  int width, height, channels, maxval;
+  size_t offset = parse_pnm_header(file.data(), file.size(), width, height, channels, maxval);
+  if (offset == 0) return false;
+
+  int bytes = (maxval > 255) ? 2 : 1;
+  size_t rowbytes = (size_t)width * channels * bytes;
+  if (file.size() - offset < rowbytes * height)
+  {
+    return false; // File is incomplete, possibly still being written
+  }
+
+  m_orig_size = cv::Size(width, height);
+  cv::Size expanded;
+  Task_Wavelet::levels_for_size(m_orig_size, &expanded);
+  m_valid_area = cv::Rect(cv::Point((expanded.width - width) / 2, (expanded.height - height) / 2), m_orig_size);
+  m_result.create(expanded.height, expanded.width, CV_8UC(channels));
+
+  // Convert values the same way as cv::imread(): 8-bit values are used
+  // as is regardless of maxval and only the high byte of 16-bit values is used.
+  // PPM files are in RGB order, OpenCV uses BGR
+  int swap = (channels == 3) ? 2 : 0;
+  for (int y = 0; y < height; y++)
+  {
+    const uint8_t *src = file.data() + offset + y * rowbytes;
+    uint8_t *dst = m_result.ptr<uint8_t>(m_valid_area.y + y) + m_valid_area.x * channels;
+
+    if (bytes == 1 && channels == 1)
+    {
+      std::memcpy(dst, src, width);
+      continue;
+    }
+
+    for (int i = 0; i < width * channels; i += channels)
+    {
+      for (int ch = 0; ch < channels; ch++)
+      {
+        dst[i + ch] = src[(i + (swap ? swap - ch : ch)) * bytes];
+      }
+    }
   }
 
+  fill_reflect_border(m_result, m_valid_area);
+  m_padded = true;
+  return true;
+}
+
+void Task_LoadImg::load_file()
+{
+  if (is_pnm(m_filename) && load_pnm())
+  {
+    return;
+  }
+
+  m_result = cv::imread(m_filename, cv::IMREAD_ANYCOLOR);
+  if (m_result.data)
+  {
+    expand();
+  }
+}
+
+void Task_LoadImg::expand()
+{
   m_orig_size = m_result.size();
   m_valid_area = cv::Rect(0, 0, m_result.cols, m_result.rows);
 
   // Expand image width & height to multiple of (1 << levels) as required by wavelet decomposition
   cv::Size expanded;
-  int levels = Task_Wavelet::levels_for_size(m_orig_size, &expanded);
-  std::string name = basename();
-  m_logger->verbose("%s has resolution %dx%d, using %d wavelet levels and expanding to %dx%d\n",
-                    name.c_str(), m_orig_size.width, m_orig_size.height, levels,
-                    expanded.width, expanded.height);
+  Task_Wavelet::levels_for_size(m_orig_size, &expanded);
 
   if (expanded != m_orig_size)
   {
@@ -89,4 +235,64 @@ void Task_LoadImg::task()
     m_result = tmp;
     m_valid_area = cv::Rect(cv::Point(expand_x / 2, expand_y / 2), m_orig_size);
   }
+
+  m_padded = true;
+}
+
+void Task_LoadImg::prefetch()
+{
+  try
+  {
+    if (!m_result.data)
+    {
+      load_file();
+    }
+  }
+  catch (std::exception &)
+  {
+    // Loading is tried again in task(), which reports the error
+    m_result = cv::Mat();
+  }
+
+  m_prefetched = true;
+}
+
+void Task_LoadImg::task()
+{
+  if (m_prefetched)
+  {
+    std::shared_ptr<ImageLoader> loader = m_loader.lock();
+    if (loader)
+    {
+      loader->consumed();
+    }
+  }
+
+  if (!m_result.data)
+  {
+    load_file();
+  }
+
+  while (!m_result.data && std::chrono::system_clock::now() < m_wait_images_until)
+  {
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    load_file();
+  }
+
+  if (!m_result.data)
+  {
+    throw std::runtime_error("Could not load " + m_filename);
+  }
+
+  if (!m_padded)
+  {
+    expand(); // Image given in memory
+  }
+
+  cv::Size expanded;
+  int levels = Task_Wavelet::levels_for_size(m_orig_size, &expanded);
+  std::string name = basename();
+  m_logger->verbose("%s has resolution %dx%d, using %d wavelet levels and expanding to %dx%d\n",
+                    name.c_str(), m_orig_size.width, m_orig_size.height, levels,
+                    expanded.width, expanded.height);
 }
@@ -5,6 +5,8 @@
 
 namespace focusstack {
 
+class ImageLoader;
+
 class Task_LoadImg: public ImgTask
 {
 public:
@@ -14,14 +16,33 @@ public:
   virtual bool ready_to_run();
 
   cv::Size orig_size() const { return m_orig_size; }
+  bool is_memory_image() const { return m_memimg; }
+
+  // When loader is set, the task waits for it to decode the image by
+  // calling prefetch() and then only takes the decoded image into use.
+  void set_loader(std::shared_ptr<ImageLoader> loader) { m_loader = loader; }
+  void prefetch();
+  bool is_prefetched() const { return m_prefetched; }
 
 private:
   virtual void task();
 
+  // Load the image and add the wavelet expansion border
+  void load_file();
+  void expand();
+
+  // Binary PGM and PPM files are memory mapped and decoded directly into an
+  // image that has the wavelet expansion border. Returns false if the file
+  // is not supported, so that it can be loaded with cv::imread() instead.
+  bool load_pnm();
+
   float m_wait_images;
   std::chrono::system_clock::time_point m_wait_images_until;
   bool m_memimg;
   cv::Size m_orig_size;
+  bool m_padded; // Image has the wavelet expansion border
+  std::weak_ptr<ImageLoader> m_loader;
+  std::atomic<bool> m_prefetched;
 };
 
 
@@ -0,0 +1,161 @@
+#include <gtest/gtest.h>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <random>
+#include <opencv2/imgcodecs.hpp>
+#include "task_loadimg.hh"
+#include "imageloader.hh"
+#include "task_wavelet.hh"
+#include "logger.hh"
+
+namespace focusstack {
+
+// Write binary PGM or PPM file with random contents, returns the pixel values.
+static std::vector<uint8_t> write_pnm(const char *filename, int width, int height, int channels, int maxval)
+{
+  std::mt19937 rng(width * height + channels);
+  std::uniform_int_distribution<int> dist(0, maxval);
+  int bytes = (maxval > 255) ? 2 : 1;
+  std::vector<uint8_t> data((size_t)width * height * channels * bytes);
+  for (size_t i = 0; i < data.size(); i += bytes)
+  {
+    int v = dist(rng);
+    if (bytes == 2) data[i + 1] = v & 0xFF;
+    data[i] = (bytes == 2) ? (v >> 8) : v;
+  }
+
+  std::ofstream file(filename, std::ios::binary);
+  file << ((channels == 1) ? "P5" : "P6") << "\n# test image\n" << width << " " << height << "\n" << maxval << "\n";
+  file.write(reinterpret_cast<const char*>(data.data()), data.size());
+  return data;
+}
+
+static std::shared_ptr<Task_LoadImg> load(const char *filename)
+{
+  std::shared_ptr<Logger> logger = std::make_shared<Logger>();
+  std::shared_ptr<Task_LoadImg> task = std::make_shared<Task_LoadImg>(filename);
+  task->run(logger);
+  return task;
+}
+
+// Compare loaded image against cv::imread() and cv::copyMakeBorder().
+static void check_against_imread(const char *filename)
+{
+  std::shared_ptr<Task_LoadImg> task = load(filename);
+  cv::Mat orig = cv::imread(filename, cv::IMREAD_ANYCOLOR);
+  ASSERT_EQ(task->orig_size(), orig.size());
+
+  cv::Size expanded;
+  Task_Wavelet::levels_for_size(orig.size(), &expanded);
+  int expand_x = expanded.width - orig.cols;
+  int expand_y = expanded.height - orig.rows;
+  cv::Mat expected;
+  cv::copyMakeBorder(orig, expected, expand_y / 2, expand_y - expand_y / 2,
+                     expand_x / 2, expand_x - expand_x / 2, cv::BORDER_REFLECT);
+
+  const cv::Mat &img = task->img();
+  ASSERT_EQ(img.size(), expected.size());
+  ASSERT_EQ(img.type(), expected.type());
+  ASSERT_EQ(task->valid_area(), cv::Rect(cv::Point(expand_x / 2, expand_y / 2), orig.size()));
+
+  for (int y = 0; y < img.rows; y++)
+  {
+    for (size_t x = 0; x < img.cols * img.elemSize(); x++)
+    {
+      ASSERT_EQ(img.ptr<uint8_t>(y)[x], expected.ptr<uint8_t>(y)[x]) << "at " << x << "," << y;
+    }
+  }
+}
+
+TEST(Task_LoadImg, PGMMatchesImread) {
+  const char *filename = "task_loadimg_tests.pgm";
+  write_pnm(filename, 301, 157, 1, 255);
+  check_against_imread(filename);
+  std::remove(filename);
+}
+
+TEST(Task_LoadImg, PPMMatchesImread) {
+  const char *filename = "task_loadimg_tests.ppm";
+  write_pnm(filename, 203, 98, 3, 200);
+  check_against_imread(filename);
+  std::remove(filename);
+}
+
+// 16-bit files are reduced to 8 bits by taking the high byte.
+TEST(Task_LoadImg, PGM16Bit) {
+  const char *filename = "task_loadimg_tests_16.pgm";
+  std::vector<uint8_t> data = write_pnm(filename, 64, 64, 1, 65535);
+  std::shared_ptr<Task_LoadImg> task = load(filename);
+  std::remove(filename);
+
+  cv::Mat img = task->img()(task->valid_area());
+  ASSERT_EQ(img.size(), cv::Size(64, 64));
+  for (int y = 0; y < img.rows; y++)
+  {
+    for (int x = 0; x < img.cols; x++)
+    {
+      ASSERT_EQ(img.at<uint8_t>(y, x), data[(y * 64 + x) * 2]);
+    }
+  }
+}
+
+// Images decoded by the loader should be taken into use by the load tasks.
+TEST(Task_LoadImg, LoaderPrefetch) {
+  const int count = 5;
+  std::shared_ptr<Logger> logger = std::make_shared<Logger>();
+  logger->set_level(Logger::LOG_ERROR);
+  std::vector<std::string> filenames;
+  std::vector<std::shared_ptr<Task_LoadImg> > tasks;
+
+  for (int i = 0; i < count; i++)
+  {
+    filenames.push_back("task_loadimg_tests_" + std::to_string(i) + ".pgm");
+    write_pnm(filenames.back().c_str(), 100 + i, 50, 1, 255);
+    tasks.push_back(std::make_shared<Task_LoadImg>(filenames.back()));
+  }
+
+  {
+    Worker worker(2, logger);
+    Worker *w = &worker;
+    std::shared_ptr<ImageLoader> loader = std::make_shared<ImageLoader>(1, 1, [w]() { w->poll_deferred(); });
+
+    for (const std::shared_ptr<Task_LoadImg> &task: tasks)
+    {
+      loader->add(task);
+      worker.add(task);
+    }
+
+    ASSERT_TRUE(worker.wait_all());
+  }
+
+  for (int i = 0; i < count; i++)
+  {
+    std::remove(filenames.at(i).c_str());
+    ASSERT_EQ(tasks.at(i)->orig_size(), cv::Size(100 + i, 50));
+    ASSERT_EQ(tasks.at(i)->valid_area().size(), cv::Size(100 + i, 50));
+  }
+}
+
+// Compare load time against cv::imread() followed by cv::copyMakeBorder().
+TEST(Task_LoadImg, DISABLED_Benchmark) {
+  const char *filename = "task_loadimg_tests_benchmark.ppm";
+  write_pnm(filename, 6000, 4000, 3, 255);
+
+  auto start = std::chrono::steady_clock::now();
+  cv::Mat orig = cv::imread(filename, cv::IMREAD_ANYCOLOR);
+  cv::Size expanded;
+  Task_Wavelet::levels_for_size(orig.size(), &expanded);
+  cv::Mat tmp;
+  cv::copyMakeBorder(orig, tmp, 0, expanded.height - orig.rows, 0, expanded.width - orig.cols, cv::BORDER_REFLECT);
+  double imread_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  start = std::chrono::steady_clock::now();
+  load(filename);
+  double mapped_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  std::remove(filename);
+
+  std::printf("imread + copyMakeBorder %0.1f ms, memory mapped %0.1f ms\n", imread_time * 1000, mapped_time * 1000);
+}
+
+}
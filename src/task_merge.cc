@@ -6,59 +6,83 @@ using namespace focusstack;
 Task_Merge::Task_Merge(std::shared_ptr<Task_Merge> prev_merge,
                        const std::vector<std::shared_ptr<ImgTask> > &images,
                        int consistency):
-  m_prev_merge(prev_merge), m_images(images), m_consistency(consistency)
+  m_images(images), m_consistency(consistency)
 {
   m_filename = "merge_result.jpg";
   m_name = "Merge " + std::to_string(m_images.size()) + " images";
 
   if (prev_merge)
+  {
+    m_merges.push_back(prev_merge);
     m_depends_on.push_back(prev_merge);
+  }
 
   m_depends_on.insert(m_depends_on.begin(), images.begin(), images.end());
 }
 
+Task_Merge::Task_Merge(std::shared_ptr<Task_Merge> left,
+                       std::shared_ptr<Task_Merge> right,
+                       int consistency):
+  m_consistency(consistency)
+{
+  m_filename = "merge_result.jpg";
+  m_name = "Merge 2 results";
+  m_merges.push_back(left);
+  m_merges.push_back(right);
+  m_depends_on.push_back(left);
+  m_depends_on.push_back(right);
+}
+
+size_t Task_Merge::estimate_result_bytes() const
+{
+  // CV_32FC2 wavelet image and CV_16U depthmap
+  const ImgTask *first = m_images.empty() ? m_merges.front().get() : m_images.front().get();
+  return first->img().total() * (8 + 2);
+}
+
 void Task_Merge::task()
 {
-  int rows = m_images.front()->img().rows;
-  int cols = m_images.front()->img().cols;
+  std::vector<source_t> sources;
+  m_indexes.clear();
 
-  cv::Mat max_absval(rows, cols, CV_32F);
+  // Keep a map from image index to image pointer for the denoise step.
+  // Indexes from earlier merges map to the merge result.
+  m_index_map.clear();
 
-  if (m_prev_merge)
+  for (std::shared_ptr<Task_Merge> merge: m_merges)
   {
-    m_result = m_prev_merge->img().clone();
-    m_depthmap = m_prev_merge->depthmap();
-    get_sq_absval(m_result, max_absval);
+    sources.push_back(source_t{merge->img(), merge->depthmap(), 0});
+    for (int index: merge->indexes())
+    {
+      m_indexes.push_back(index);
+      m_index_map[index] = merge;
+    }
   }
-  else
+
+  for (std::shared_ptr<ImgTask> image: m_images)
   {
-    m_result.create(rows, cols, CV_32FC2);
-    m_depthmap.create(rows, cols, CV_16U);
-    m_depthmap = 0;
-    max_absval = -1.0f;
+    sources.push_back(source_t{image->img(), cv::Mat(), (uint16_t)image->index()});
+    m_indexes.push_back(image->index());
+    m_index_map[image->index()] = image;
   }
 
-  // Most of the pixel copying is done in loop below using masks, as it is faster.
-  // Minor touch-ups are done per-pixel in denoise loops.
-  // Keep a map from image index to image pointer for the denoise step.
-  m_index_map.clear();
-  m_index_map.reserve(m_images.size());
+  int rows = sources.front().wavelet.rows;
+  int cols = sources.front().wavelet.cols;
+  m_result.create(rows, cols, CV_32FC2);
+  m_wavelet_levels = m_merges.empty() ? m_images.front()->wavelet_levels() : m_merges.front()->wavelet_levels();
+  m_depthmap.create(rows, cols, CV_16U);
 
   // For each pixel in the wavelet image, select the wavelet with highest
-  // absolute value.
-  for (int i = 0; i < m_images.size(); i++)
-  {
-    const cv::Mat &wavelet = m_images.at(i)->img();
-    cv::Mat absval(rows, cols, CV_32F);
-    get_sq_absval(wavelet, absval);
-
-    cv::Mat mask = (absval > max_absval);
-    absval.copyTo(max_absval, mask);
-    wavelet.copyTo(m_result, mask);
-    m_depthmap.setTo(m_images.at(i)->index(), mask);
+  // absolute value. Row stripes are processed in parallel.
+  cv::parallel_for_(cv::Range(0, rows), [&](const cv::Range &range) {
+    std::vector<float> max_absval(cols);
 
-    m_index_map[m_images.at(i)->index()] = m_images.at(i);
-  }
+    for (int y = range.start; y < range.end; y++)
+    {
+      merge_row(sources, y, m_result.ptr<cv::Vec2f>(y), m_depthmap.ptr<uint16_t>(y),
+                max_absval.data(), cols);
+    }
+  });
 
   if (m_consistency >= 1)
   {
@@ -71,43 +95,107 @@ void Task_Merge::task()
   }
 
   // Find out the intersection of input image valid areas.
-  m_valid_area = m_images.at(0)->valid_area();
-  for (int i = 1; i < m_images.size(); i++)
+  // When combining merge results, use the area of the latest batch
+  // like the sequential merge chain does.
+  if (!m_images.empty())
   {
-    limit_valid_area(m_images.at(i)->valid_area());
+    m_valid_area = m_images.at(0)->valid_area();
+    for (int i = 1; i < m_images.size(); i++)
+    {
+      limit_valid_area(m_images.at(i)->valid_area());
+    }
+  }
+  else
+  {
+    m_valid_area = m_merges.back()->valid_area();
   }
 
   m_images.clear();
   m_index_map.clear();
-  m_prev_merge.reset();
+  m_merges.clear();
 }
 
-void Task_Merge::get_sq_absval(const cv::Mat& complex_mat, cv::Mat& absval)
+// Select the coefficient with largest absolute value for each pixel of a row.
+// Later sources replace earlier ones only if their absolute value is strictly
+// larger, so that the result does not depend on how images are batched.
+void Task_Merge::merge_row(const std::vector<source_t> &sources, int y,
+                           cv::Vec2f *result, uint16_t *depthmap, float *max_absval, int cols)
 {
-  for (int y = 0; y < complex_mat.rows; y++)
+  for (int x = 0; x < cols; x++)
   {
-    for (int x = 0; x < complex_mat.cols; x++)
+    result[x] = cv::Vec2f(0, 0);
+    depthmap[x] = 0;
+    max_absval[x] = -1.0f;
+  }
+
+  for (const source_t &source: sources)
+  {
+    const cv::Vec2f *src = source.wavelet.ptr<cv::Vec2f>(y);
+
+    if (source.depthmap.empty())
     {
-      cv::Vec2f v = complex_mat.at<cv::Vec2f>(y, x);
-      absval.at<float>(y, x) = v[0] * v[0] + v[1] * v[1];
+      uint16_t index = source.index;
+      for (int x = 0; x < cols; x++)
+      {
+        cv::Vec2f v = src[x];
+        float absval = v[0] * v[0] + v[1] * v[1];
+        if (absval > max_absval[x])
+        {
+          max_absval[x] = absval;
+          result[x] = v;
+          depthmap[x] = index;
+        }
+      }
+    }
+    else
+    {
+      const uint16_t *index = source.depthmap.ptr<uint16_t>(y);
+      for (int x = 0; x < cols; x++)
+      {
+        cv::Vec2f v = src[x];
+        float absval = v[0] * v[0] + v[1] * v[1];
+        if (absval > max_absval[x])
+        {
+          max_absval[x] = absval;
+          result[x] = v;
+          depthmap[x] = index[x];
+        }
+      }
     }
   }
 }
 
+void Task_Merge::get_sq_absval(const cv::Mat& complex_mat, cv::Mat& absval)
+{
+  cv::parallel_for_(cv::Range(0, complex_mat.rows), [&](const cv::Range &range) {
+    for (int y = range.start; y < range.end; y++)
+    {
+      const cv::Vec2f *src = complex_mat.ptr<cv::Vec2f>(y);
+      float *dst = absval.ptr<float>(y);
+      for (int x = 0; x < complex_mat.cols; x++)
+      {
+        dst[x] = src[x][0] * src[x][0] + src[x][1] * src[x][1];
+      }
+    }
+  });
+}
+
+// Get the wavelet image that the coefficients with given depth index come from.
+// For indexes merged earlier this is the earlier merge result.
 cv::Mat Task_Merge::get_source_img(int index)
 {
   auto iter = m_index_map.find(index);
   if (iter != m_index_map.end())
     return iter->second->img();
   else
-    return m_prev_merge->img();
+    return m_result;
 }
 
 // Compare the horizontal / vertical / diagonal subbands at each level
 // and perform two-out-of-three voting filter.
 void Task_Merge::denoise_subbands()
 {
-  int levels = Task_Wavelet::levels_for_size(m_result.size());
+  int levels = Task_Wavelet::levels_for_image(*this);
   for (int level = 0; level < levels; level++)
   {
     int w = m_result.cols >> level;
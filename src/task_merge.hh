@@ -15,21 +15,47 @@ public:
              const std::vector<std::shared_ptr<ImgTask> > &images,
              int consistency);
 
+  // Combine results of two merges. Left should contain the earlier merged
+  // batches, which are scheduled from the reference image outwards, so that
+  // it is not necessarily the lower image indexes. Left is preferred when
+  // absolute values are equal.
+  Task_Merge(std::shared_ptr<Task_Merge> left,
+             std::shared_ptr<Task_Merge> right,
+             int consistency);
+
   const cv::Mat &depthmap() const { return m_depthmap; }
 
+  // Indexes of all images included in the merge result.
+  const std::vector<int> &indexes() const { return m_indexes; }
+
+  virtual size_t estimate_result_bytes() const;
+  virtual size_t result_bytes() const { return ImgTask::result_bytes() + m_depthmap.total() * m_depthmap.elemSize(); }
+
   static void get_sq_absval(const cv::Mat &complex_mat, cv::Mat &absval);
 
 private:
   virtual void task();
 
+  // Source for merge, either wavelet image with single index or
+  // an earlier merge result with its depthmap.
+  struct source_t {
+    cv::Mat wavelet;
+    cv::Mat depthmap;
+    uint16_t index;
+  };
+
+  static void merge_row(const std::vector<source_t> &sources, int y,
+                        cv::Vec2f *result, uint16_t *depthmap, float *max_absval, int cols);
+
   cv::Mat get_source_img(int index);
   void denoise_subbands();
   void denoise_neighbours();
 
   cv::Mat m_depthmap;
 
+  std::vector<int> m_indexes;
   std::unordered_map<int, std::shared_ptr<ImgTask> > m_index_map;
-  std::shared_ptr<Task_Merge> m_prev_merge;
+  std::vector<std::shared_ptr<Task_Merge> > m_merges;
   std::vector<std::shared_ptr<ImgTask> > m_images;
   int m_consistency;
 };
@@ -0,0 +1,143 @@
+#include <gtest/gtest.h>
+#include <random>
+#include "task_merge.hh"
+#include "logger.hh"
+
+namespace focusstack {
+
+static std::shared_ptr<ImgTask> random_wavelet(int rows, int cols, int index)
+{
+  std::mt19937 rng(index);
+  std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+  cv::Mat img(rows, cols, CV_32FC2);
+
+  for (int y = 0; y < rows; y++)
+  {
+    for (int x = 0; x < cols; x++)
+    {
+      img.at<cv::Vec2f>(y, x) = cv::Vec2f(dist(rng), dist(rng));
+    }
+  }
+
+  std::shared_ptr<ImgTask> task = std::make_shared<ImgTask>(img);
+  task->set_index(index);
+  return task;
+}
+
+// Merging in several chained batches should select the same coefficients
+// as picking the largest absolute value over all images at once.
+TEST(Task_Merge, SelectsLargest) {
+  const int rows = 64;
+  const int cols = 96;
+  const int count = 7;
+  std::shared_ptr<Logger> logger = std::make_shared<Logger>();
+
+  std::vector<std::shared_ptr<ImgTask> > images;
+  for (int i = 0; i < count; i++)
+  {
+    images.push_back(random_wavelet(rows, cols, i));
+  }
+
+  std::shared_ptr<Task_Merge> merge;
+  for (int start = 0; start < count; start += 3)
+  {
+    std::vector<std::shared_ptr<ImgTask> > batch(images.begin() + start,
+                                                 images.begin() + std::min(count, start + 3));
+    merge = std::make_shared<Task_Merge>(merge, batch, 0);
+    merge->run(logger);
+  }
+
+  for (int y = 0; y < rows; y++)
+  {
+    for (int x = 0; x < cols; x++)
+    {
+      int best = 0;
+      float best_absval = -1.0f;
+      for (int i = 0; i < count; i++)
+      {
+        cv::Vec2f v = images.at(i)->img().at<cv::Vec2f>(y, x);
+        float absval = v[0] * v[0] + v[1] * v[1];
+        if (absval > best_absval)
+        {
+          best = i;
+          best_absval = absval;
+        }
+      }
+
+      ASSERT_EQ(merge->depthmap().at<uint16_t>(y, x), best);
+      ASSERT_EQ(merge->img().at<cv::Vec2f>(y, x), images.at(best)->img().at<cv::Vec2f>(y, x));
+    }
+  }
+}
+
+// Combining batch merges pairwise should give the same result as
+// merging the batches in a sequential chain.
+TEST(Task_Merge, TreeMatchesChain) {
+  const int rows = 48;
+  const int cols = 40;
+  const int count = 10;
+  std::shared_ptr<Logger> logger = std::make_shared<Logger>();
+
+  std::vector<std::shared_ptr<ImgTask> > images;
+  for (int i = 0; i < count; i++)
+  {
+    images.push_back(random_wavelet(rows, cols, i));
+  }
+
+  std::shared_ptr<Task_Merge> chain;
+  std::vector<std::shared_ptr<Task_Merge> > leaves;
+  for (int start = 0; start < count; start += 3)
+  {
+    std::vector<std::shared_ptr<ImgTask> > batch(images.begin() + start,
+                                                 images.begin() + std::min(count, start + 3));
+    chain = std::make_shared<Task_Merge>(chain, batch, 0);
+    chain->run(logger);
+
+    leaves.push_back(std::make_shared<Task_Merge>(nullptr, batch, 0));
+    leaves.back()->run(logger);
+  }
+
+  std::shared_ptr<Task_Merge> left = std::make_shared<Task_Merge>(leaves.at(0), leaves.at(1), 0);
+  std::shared_ptr<Task_Merge> right = std::make_shared<Task_Merge>(leaves.at(2), leaves.at(3), 0);
+  left->run(logger);
+  right->run(logger);
+  std::shared_ptr<Task_Merge> tree = std::make_shared<Task_Merge>(left, right, 0);
+  tree->run(logger);
+
+  ASSERT_EQ(tree->indexes().size(), (size_t)count);
+
+  for (int y = 0; y < rows; y++)
+  {
+    for (int x = 0; x < cols; x++)
+    {
+      ASSERT_EQ(tree->depthmap().at<uint16_t>(y, x), chain->depthmap().at<uint16_t>(y, x));
+      ASSERT_EQ(tree->img().at<cv::Vec2f>(y, x), chain->img().at<cv::Vec2f>(y, x));
+    }
+  }
+}
+
+// Merging must not modify the result of the previous merge.
+TEST(Task_Merge, KeepsPrevious) {
+  std::shared_ptr<Logger> logger = std::make_shared<Logger>();
+  std::vector<std::shared_ptr<ImgTask> > batch1 = {random_wavelet(32, 32, 0)};
+  std::vector<std::shared_ptr<ImgTask> > batch2 = {random_wavelet(32, 32, 1)};
+
+  std::shared_ptr<Task_Merge> merge1 = std::make_shared<Task_Merge>(nullptr, batch1, 0);
+  merge1->run(logger);
+  cv::Mat result1 = merge1->img().clone();
+  cv::Mat depthmap1 = merge1->depthmap().clone();
+
+  std::shared_ptr<Task_Merge> merge2 = std::make_shared<Task_Merge>(merge1, batch2, 0);
+  merge2->run(logger);
+
+  for (int y = 0; y < 32; y++)
+  {
+    for (int x = 0; x < 32; x++)
+    {
+      ASSERT_EQ(merge1->depthmap().at<uint16_t>(y, x), depthmap1.at<uint16_t>(y, x));
+      ASSERT_EQ(merge1->img().at<cv::Vec2f>(y, x), result1.at<cv::Vec2f>(y, x));
+    }
+  }
+}
+
+}
@@ -0,0 +1,151 @@
+#include "task_preview.hh"
+#include "task_wavelet.hh"
+#include "task_wavelet_templates.hh"
+#include "task_tile.hh"
+
+using namespace focusstack;
+
+PreviewPublisher::PreviewPublisher(std::function<void(const cv::Mat &preview)> callback):
+  m_callback(callback), m_scheduled(0), m_published(0), m_delivered(0)
+{
+}
+
+void PreviewPublisher::publish(int sequence, const cv::Mat &preview)
+{
+  {
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    if (sequence <= m_published)
+    {
+      return; // Newer preview finished first
+    }
+
+    m_published = sequence;
+    m_latest = preview;
+  }
+
+  if (m_callback)
+  {
+    // Callbacks have their own lock, so that a slow callback does not
+    // block latest() and the callback can call it.
+    std::unique_lock<std::mutex> lock(m_callback_mutex);
+
+    if (sequence < m_delivered)
+    {
+      return; // Newer preview was passed to callback already
+    }
+
+    m_delivered = sequence;
+    m_callback(preview);
+  }
+}
+
+cv::Mat PreviewPublisher::latest() const
+{
+  std::unique_lock<std::mutex> lock(m_mutex);
+  return m_latest;
+}
+
+Task_Preview::Task_Preview(const std::vector<std::shared_ptr<ImgTask> > &merges,
+                           const std::vector<cv::Rect> &areas, int tile_size,
+                           int max_size, std::shared_ptr<PreviewPublisher> publisher):
+  m_merges(merges), m_areas(areas), m_tile_size(tile_size), m_max_size(max_size), m_publisher(publisher)
+{
+  m_sequence = publisher->next_sequence();
+  m_filename = "preview.jpg";
+  m_name = "Preview " + std::to_string(m_sequence);
+
+  m_depends_on.insert(m_depends_on.end(), merges.begin(), merges.end());
+}
+
+cv::Mat Task_Preview::compose_coarse(const cv::Mat &wavelet, int levels, int skip)
+{
+  // The top left corner of the wavelet image is a multilevel decomposition
+  // of the image downscaled by 2^skip, with values multiplied by 2^skip.
+  cv::Mat coarse = wavelet(cv::Rect(0, 0, wavelet.cols >> skip, wavelet.rows >> skip)).clone();
+  cv::Mat tmp(coarse.rows, coarse.cols, CV_32FC2);
+
+  Wavelet<cv::Mat>::compose_multilevel(coarse, tmp, levels - skip);
+
+  cv::Mat channels[2];
+  cv::split(tmp, channels);
+
+  // The low-pass filters shift the image by 2^skip - 1 pixels. Rotating by one
+  // preview pixel, which is possible because the transform wraps around,
+  // leaves an offset of one full resolution pixel.
+  cv::Mat real = channels[0];
+  if (skip > 0 && real.rows > 1 && real.cols > 1)
+  {
+    int w = real.cols - 1;
+    int h = real.rows - 1;
+    real = cv::Mat(channels[0].rows, channels[0].cols, CV_32F);
+    channels[0](cv::Rect(1, 1, w, h)).copyTo(real(cv::Rect(0, 0, w, h)));
+    channels[0](cv::Rect(0, 1, 1, h)).copyTo(real(cv::Rect(w, 0, 1, h)));
+    channels[0](cv::Rect(1, 0, w, 1)).copyTo(real(cv::Rect(0, h, w, 1)));
+    channels[0](cv::Rect(0, 0, 1, 1)).copyTo(real(cv::Rect(w, h, 1, 1)));
+  }
+
+  cv::Mat result;
+  real.convertTo(result, CV_8U, 1.0 / (1 << skip));
+  return result;
+}
+
+void Task_Preview::task()
+{
+  if (m_publisher->superseded(m_sequence))
+  {
+    m_logger->verbose("Skipping preview %d, newer one is scheduled\n", m_sequence);
+    m_merges.clear();
+    return;
+  }
+
+  cv::Size size = m_merges.front()->img().size();
+  if (!m_areas.empty())
+  {
+    size = cv::Size(0, 0);
+    for (const cv::Rect &area: m_areas)
+    {
+      size.width = std::max(size.width, area.x + area.width);
+      size.height = std::max(size.height, area.y + area.height);
+    }
+  }
+
+  // Keep at least one level to compose
+  int levels = Task_Wavelet::levels_for_image(*m_merges.front());
+  int skip = 0;
+  while (std::max(size.width, size.height) >> skip > m_max_size && skip < levels - 1)
+  {
+    skip++;
+  }
+
+  if (m_areas.empty())
+  {
+    m_result = compose_coarse(m_merges.front()->img(), levels, skip);
+  }
+  else
+  {
+    m_result = cv::Mat::zeros(size.height >> skip, size.width >> skip, CV_8U);
+
+    for (size_t i = 0; i < m_merges.size(); i++)
+    {
+      cv::Mat tile = compose_coarse(m_merges.at(i)->img(), levels, skip);
+      const cv::Rect &area = m_areas.at(i);
+      cv::Point origin = Task_Tile::tile_origin(area, m_tile_size);
+
+      // Rounding may differ by a pixel between the tile and the image
+      cv::Rect dest(cv::Point(area.x >> skip, area.y >> skip),
+                    cv::Point((area.x + area.width) >> skip, (area.y + area.height) >> skip));
+      cv::Point src((area.x - origin.x) >> skip, (area.y - origin.y) >> skip);
+      dest.width = std::min(dest.width, tile.cols - src.x);
+      dest.height = std::min(dest.height, tile.rows - src.y);
+
+      if (!dest.empty())
+      {
+        tile(cv::Rect(src, dest.size())).copyTo(m_result(dest));
+      }
+    }
+  }
+
+  m_merges.clear();
+  m_publisher->publish(m_sequence, m_result);
+}
@@ -0,0 +1,67 @@
+// Generates a downscaled preview of the merge result so far.
+// Only the coarse wavelet levels are inverse-transformed, which is
+// much cheaper than the full inverse transform.
+
+#pragma once
+#include "worker.hh"
+#include <functional>
+
+namespace focusstack {
+
+// Keeps track of the latest preview and passes it to the callback.
+// Shared between the preview tasks, which may run in any thread.
+class PreviewPublisher
+{
+public:
+  PreviewPublisher(std::function<void(const cv::Mat &preview)> callback);
+
+  // Sequence number for a new preview task.
+  int next_sequence() { return ++m_scheduled; }
+
+  // Check if there is a newer preview scheduled than the given one.
+  bool superseded(int sequence) const { return sequence < m_scheduled; }
+
+  // Store the preview and call the callback, unless a newer preview
+  // has already been published.
+  void publish(int sequence, const cv::Mat &preview);
+
+  // Latest published preview, or empty image if none yet.
+  cv::Mat latest() const;
+
+private:
+  std::function<void(const cv::Mat &preview)> m_callback;
+  std::atomic<int> m_scheduled;
+  mutable std::mutex m_mutex;
+  int m_published;
+  cv::Mat m_latest;
+  std::mutex m_callback_mutex;
+  int m_delivered;
+};
+
+class Task_Preview: public ImgTask
+{
+public:
+  // Merges are the latest merge results of each tile. If the image is not
+  // processed in tiles, areas is empty and merges has one item.
+  // The preview is downscaled by a power of two until it fits max_size.
+  Task_Preview(const std::vector<std::shared_ptr<ImgTask> > &merges,
+               const std::vector<cv::Rect> &areas, int tile_size,
+               int max_size, std::shared_ptr<PreviewPublisher> publisher);
+
+  // Inverse-transform the coarse levels of a wavelet image that has been
+  // decomposed to given number of levels, skipping the given number of
+  // finest levels. Result is 8-bit grayscale image downscaled by 2^skip.
+  static cv::Mat compose_coarse(const cv::Mat &wavelet, int levels, int skip);
+
+private:
+  virtual void task();
+
+  std::vector<std::shared_ptr<ImgTask> > m_merges;
+  std::vector<cv::Rect> m_areas;
+  int m_tile_size;
+  int m_max_size;
+  std::shared_ptr<PreviewPublisher> m_publisher;
+  int m_sequence;
+};
+
+}
@@ -0,0 +1,100 @@
+#include <gtest/gtest.h>
+#include <cmath>
+#include "task_preview.hh"
+#include "task_wavelet.hh"
+#include "task_wavelet_templates.hh"
+#include "logger.hh"
+
+namespace focusstack {
+
+static cv::Mat smooth_image(int rows, int cols)
+{
+  cv::Mat img(rows, cols, CV_8U);
+  for (int y = 0; y < rows; y++)
+  {
+    for (int x = 0; x < cols; x++)
+    {
+      img.at<uint8_t>(y, x) = (uint8_t)(128 + 60 * std::sin(x / 20.0) * std::cos(y / 25.0));
+    }
+  }
+  return img;
+}
+
+// Composing only the coarse levels should give a downscaled image.
+TEST(Task_Preview, CoarseMatchesDownscaled) {
+  const int rows = 256;
+  const int cols = 384;
+  cv::Mat img = smooth_image(rows, cols);
+  cv::Mat wavelet(rows, cols, CV_32FC2);
+  int levels = Task_Wavelet::levels_for_size(img.size());
+  Wavelet<cv::Mat>::decompose_multilevel(img, wavelet, levels);
+
+  for (int skip = 0; skip <= 2; skip++)
+  {
+    cv::Mat preview = Task_Preview::compose_coarse(wavelet, levels, skip);
+    ASSERT_EQ(preview.rows, rows >> skip);
+    ASSERT_EQ(preview.cols, cols >> skip);
+
+    int factor = 1 << skip;
+    double total_error = 0;
+    for (int y = 0; y < preview.rows; y++)
+    {
+      for (int x = 0; x < preview.cols; x++)
+      {
+        double expected = 0;
+        for (int dy = 0; dy < factor; dy++)
+        {
+          for (int dx = 0; dx < factor; dx++)
+          {
+            expected += img.at<uint8_t>(y * factor + dy, x * factor + dx);
+          }
+        }
+        expected /= factor * factor;
+        total_error += std::abs(preview.at<uint8_t>(y, x) - expected);
+      }
+    }
+
+    EXPECT_LT(total_error / preview.total(), 2.5) << "skip " << skip;
+  }
+}
+
+// Older previews should not replace newer ones.
+TEST(Task_Preview, NewerSupersedes) {
+  std::shared_ptr<Logger> logger = std::make_shared<Logger>();
+  int callbacks = 0;
+  std::shared_ptr<PreviewPublisher> publisher = std::make_shared<PreviewPublisher>(
+    [&callbacks](const cv::Mat &) { callbacks++; });
+
+  cv::Mat img = smooth_image(64, 64);
+  cv::Mat wavelet(64, 64, CV_32FC2);
+  Wavelet<cv::Mat>::decompose_multilevel(img, wavelet, Task_Wavelet::levels_for_size(img.size()));
+  std::vector<std::shared_ptr<ImgTask> > merges = {std::make_shared<ImgTask>(wavelet)};
+
+  std::shared_ptr<Task_Preview> older = std::make_shared<Task_Preview>(merges, std::vector<cv::Rect>(), 0, 32, publisher);
+  std::shared_ptr<Task_Preview> newer = std::make_shared<Task_Preview>(merges, std::vector<cv::Rect>(), 0, 32, publisher);
+
+  newer->run(logger);
+  ASSERT_EQ(callbacks, 1);
+  ASSERT_EQ(publisher->latest().size(), cv::Size(32, 32));
+
+  older->run(logger);
+  ASSERT_EQ(callbacks, 1);
+  ASSERT_TRUE(older->img().empty());
+
+  publisher->publish(1, cv::Mat());
+  ASSERT_EQ(callbacks, 1);
+  ASSERT_FALSE(publisher->latest().empty());
+}
+
+// The callback should be able to query the latest preview.
+TEST(Task_Preview, CallbackCanQueryLatest) {
+  std::shared_ptr<PreviewPublisher> publisher;
+  cv::Size latest_size;
+  publisher = std::make_shared<PreviewPublisher>(
+    [&publisher, &latest_size](const cv::Mat &) { latest_size = publisher->latest().size(); });
+
+  publisher->publish(publisher->next_sequence(), cv::Mat(16, 24, CV_8U, cv::Scalar(0)));
+  ASSERT_EQ(latest_size, cv::Size(24, 16));
+}
+
+}
@@ -1,14 +1,25 @@
 #include "task_reassign.hh"
+#include "task_merge.hh"
+#include "task_loadimg.hh"
+#include "task_grayscale.hh"
+#include "task_align.hh"
 #include <opencv2/core/core.hpp>
 #include <opencv2/imgcodecs.hpp>
+#include <opencv2/core/utility.hpp>
+#include <algorithm>
 
 #define REASSIGN_MAX_BATCH 32
+#define REASSIGN_MAX_ENTRIES 64
+#define REASSIGN_MIN_ENTRIES 2
+#define REASSIGN_STRIP_ROWS 16
+#define REASSIGN_NO_CANDIDATE 0xFFFF
 
 using namespace focusstack;
 
 Task_Reassign_Map::Task_Reassign_Map(const std::vector<std::shared_ptr<ImgTask> > &grayscale_imgs,
-                                     const std::vector<std::shared_ptr<ImgTask> > &color_imgs, std::shared_ptr<Task_Reassign_Map> old_map):
-  m_grayscale_imgs(grayscale_imgs), m_color_imgs(color_imgs), m_old_map(old_map)
+                                     const std::vector<std::shared_ptr<ImgTask> > &color_imgs, std::shared_ptr<Task_Reassign_Map> old_map,
+                                     size_t max_bytes):
+  m_grayscale_imgs(grayscale_imgs), m_color_imgs(color_imgs), m_old_map(old_map), m_max_bytes(max_bytes)
 {
   m_filename = "reassign_map";
   m_name = "Build color reassignment map from " + std::to_string(m_color_imgs.size()) + " images";
@@ -21,6 +32,19 @@ Task_Reassign_Map::Task_Reassign_Map(const std::vector<std::shared_ptr<ImgTask>
   }
 }
 
+size_t Task_Reassign_Map::result_bytes() const
+{
+  size_t bytes = 0;
+  for (const strip_t &strip: m_strips)
+  {
+    bytes += strip.counts.size() + strip.colors.size() * sizeof(color_entry_t);
+  }
+
+  return bytes
+       + m_gray_min.total() * m_gray_min.elemSize()
+       + m_gray_max.total() * m_gray_max.elemSize();
+}
+
 void Task_Reassign_Map::task()
 {
   if (m_old_map)
@@ -41,6 +65,10 @@ void Task_Reassign_Map::task()
     build_color();
   }
 
+  size_t pixels = m_color_imgs.at(0)->img().total();
+  m_logger->verbose("Reassignment map uses %0.1f MB, %0.1f bytes per pixel\n",
+                    result_bytes() / 1e6, result_bytes() / (double)pixels);
+
   m_grayscale_imgs.clear();
   m_color_imgs.clear();
   m_old_map.reset();
@@ -57,18 +85,38 @@ void Task_Reassign_Map::build_color()
     assert(m_color_imgs.at(i)->img().type() == CV_8UC3);
   }
 
-  // Calculate how much space we may need for the data
-  const color_entry_t *old_colors = m_old_map ? (m_old_map->m_colors.data()) : nullptr;
-  const uint8_t *old_counts = m_old_map ? (m_old_map->m_counts.data()) : nullptr;
-  size_t old_map_size = m_old_map ? (m_old_map->m_colors.size()) : 0;
   int width = m_grayscale_imgs.at(0)->img().cols;
   int height = m_grayscale_imgs.at(0)->img().rows;
+  int max_count = max_entries(width * height);
+
+  if (m_old_map)
+  {
+    // The old map is not needed after this, so its strips are updated in place.
+    m_strips.swap(m_old_map->m_strips);
+  }
+  else
+  {
+    m_strips.resize((height + REASSIGN_STRIP_ROWS - 1) / REASSIGN_STRIP_ROWS);
+  }
+
+  cv::parallel_for_(cv::Range(0, m_strips.size()), [&](const cv::Range &range) {
+    for (int s = range.start; s < range.end; s++)
+    {
+      int y0 = s * REASSIGN_STRIP_ROWS;
+      build_strip(m_strips.at(s), y0, std::min(height, y0 + REASSIGN_STRIP_ROWS), max_count);
+    }
+  });
+}
 
-  // Preallocate the arrays to as much size as we may need to avoid checks during inner loop.
-  m_colors.resize(width * height * (m_grayscale_imgs.size() + 1) + old_map_size);
-  m_counts.resize(width * height);
-  color_entry_t *colors_wrpos = m_colors.data();
-  uint8_t *counts_wrpos = m_counts.data();
+void Task_Reassign_Map::build_strip(strip_t &strip, int y0, int y1, int max_count) const
+{
+  int imgcount = m_grayscale_imgs.size();
+  int width = m_grayscale_imgs.at(0)->img().cols;
+  int pixels = (y1 - y0) * width;
+  int stride = std::min(max_count, strip.stride + imgcount);
+  int used_stride = 1;
+  std::vector<color_entry_t> buffer(pixels * stride);
+  strip.counts.resize(pixels);
 
   // Each new pixel is checked against gray_seen[] array. If the entry matches current pixel_idx,
   // we have already seen this pixel value at this position, so it is not necessary to add new entry.
@@ -76,9 +124,13 @@ void Task_Reassign_Map::build_color()
   uint32_t pixel_idx = 1;
   const uint8_t *grayscale_row_ptrs[REASSIGN_MAX_BATCH] = {nullptr};
   const cv::Vec3b *color_row_ptrs[REASSIGN_MAX_BATCH] = {nullptr};
+  color_entry_t entries[256 + REASSIGN_MAX_BATCH];
 
-  // Go through all pixels in order, and add any color values that aren't already in map.
-  for (int y = 0; y < height; y++)
+  const color_entry_t *old_colors = strip.colors.data();
+  color_entry_t *colors_wrpos = buffer.data();
+  uint8_t *counts = strip.counts.data();
+
+  for (int y = y0; y < y1; y++)
   {
     // Get row pointers for each image, to speed up inner loop
     for (int i = 0; i < imgcount; i++)
@@ -93,38 +145,87 @@ void Task_Reassign_Map::build_color()
 
       int color_count = 0;
 
-      // Bring in values from old map.
-      // Copy each color into m_colors and mark it present in gray_seen[].
-      if (old_colors)
+      // Bring in values from old map, they are already sorted.
+      if (strip.stride > 0)
       {
-        color_count = (*old_counts++) + 1;
+        color_count = *counts + 1;
         for (int i = 0; i < color_count; i++)
         {
-          color_entry_t color = *old_colors++;
-          gray_seen[color.gray] = pixel_idx;
-          *colors_wrpos++ = color;
+          entries[i] = old_colors[i];
+          gray_seen[entries[i].gray] = pixel_idx;
         }
+        old_colors += strip.stride;
       }
 
-      // Check for new values in the input images
+      // Insert new values from the input images in sorted order
       for (int i = 0; i < imgcount; i++)
       {
         uint8_t gray = grayscale_row_ptrs[i][x];
         if (gray_seen[gray] != pixel_idx)
         {
           gray_seen[gray] = pixel_idx;
-          *colors_wrpos++ = color_entry_t(gray, color_row_ptrs[i][x]);
-          color_count++;
+
+          int pos = color_count++;
+          while (pos > 0 && entries[pos - 1].gray > gray)
+          {
+            entries[pos] = entries[pos - 1];
+            pos--;
+          }
+          entries[pos] = color_entry_t(gray, color_row_ptrs[i][x]);
         }
       }
 
-      *counts_wrpos++ = color_count - 1;
+      color_count = limit_entries(entries, color_count, stride);
+      std::copy(entries, entries + color_count, colors_wrpos);
+      colors_wrpos += stride;
+      *counts++ = color_count - 1;
+      used_stride = std::max(used_stride, color_count);
     }
   }
 
-  // Release any extra memory that was preallocated
-  assert(colors_wrpos - m_colors.data() < m_colors.size());
-  m_colors.resize(colors_wrpos - m_colors.data());
+  // Store the strip with only as many slots as needed
+  std::vector<color_entry_t> colors(pixels * used_stride);
+  for (int i = 0; i < pixels; i++)
+  {
+    std::copy(&buffer[i * stride], &buffer[i * stride] + strip.counts[i] + 1, &colors[i * used_stride]);
+  }
+
+  strip.colors.swap(colors);
+  strip.stride = used_stride;
+}
+
+int Task_Reassign_Map::max_entries(int pixels) const
+{
+  int count = REASSIGN_MAX_ENTRIES;
+  if (m_max_bytes > 0)
+  {
+    size_t limit = m_max_bytes / ((size_t)pixels * sizeof(color_entry_t));
+    count = std::max<int>(REASSIGN_MIN_ENTRIES, std::min<size_t>(count, limit));
+  }
+  return count;
+}
+
+int Task_Reassign_Map::limit_entries(color_entry_t *entries, int count, int max_count)
+{
+  while (count > max_count)
+  {
+    int drop = 1;
+    int smallest_gap = 256;
+    for (int i = 1; i < count - 1; i++)
+    {
+      int gap = entries[i + 1].gray - entries[i - 1].gray;
+      if (gap < smallest_gap)
+      {
+        smallest_gap = gap;
+        drop = i;
+      }
+    }
+
+    std::copy(entries + drop + 1, entries + count, entries + drop);
+    count--;
+  }
+
+  return count;
 }
 
 void Task_Reassign_Map::build_gray()
@@ -188,39 +289,51 @@ void Task_Reassign::reassign_color()
   cv::Mat merged = m_merged->img();
   m_result.create(merged.rows, merged.cols, CV_8UC3);
 
-  const Task_Reassign_Map::color_entry_t *colors = m_map->m_colors.data();
-  const uint8_t *counts = m_map->m_counts.data();
   int width = merged.cols;
   int height = merged.rows;
+  const std::vector<Task_Reassign_Map::strip_t> &strips = m_map->m_strips;
 
-  for (int y = 0; y < height; y++)
-  {
-    for (int x = 0; x < width; x++)
+  // Each strip of the map has its own entries, so they can be looked up in parallel.
+  cv::parallel_for_(cv::Range(0, strips.size()), [&](const cv::Range &range) {
+    for (int s = range.start; s < range.end; s++)
     {
-      // Get the number of color map entries for this pixel
-      int color_count = *counts++ + 1;
-      const Task_Reassign_Map::color_entry_t *pos = colors;
-      colors += color_count;
-
-      // Go through all entries and find the closest one
-      uint8_t gray = merged.at<uint8_t>(y, x);
-      Task_Reassign_Map::color_entry_t closest = *pos++;
-      int error = std::abs(closest.gray - gray);
+      const Task_Reassign_Map::strip_t &strip = strips.at(s);
+      const Task_Reassign_Map::color_entry_t *colors = strip.colors.data();
+      const uint8_t *counts = strip.counts.data();
+      int y0 = s * REASSIGN_STRIP_ROWS;
+      int y1 = std::min(height, y0 + REASSIGN_STRIP_ROWS);
 
-      while (error > 0 && pos != colors)
+      for (int y = y0; y < y1; y++)
       {
-        Task_Reassign_Map::color_entry_t candidate = *pos++;
-        int distance = std::abs(candidate.gray - gray);
-        if (distance < error)
+        const uint8_t *grays = merged.ptr<uint8_t>(y);
+        cv::Vec3b *result = m_result.ptr<cv::Vec3b>(y);
+
+        for (int x = 0; x < width; x++)
         {
-          error = distance;
-          closest = candidate;
+          // Get the number of color map entries for this pixel
+          const Task_Reassign_Map::color_entry_t *pos = colors;
+          const Task_Reassign_Map::color_entry_t *end = colors + *counts++ + 1;
+          colors += strip.stride;
+
+          // Entries are sorted, so the closest one is either the last one
+          // that is not brighter or the one after it.
+          uint8_t gray = grays[x];
+          const Task_Reassign_Map::color_entry_t *closest = pos++;
+          while (pos != end && pos->gray <= gray)
+          {
+            closest = pos++;
+          }
+
+          if (pos != end && closest->gray < gray && pos->gray - gray < gray - closest->gray)
+          {
+            closest = pos;
+          }
+
+          result[x] = closest->color;
         }
       }
-
-      m_result.at<cv::Vec3b>(y, x) = closest.color;
     }
-  }
+  });
 }
 
 void Task_Reassign::reassign_gray()
@@ -228,4 +341,298 @@ void Task_Reassign::reassign_gray()
   m_result = m_merged->img().clone();
   cv::min(m_result, m_map->m_gray_max, m_result);
   cv::max(m_result, m_map->m_gray_min, m_result);
-}
\ No newline at end of file
+}
+
+Task_Reassign_Candidates::Task_Reassign_Candidates(std::shared_ptr<Task_Merge> merge):
+  m_merge(merge)
+{
+  m_filename = "reassign_candidates.png";
+  m_name = "Find reassignment candidates";
+  m_index = merge->index();
+
+  m_depends_on.push_back(merge);
+}
+
+void Task_Reassign_Candidates::task()
+{
+  const cv::Mat &depthmap = m_merge->depthmap();
+  m_valid_area = m_merge->valid_area();
+  m_result.create(depthmap.rows, depthmap.cols, CV_16UC4);
+
+  // Horizontal, diagonal and vertical subbands of the two finest levels
+  cv::Mat subbands[2][3];
+  for (int level = 0; level < 2; level++)
+  {
+    int w2 = depthmap.cols >> (level + 1);
+    int h2 = depthmap.rows >> (level + 1);
+    subbands[level][0] = depthmap(cv::Rect(w2, 0, w2, h2));
+    subbands[level][1] = depthmap(cv::Rect(w2, h2, w2, h2));
+    subbands[level][2] = depthmap(cv::Rect(0, h2, w2, h2));
+  }
+
+  int w2 = subbands[0][0].cols;
+  int h2 = subbands[0][0].rows;
+
+  cv::parallel_for_(cv::Range(0, depthmap.rows), [&](const cv::Range &range) {
+    for (int y = range.start; y < range.end; y++)
+    {
+      // Finest level coefficients next to the pixel, and the coarser one
+      // under it. The wavelet filters shift the image by about a pixel.
+      int cy0 = std::max(0, (y - 1) >> 1);
+      int cy1 = std::min(h2 - 1, (y + 1) >> 1);
+      int cy2 = std::min(subbands[1][0].rows - 1, y >> 2);
+      cv::Vec4w *result = m_result.ptr<cv::Vec4w>(y);
+
+      for (int x = 0; x < depthmap.cols; x++)
+      {
+        int cx0 = std::max(0, (x - 1) >> 1);
+        int cx1 = std::min(w2 - 1, (x + 1) >> 1);
+        int cx2 = std::min(subbands[1][0].cols - 1, x >> 2);
+
+        // Count how many times each index occurs
+        uint16_t indexes[15];
+        int counts[15];
+        int found = 0;
+        auto add = [&](uint16_t index) {
+          for (int i = 0; i < found; i++)
+          {
+            if (indexes[i] == index)
+            {
+              counts[i]++;
+              return;
+            }
+          }
+          indexes[found] = index;
+          counts[found++] = 1;
+        };
+
+        for (int s = 0; s < 3; s++)
+        {
+          for (int cy = cy0; cy <= cy1; cy++)
+          {
+            const uint16_t *row = subbands[0][s].ptr<uint16_t>(cy);
+            for (int cx = cx0; cx <= cx1; cx++)
+            {
+              add(row[cx]);
+            }
+          }
+
+          add(subbands[1][s].at<uint16_t>(cy2, cx2));
+        }
+
+        // Take the most common ones, earlier ones first when counts are equal
+        for (int c = 0; c < 4; c++)
+        {
+          int best = -1;
+          for (int i = 0; i < found; i++)
+          {
+            if (counts[i] > 0 && (best < 0 || counts[i] > counts[best]))
+            {
+              best = i;
+            }
+          }
+
+          if (best >= 0)
+          {
+            result[x][c] = indexes[best];
+            counts[best] = 0;
+          }
+          else
+          {
+            result[x][c] = REASSIGN_NO_CANDIDATE;
+          }
+        }
+      }
+    }
+  });
+
+  m_merge.reset();
+}
+
+Task_Reassign_Index::Task_Reassign_Index(std::shared_ptr<Task_Reassign_Index> previous,
+                                         std::shared_ptr<ImgTask> candidates,
+                                         std::shared_ptr<ImgTask> merged,
+                                         std::shared_ptr<Task_LoadImg> source,
+                                         std::shared_ptr<AlignmentStore> alignment,
+                                         std::shared_ptr<Task_Grayscale> weights,
+                                         FocusStack::align_flags_t flags):
+  m_previous(previous), m_candidates(candidates), m_merged(merged), m_source(source),
+  m_alignment(alignment), m_weights(weights), m_flags(flags)
+{
+  m_filename = merged->filename();
+  m_name = "Reassign pixel values from " + source->basename();
+  m_index = source->index();
+
+  if (previous) m_depends_on.push_back(previous);
+  m_depends_on.push_back(candidates);
+  m_depends_on.push_back(merged);
+  m_depends_on.push_back(weights);
+}
+
+bool Task_Reassign_Index::ready_to_run()
+{
+  return ImgTask::ready_to_run() && m_source->ready_to_run();
+}
+
+void Task_Reassign_Index::find_strips()
+{
+  const cv::Mat &candidates = m_candidates->img();
+  int strip_count = (candidates.rows + Task_Align::warp_strip_rows - 1) / Task_Align::warp_strip_rows;
+  std::vector<std::vector<uint16_t> > strip_indexes(strip_count);
+
+  cv::parallel_for_(cv::Range(0, strip_count), [&](const cv::Range &range) {
+    std::vector<bool> seen(REASSIGN_NO_CANDIDATE + 1);
+    for (int s = range.start; s < range.end; s++)
+    {
+      std::vector<uint16_t> &indexes = strip_indexes.at(s);
+      int y0 = s * Task_Align::warp_strip_rows;
+      int y1 = std::min(candidates.rows, y0 + Task_Align::warp_strip_rows);
+      for (int y = y0; y < y1; y++)
+      {
+        const uint16_t *row = candidates.ptr<uint16_t>(y);
+        for (int x = 0; x < candidates.cols * candidates.channels(); x++)
+        {
+          if (row[x] != REASSIGN_NO_CANDIDATE && !seen[row[x]])
+          {
+            seen[row[x]] = true;
+            indexes.push_back(row[x]);
+          }
+        }
+      }
+
+      for (uint16_t index: indexes)
+      {
+        seen[index] = false;
+      }
+    }
+  });
+
+  std::shared_ptr<std::vector<std::vector<bool> > > strips = std::make_shared<std::vector<std::vector<bool> > >();
+  for (int s = 0; s < strip_count; s++)
+  {
+    for (uint16_t index: strip_indexes.at(s))
+    {
+      if (index >= strips->size())
+      {
+        strips->resize(index + 1, std::vector<bool>(strip_count));
+      }
+      strips->at(index).at(s) = true;
+    }
+  }
+
+  m_strips = strips;
+}
+
+void Task_Reassign_Index::task()
+{
+  if (m_previous)
+  {
+    // Continue from the result of the previous image
+    std::swap(m_result, m_previous->m_result);
+    std::swap(m_error, m_previous->m_error);
+    m_strips = m_previous->m_strips;
+    m_previous.reset();
+  }
+  else
+  {
+    find_strips();
+  }
+
+  m_valid_area = m_merged->valid_area();
+  const cv::Mat &merged = m_merged->img();
+
+  std::vector<bool> strips;
+  if (m_index < (int)m_strips->size())
+  {
+    strips = m_strips->at(m_index);
+  }
+
+  bool needed = std::find(strips.begin(), strips.end(), true) != strips.end();
+  if (!needed)
+  {
+    m_logger->verbose("%s is not a candidate for any pixel\n", m_source->basename().c_str());
+  }
+
+  // Decode the image again, or take it from the image loader
+  if (needed || m_source->is_prefetched())
+  {
+    m_source->run(m_logger);
+  }
+
+  const cv::Mat &src = m_source->img();
+  if (needed && src.size() != merged.size())
+  {
+    throw std::runtime_error("Image size of " + m_source->filename() + " has changed");
+  }
+
+  if (needed && m_result.empty())
+  {
+    m_result = cv::Mat::zeros(merged.rows, merged.cols, src.type());
+    // Larger than any difference, so that the first candidate is always taken
+    m_error = cv::Mat(merged.rows, merged.cols, CV_16U, cv::Scalar(256));
+  }
+
+  if (needed)
+  {
+    // Apply the same alignment as Task_Align, only to the strips where it is needed.
+    // The reference image is not in the alignment store and is used as is.
+    cv::Mat transformation, contrast, whitebalance;
+    if (m_alignment->get(m_index, transformation, contrast, whitebalance))
+    {
+      if ((m_flags & FocusStack::ALIGN_NO_CONTRAST) && (m_flags & FocusStack::ALIGN_NO_WHITEBALANCE))
+      {
+        contrast = cv::Mat();
+      }
+    }
+
+    cv::Mat color, gray;
+    Task_Align::warp_and_correct(src, color, transformation, contrast, whitebalance,
+                                 m_weights->weights(), &gray, strips);
+
+    int channels = color.channels();
+    cv::parallel_for_(cv::Range(0, strips.size()), [&](const cv::Range &range) {
+      for (int s = range.start; s < range.end; s++)
+      {
+        if (!strips.at(s)) continue;
+
+        int y0 = s * Task_Align::warp_strip_rows;
+        int y1 = std::min(merged.rows, y0 + Task_Align::warp_strip_rows);
+        for (int y = y0; y < y1; y++)
+        {
+          const cv::Vec4w *candidates = m_candidates->img().ptr<cv::Vec4w>(y);
+          const uint8_t *merged_row = merged.ptr<uint8_t>(y);
+          const uint8_t *gray_row = gray.ptr<uint8_t>(y);
+          const uint8_t *color_row = color.ptr<uint8_t>(y);
+          uint16_t *error_row = m_error.ptr<uint16_t>(y);
+          uint8_t *result_row = m_result.ptr<uint8_t>(y);
+
+          for (int x = 0; x < merged.cols; x++)
+          {
+            const cv::Vec4w &c = candidates[x];
+            if (c[0] != m_index && c[1] != m_index && c[2] != m_index && c[3] != m_index)
+            {
+              continue;
+            }
+
+            // Earlier images are preferred when the difference is equal
+            int error = std::abs(gray_row[x] - merged_row[x]);
+            if (error < error_row[x])
+            {
+              error_row[x] = error;
+              for (int ch = 0; ch < channels; ch++)
+              {
+                result_row[x * channels + ch] = color_row[x * channels + ch];
+              }
+            }
+          }
+        }
+      }
+    });
+  }
+
+  m_source.reset();
+  m_alignment.reset();
+  m_weights.reset();
+  m_candidates.reset();
+  m_merged.reset();
+}
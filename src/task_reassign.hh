@@ -4,15 +4,23 @@
 
 #pragma once
 #include "worker.hh"
+#include "focusstack.hh"
 
 namespace focusstack {
 
+class Task_Merge;
+class Task_LoadImg;
+class Task_Grayscale;
+class AlignmentStore;
+
 // Task_Reassign_Map builds a map between grayscale and color values.
 // The map can be built incrementally, so that source images can be
 // unloaded from RAM sooner.
 //
 // Each unique gray value for each pixel is stored only once, which
-// conserves RAM compared to storing all source images.
+// conserves RAM compared to storing all source images. The number of
+// entries per pixel is limited, and the contents of the old map are
+// moved into the new one when it is built.
 //
 // For grayscale input images color reassignment is not strictly necessary,
 // but limiting the output values to input range reduces ringing artefacts
@@ -21,16 +29,25 @@ namespace focusstack {
 class Task_Reassign_Map: public Task
 {
 public:
+  // max_bytes limits the memory used for the color entries. With 0 only
+  // the fixed limit of entries per pixel applies.
   Task_Reassign_Map(const std::vector<std::shared_ptr<ImgTask> > &grayscale_imgs,
                     const std::vector<std::shared_ptr<ImgTask> > &color_imgs,
-                    std::shared_ptr<Task_Reassign_Map> old_map);
+                    std::shared_ptr<Task_Reassign_Map> old_map,
+                    size_t max_bytes = 0);
+
+  virtual size_t result_bytes() const;
 
 private:
   virtual void task();
 
   // Build reassigment map for color input images.
+  // Strips are built in parallel.
   void build_color();
 
+  // Number of color entries to keep per pixel, according to m_max_bytes.
+  int max_entries(int pixels) const;
+
   // Build reassignment map for grayscale images.
   // This only stores the range of grayscale values present in input,
   // which helps with reducing any ringing artefacts.
@@ -40,6 +57,7 @@ private:
   std::vector<std::shared_ptr<ImgTask> > m_grayscale_imgs;
   std::vector<std::shared_ptr<ImgTask> > m_color_imgs;
   std::shared_ptr<Task_Reassign_Map> m_old_map;
+  size_t m_max_bytes;
 
   struct color_entry_t
   {
@@ -56,10 +74,30 @@ private:
     color_entry_t& operator=(const color_entry_t &old) = default;
   };
 
-  // m_colors has color entries for all pixels, concatenated into one vector.
-  // m_counts has number of entries per each pixel, minus one. Maximum count is 256, minimum count is 1.
-  std::vector<color_entry_t> m_colors;
-  std::vector<uint8_t> m_counts;
+  // Drop entries until at most max_count remain, returns the new count.
+  // Entries must be sorted by gray value. The darkest and brightest entries
+  // are always kept, and of the others the one that leaves the smallest
+  // gap in the gray range is dropped first.
+  static int limit_entries(color_entry_t *entries, int count, int max_count);
+
+  // The map is stored in strips of rows. Each strip has a fixed number of
+  // entry slots per pixel, enough for the pixel with the most entries.
+  // Entries of each pixel are sorted by gray value. A new batch replaces
+  // the strips one at a time, so the map is never copied as a whole.
+  // Strips are independent of each other, so they can be processed in parallel.
+  struct strip_t
+  {
+    int stride;
+    std::vector<uint8_t> counts; // Number of entries per pixel, minus one.
+    std::vector<color_entry_t> colors;
+
+    strip_t(): stride(0) {}
+  };
+
+  // Add the entries from input images to rows y0 to y1 of the map.
+  void build_strip(strip_t &strip, int y0, int y1, int max_count) const;
+
+  std::vector<strip_t> m_strips;
 
   cv::Mat m_gray_min;
   cv::Mat m_gray_max;
@@ -85,4 +123,66 @@ private:
   std::shared_ptr<ImgTask> m_merged;
 };
 
+// Task_Reassign_Candidates finds the source images that are candidates for
+// the color of each pixel, from the image indexes selected by the merge for
+// the two finest levels of wavelet coefficients near the pixel. The result
+// is a CV_16UC4 image with up to four most common indexes, and unused slots
+// are set to 0xFFFF.
+class Task_Reassign_Candidates: public ImgTask
+{
+public:
+  Task_Reassign_Candidates(std::shared_ptr<Task_Merge> merge);
+
+private:
+  virtual void task();
+
+  std::shared_ptr<Task_Merge> m_merge;
+};
+
+// Task_Reassign_Index is an alternative to Task_Reassign that keeps no
+// color data of the source images in memory. Each task in the chain decodes
+// one source image again, applies the alignment to only those strips of
+// rows where the image is a candidate, and takes the color of the candidate
+// whose gray value is closest to the merged image. The result of the last
+// task in the chain is the final color image.
+class Task_Reassign_Index: public ImgTask
+{
+public:
+  // Previous is the previous task in the chain or nullptr for the first one.
+  // Alignment has the transformations of all images except the reference,
+  // and weights is the grayscale conversion used in the merge.
+  Task_Reassign_Index(std::shared_ptr<Task_Reassign_Index> previous,
+                      std::shared_ptr<ImgTask> candidates,
+                      std::shared_ptr<ImgTask> merged,
+                      std::shared_ptr<Task_LoadImg> source,
+                      std::shared_ptr<AlignmentStore> alignment,
+                      std::shared_ptr<Task_Grayscale> weights,
+                      FocusStack::align_flags_t flags);
+
+  // Waits for an image loader to decode the source image.
+  virtual bool ready_to_run();
+
+  virtual size_t result_bytes() const { return ImgTask::result_bytes() + m_error.total() * m_error.elemSize(); }
+
+private:
+  virtual void task();
+
+  // Find the strips of rows where each image index is a candidate.
+  void find_strips();
+
+  std::shared_ptr<Task_Reassign_Index> m_previous;
+  std::shared_ptr<ImgTask> m_candidates;
+  std::shared_ptr<ImgTask> m_merged;
+  std::shared_ptr<Task_LoadImg> m_source;
+  std::shared_ptr<AlignmentStore> m_alignment;
+  std::shared_ptr<Task_Grayscale> m_weights;
+  FocusStack::align_flags_t m_flags;
+
+  // Difference between the gray value of the chosen color and the merged image
+  cv::Mat m_error;
+
+  // Strips where each image index is a candidate, shared along the chain
+  std::shared_ptr<const std::vector<std::vector<bool> > > m_strips;
+};
+
 }
@@ -0,0 +1,289 @@
+#include <gtest/gtest.h>
+#include <cstdio>
+#include <fstream>
+#include <random>
+#include "task_reassign.hh"
+#include "task_merge.hh"
+#include "task_loadimg.hh"
+#include "task_grayscale.hh"
+#include "task_align.hh"
+#include "task_wavelet.hh"
+#include "logger.hh"
+
+namespace focusstack {
+
+struct reassign_input_t
+{
+  std::vector<std::shared_ptr<ImgTask> > grays;
+  std::vector<std::shared_ptr<ImgTask> > colors;
+};
+
+// Random color images where the color identifies the image and gray value
+static reassign_input_t make_inputs(cv::Size size, int count, int seed)
+{
+  std::mt19937 rng(seed);
+  std::uniform_int_distribution<int> dist(0, 255);
+  reassign_input_t inputs;
+
+  for (int i = 0; i < count; i++)
+  {
+    cv::Mat gray(size, CV_8U);
+    cv::Mat color(size, CV_8UC3);
+    for (int y = 0; y < size.height; y++)
+    {
+      for (int x = 0; x < size.width; x++)
+      {
+        uint8_t v = dist(rng);
+        gray.at<uint8_t>(y, x) = v;
+        color.at<cv::Vec3b>(y, x) = cv::Vec3b(v, i, 255 - v);
+      }
+    }
+
+    inputs.grays.push_back(std::make_shared<ImgTask>(gray));
+    inputs.colors.push_back(std::make_shared<ImgTask>(color));
+  }
+
+  return inputs;
+}
+
+// Build the map in batches and reassign colors for the merged image.
+static cv::Mat reassign(const reassign_input_t &inputs, const cv::Mat &merged, int batchsize, size_t max_bytes)
+{
+  std::shared_ptr<Logger> logger = std::make_shared<Logger>();
+  std::shared_ptr<Task_Reassign_Map> map;
+
+  for (size_t start = 0; start < inputs.grays.size(); start += batchsize)
+  {
+    size_t end = std::min(inputs.grays.size(), start + batchsize);
+    std::vector<std::shared_ptr<ImgTask> > grays(inputs.grays.begin() + start, inputs.grays.begin() + end);
+    std::vector<std::shared_ptr<ImgTask> > colors(inputs.colors.begin() + start, inputs.colors.begin() + end);
+    map = std::make_shared<Task_Reassign_Map>(grays, colors, map, max_bytes);
+    map->run(logger);
+  }
+
+  std::shared_ptr<Task_Reassign> task = std::make_shared<Task_Reassign>(map, std::make_shared<ImgTask>(merged));
+  task->run(logger);
+  return task->img();
+}
+
+// Each pixel should get the color of a source image with the closest gray value.
+TEST(Task_Reassign, ClosestColor) {
+  cv::Size size(97, 45);
+  reassign_input_t inputs = make_inputs(size, 20, 1);
+  cv::Mat merged = make_inputs(size, 1, 2).grays.at(0)->img();
+  cv::Mat result = reassign(inputs, merged, 8, 0);
+
+  for (int y = 0; y < size.height; y++)
+  {
+    for (int x = 0; x < size.width; x++)
+    {
+      int gray = merged.at<uint8_t>(y, x);
+      int best = 256;
+      for (const std::shared_ptr<ImgTask> &img: inputs.grays)
+      {
+        best = std::min(best, std::abs(img->img().at<uint8_t>(y, x) - gray));
+      }
+
+      cv::Vec3b color = result.at<cv::Vec3b>(y, x);
+      ASSERT_LT(color[1], 20);
+      ASSERT_EQ(inputs.colors.at(color[1])->img().at<cv::Vec3b>(y, x), color) << "at " << x << "," << y;
+      ASSERT_EQ(std::abs(color[0] - gray), best) << "at " << x << "," << y;
+    }
+  }
+}
+
+// Strips are processed in parallel, which must not change the result.
+TEST(Task_Reassign, ParallelMatchesSequential) {
+  cv::Size size(211, 173);
+  reassign_input_t inputs = make_inputs(size, 12, 4);
+  cv::Mat merged = make_inputs(size, 1, 5).grays.at(0)->img();
+
+  int threads = cv::getNumThreads();
+  cv::setNumThreads(1);
+  cv::Mat sequential = reassign(inputs, merged, 5, size.area() * 24);
+  cv::setNumThreads(threads);
+  cv::Mat parallel = reassign(inputs, merged, 5, size.area() * 24);
+
+  ASSERT_EQ(cv::norm(sequential, parallel, cv::NORM_INF), 0.0);
+}
+
+// With a memory limit, the darkest and brightest values must still be kept.
+TEST(Task_Reassign, MemoryLimitKeepsRange) {
+  cv::Size size(64, 40);
+  reassign_input_t inputs = make_inputs(size, 40, 3);
+  size_t max_bytes = size.area() * 16; // Four 4-byte entries per pixel
+
+  cv::Mat dark = reassign(inputs, cv::Mat::zeros(size, CV_8U), 8, max_bytes);
+  cv::Mat bright = reassign(inputs, cv::Mat(size, CV_8U, cv::Scalar(255)), 8, max_bytes);
+
+  for (int y = 0; y < size.height; y++)
+  {
+    for (int x = 0; x < size.width; x++)
+    {
+      int darkest = 255, brightest = 0;
+      for (const std::shared_ptr<ImgTask> &img: inputs.grays)
+      {
+        darkest = std::min<int>(darkest, img->img().at<uint8_t>(y, x));
+        brightest = std::max<int>(brightest, img->img().at<uint8_t>(y, x));
+      }
+
+      ASSERT_EQ(dark.at<cv::Vec3b>(y, x)[0], darkest) << "at " << x << "," << y;
+      ASSERT_EQ(bright.at<cv::Vec3b>(y, x)[0], brightest) << "at " << x << "," << y;
+    }
+  }
+}
+
+// Wavelet image where the two finest levels have large coefficients in
+// either the top or the bottom half of the image.
+static std::shared_ptr<ImgTask> half_wavelet(int rows, int cols, bool top, int index)
+{
+  cv::Mat img(rows, cols, CV_32FC2, cv::Scalar(1.0f, 0.0f));
+  for (int level = 0; level < 2; level++)
+  {
+    int w2 = cols >> (level + 1);
+    int h2 = rows >> (level + 1);
+    for (cv::Rect subband: {cv::Rect(w2, 0, w2, h2), cv::Rect(w2, h2, w2, h2), cv::Rect(0, h2, w2, h2)})
+    {
+      cv::Rect half(subband.x, subband.y + (top ? 0 : h2 / 2), w2, h2 / 2);
+      img(half) = cv::Scalar(10.0f, 0.0f);
+    }
+  }
+
+  std::shared_ptr<ImgTask> task = std::make_shared<ImgTask>(img);
+  task->set_index(index);
+  return task;
+}
+
+// Candidates should come from the image that the merge selected near each pixel.
+TEST(Task_Reassign, CandidatesFromMerge) {
+  const int rows = 64;
+  const int cols = 96;
+  std::shared_ptr<Logger> logger = std::make_shared<Logger>();
+  std::vector<std::shared_ptr<ImgTask> > images = {half_wavelet(rows, cols, true, 3),
+                                                   half_wavelet(rows, cols, false, 5)};
+  std::shared_ptr<Task_Merge> merge = std::make_shared<Task_Merge>(nullptr, images, 0);
+  merge->run(logger);
+
+  std::shared_ptr<Task_Reassign_Candidates> candidates = std::make_shared<Task_Reassign_Candidates>(merge);
+  candidates->run(logger);
+  ASSERT_EQ(candidates->img().size(), cv::Size(cols, rows));
+  ASSERT_EQ(candidates->img().type(), CV_16UC4);
+
+  for (int y = 0; y < rows; y++)
+  {
+    if (std::abs(y - rows / 2) < 4) continue; // Both are candidates near the edge
+
+    for (int x = 0; x < cols; x++)
+    {
+      cv::Vec4w c = candidates->img().at<cv::Vec4w>(y, x);
+      ASSERT_EQ(c, cv::Vec4w(y < rows / 2 ? 3 : 5, 0xFFFF, 0xFFFF, 0xFFFF)) << "at " << x << "," << y;
+    }
+  }
+}
+
+static void write_pgm(const std::string &filename, const cv::Mat &img)
+{
+  std::ofstream file(filename.c_str(), std::ios::binary);
+  file << "P5\n" << img.cols << " " << img.rows << "\n255\n";
+  for (int y = 0; y < img.rows; y++)
+  {
+    file.write(reinterpret_cast<const char*>(img.ptr<uint8_t>(y)), img.cols);
+  }
+}
+
+// Decoding the images again should give the candidate closest to the merged value.
+TEST(Task_Reassign, IndexClosestCandidate) {
+  const int count = 4;
+  std::shared_ptr<Logger> logger = std::make_shared<Logger>();
+  logger->set_level(Logger::LOG_ERROR);
+
+  cv::Size size;
+  Task_Wavelet::levels_for_size(cv::Size(90, 70), &size);
+  reassign_input_t inputs = make_inputs(size, count + 1, 6);
+  std::vector<std::string> filenames;
+  for (int i = 0; i < count; i++)
+  {
+    filenames.push_back("task_reassign_tests_" + std::to_string(i) + ".pgm");
+    write_pgm(filenames.back(), inputs.grays.at(i)->img());
+  }
+
+  // Two candidates for each pixel, the last image is not a candidate anywhere
+  std::mt19937 rng(7);
+  std::uniform_int_distribution<int> dist(0, count - 2);
+  cv::Mat candidates(size, CV_16UC4);
+  for (int y = 0; y < size.height; y++)
+  {
+    for (int x = 0; x < size.width; x++)
+    {
+      int a = dist(rng);
+      int b = (a + 1 + dist(rng) % (count - 2)) % (count - 1);
+      candidates.at<cv::Vec4w>(y, x) = cv::Vec4w(a, b, 0xFFFF, 0xFFFF);
+    }
+  }
+
+  std::shared_ptr<ImgTask> candidates_task = std::make_shared<ImgTask>(candidates);
+  std::shared_ptr<ImgTask> merged = inputs.grays.at(count);
+  std::shared_ptr<AlignmentStore> alignment = std::make_shared<AlignmentStore>(0);
+  std::shared_ptr<Task_Grayscale> weights = std::make_shared<Task_Grayscale>(merged);
+
+  std::shared_ptr<Task_Reassign_Index> reassign;
+  for (int i = 0; i < count; i++)
+  {
+    std::shared_ptr<Task_LoadImg> source = std::make_shared<Task_LoadImg>(filenames.at(i));
+    source->set_index(i);
+    reassign = std::make_shared<Task_Reassign_Index>(reassign, candidates_task, merged, source,
+                                                     alignment, weights, FocusStack::ALIGN_DEFAULT);
+    reassign->run(logger);
+  }
+
+  for (const std::string &filename: filenames)
+  {
+    std::remove(filename.c_str());
+  }
+
+  cv::Mat result = reassign->img();
+  ASSERT_EQ(result.size(), size);
+  for (int y = 0; y < size.height; y++)
+  {
+    for (int x = 0; x < size.width; x++)
+    {
+      cv::Vec4w c = candidates.at<cv::Vec4w>(y, x);
+      int m = merged->img().at<uint8_t>(y, x);
+      int first = std::min(c[0], c[1]);
+      int second = std::max(c[0], c[1]);
+      int v1 = inputs.grays.at(first)->img().at<uint8_t>(y, x);
+      int v2 = inputs.grays.at(second)->img().at<uint8_t>(y, x);
+      int expected = (std::abs(v2 - m) < std::abs(v1 - m)) ? v2 : v1;
+      ASSERT_EQ(result.at<uint8_t>(y, x), expected) << "at " << x << "," << y;
+    }
+  }
+}
+
+// Candidate should be taken even if it differs from the merged value by the full range.
+TEST(Task_Reassign, IndexMaximumDifference) {
+  std::shared_ptr<Logger> logger = std::make_shared<Logger>();
+  logger->set_level(Logger::LOG_ERROR);
+
+  cv::Size size;
+  Task_Wavelet::levels_for_size(cv::Size(90, 70), &size);
+  std::string filename = "task_reassign_tests_white.pgm";
+  write_pgm(filename, cv::Mat(size, CV_8U, cv::Scalar(255)));
+
+  cv::Mat candidates(size, CV_16UC4, cv::Scalar(0, 0xFFFF, 0xFFFF, 0xFFFF));
+  std::shared_ptr<ImgTask> candidates_task = std::make_shared<ImgTask>(candidates);
+  std::shared_ptr<ImgTask> merged = std::make_shared<ImgTask>(cv::Mat(size, CV_8U, cv::Scalar(0)));
+  std::shared_ptr<AlignmentStore> alignment = std::make_shared<AlignmentStore>(0);
+  std::shared_ptr<Task_Grayscale> weights = std::make_shared<Task_Grayscale>(merged);
+
+  std::shared_ptr<Task_LoadImg> source = std::make_shared<Task_LoadImg>(filename);
+  source->set_index(0);
+  std::shared_ptr<Task_Reassign_Index> reassign = std::make_shared<Task_Reassign_Index>(
+    nullptr, candidates_task, merged, source, alignment, weights, FocusStack::ALIGN_DEFAULT);
+  reassign->run(logger);
+  std::remove(filename.c_str());
+
+  ASSERT_EQ(reassign->img().size(), size);
+  EXPECT_EQ(cv::countNonZero(reassign->img() != 255), 0);
+}
+
+}
@@ -0,0 +1,139 @@
+#include "task_tile.hh"
+#include "task_wavelet.hh"
+
+using namespace focusstack;
+
+Task_Tile::Task_Tile(std::shared_ptr<ImgTask> input, cv::Rect area, int tile_size)
+{
+  m_input = input;
+  m_area = area;
+  m_tile_size = tile_size;
+
+  m_filename = input->filename();
+  m_index = input->index();
+  m_name = "Tile " + std::to_string(area.x) + "," + std::to_string(area.y) + " " + m_filename;
+
+  m_depends_on.push_back(input);
+}
+
+std::vector<cv::Rect> Task_Tile::layout(cv::Size image_size, int tile_size)
+{
+  // Divide evenly, so that the last tiles are not much smaller than others
+  int cols = (image_size.width + tile_size - 1) / tile_size;
+  int rows = (image_size.height + tile_size - 1) / tile_size;
+
+  std::vector<cv::Rect> areas;
+  for (int y = 0; y < rows; y++)
+  {
+    int y0 = y * image_size.height / rows;
+    int y1 = (y + 1) * image_size.height / rows;
+
+    for (int x = 0; x < cols; x++)
+    {
+      int x0 = x * image_size.width / cols;
+      int x1 = (x + 1) * image_size.width / cols;
+      areas.push_back(cv::Rect(x0, y0, x1 - x0, y1 - y0));
+    }
+  }
+
+  return areas;
+}
+
+int Task_Tile::tile_levels()
+{
+  // With more levels the margin would have to be larger than the tile
+  return Task_Wavelet::min_levels;
+}
+
+cv::Size Task_Tile::tile_image_size(int tile_size)
+{
+  // Margin on both sides, and room for aligning the origin
+  int factor = 1 << tile_levels();
+  int margin = Task_Wavelet::filter_support(tile_levels());
+  int size = tile_size + 2 * margin + factor - 1;
+  size += (factor - size % factor) % factor;
+  return cv::Size(size, size);
+}
+
+// Round down to multiple of factor, also for negative values
+static int align_down(int value, int factor)
+{
+  return value - ((value % factor) + factor) % factor;
+}
+
+cv::Point Task_Tile::tile_origin(cv::Rect area, int tile_size)
+{
+  // Wavelet subsampling is aligned the same way as for the full image
+  int factor = 1 << tile_levels();
+  int margin = Task_Wavelet::filter_support(tile_levels());
+  return cv::Point(align_down(area.x - margin, factor), align_down(area.y - margin, factor));
+}
+
+size_t Task_Tile::estimate_result_bytes() const
+{
+  return tile_image_size(m_tile_size).area() * m_input->img().elemSize();
+}
+
+void Task_Tile::task()
+{
+  const cv::Mat &img = m_input->img();
+  cv::Size size = tile_image_size(m_tile_size);
+  cv::Point origin = tile_origin(m_area, m_tile_size);
+
+  // Copy the part that is inside the image and mirror the rest
+  cv::Rect src = cv::Rect(origin, size) & cv::Rect(0, 0, img.cols, img.rows);
+  cv::copyMakeBorder(img(src), m_result,
+                     src.y - origin.y, origin.y + size.height - src.y - src.height,
+                     src.x - origin.x, origin.x + size.width - src.x - src.width,
+                     cv::BORDER_REFLECT);
+
+  cv::Rect valid = m_input->valid_area();
+  m_valid_area = cv::Rect(valid.tl() - origin, valid.size());
+  m_wavelet_levels = tile_levels();
+  m_input.reset();
+}
+
+Task_Stitch::Task_Stitch(const std::vector<std::shared_ptr<ImgTask> > &tiles,
+                         const std::vector<cv::Rect> &areas, int tile_size)
+{
+  m_tiles = tiles;
+  m_areas = areas;
+  m_tile_size = tile_size;
+
+  m_filename = tiles.front()->filename();
+  m_index = tiles.front()->index();
+  m_name = "Stitch " + m_filename;
+
+  for (const cv::Rect &area: areas)
+  {
+    m_size.width = std::max(m_size.width, area.x + area.width);
+    m_size.height = std::max(m_size.height, area.y + area.height);
+  }
+
+  m_depends_on.insert(m_depends_on.end(), tiles.begin(), tiles.end());
+}
+
+size_t Task_Stitch::estimate_result_bytes() const
+{
+  return m_size.area() * m_tiles.front()->img().elemSize();
+}
+
+void Task_Stitch::task()
+{
+  m_result.create(m_size, m_tiles.front()->img().type());
+
+  for (size_t i = 0; i < m_tiles.size(); i++)
+  {
+    const cv::Rect &area = m_areas.at(i);
+    cv::Point origin = Task_Tile::tile_origin(area, m_tile_size);
+    m_tiles.at(i)->img()(cv::Rect(area.tl() - origin, area.size())).copyTo(m_result(area));
+  }
+
+  // All tiles have the same valid area in image coordinates
+  cv::Rect valid = m_tiles.front()->valid_area();
+  cv::Point origin = Task_Tile::tile_origin(m_areas.front(), m_tile_size);
+  m_valid_area = cv::Rect(0, 0, m_size.width, m_size.height);
+  limit_valid_area(cv::Rect(valid.tl() + origin, valid.size()));
+
+  m_tiles.clear();
+}
@@ -0,0 +1,69 @@
+// Splits images into overlapping tiles, so that the wavelet transform and
+// merging can be done one part at a time. This limits the memory needed
+// for the complex-valued wavelet images of very large input images.
+
+#pragma once
+#include "worker.hh"
+
+namespace focusstack {
+
+// Task_Tile extracts one tile from the input image. The tile image extends
+// by a margin around the tile area, and is sized so that it can be wavelet
+// transformed. Parts of the margin that are outside the input image are
+// filled by mirroring.
+//
+// The valid area of the tile is given in the coordinates of the tile image,
+// and may extend outside it. This way the valid areas of merged tiles are
+// the same as for merged full images, and Task_Stitch can translate them back.
+//
+// Tiles are decomposed to tile_levels() wavelet levels regardless of their
+// size. The margin covers the filter support of these levels and the tile
+// images start at multiples of 2^levels, so that the tile area gets the same
+// result as the full image decomposed to as many levels and the stitched
+// result has no seams.
+class Task_Tile: public ImgTask
+{
+public:
+  Task_Tile(std::shared_ptr<ImgTask> input, cv::Rect area, int tile_size);
+
+  virtual size_t estimate_result_bytes() const;
+
+  // Divide image to tile areas of at most tile_size x tile_size pixels.
+  static std::vector<cv::Rect> layout(cv::Size image_size, int tile_size);
+
+  // Number of wavelet levels used for the tiles.
+  static int tile_levels();
+
+  // Size of the tile image, including margins.
+  static cv::Size tile_image_size(int tile_size);
+
+  // Position of the tile image's top left corner in the full image.
+  static cv::Point tile_origin(cv::Rect area, int tile_size);
+
+private:
+  virtual void task();
+
+  std::shared_ptr<ImgTask> m_input;
+  cv::Rect m_area;
+  int m_tile_size;
+};
+
+// Task_Stitch combines the areas of processed tiles back to a full image.
+class Task_Stitch: public ImgTask
+{
+public:
+  Task_Stitch(const std::vector<std::shared_ptr<ImgTask> > &tiles,
+              const std::vector<cv::Rect> &areas, int tile_size);
+
+  virtual size_t estimate_result_bytes() const;
+
+private:
+  virtual void task();
+
+  std::vector<std::shared_ptr<ImgTask> > m_tiles;
+  std::vector<cv::Rect> m_areas;
+  int m_tile_size;
+  cv::Size m_size;
+};
+
+}
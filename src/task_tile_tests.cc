@@ -0,0 +1,206 @@
+#include <gtest/gtest.h>
+#include "task_tile.hh"
+#include "task_wavelet.hh"
+#include "task_merge.hh"
+#include "logger.hh"
+#include <random>
+#include <opencv2/imgproc.hpp>
+
+namespace focusstack {
+
+class TestImg: public ImgTask
+{
+public:
+  TestImg(cv::Mat img, cv::Rect valid_area, int levels = 0): ImgTask(img)
+  {
+    m_valid_area = valid_area;
+    m_wavelet_levels = levels;
+  }
+};
+
+// Tile areas should cover the image exactly once, and the tile images
+// should extend far enough around them.
+TEST(Task_Tile, LayoutCoversImage) {
+  cv::Size size(1000, 700);
+  const int tile_size = 256;
+  std::vector<cv::Rect> areas = Task_Tile::layout(size, tile_size);
+  ASSERT_EQ(areas.size(), (size_t)12);
+
+  cv::Mat coverage = cv::Mat::zeros(size, CV_8U);
+  cv::Size tile_image = Task_Tile::tile_image_size(tile_size);
+  int factor = 1 << Task_Tile::tile_levels();
+  int margin = Task_Wavelet::filter_support(Task_Tile::tile_levels());
+  ASSERT_EQ(tile_image.width % factor, 0);
+  ASSERT_EQ(tile_image.height % factor, 0);
+
+  for (const cv::Rect &area: areas)
+  {
+    ASSERT_LE(area.width, tile_size);
+    ASSERT_LE(area.height, tile_size);
+
+    cv::Point origin = Task_Tile::tile_origin(area, tile_size);
+    ASSERT_EQ(origin.x & (factor - 1), 0);
+    ASSERT_EQ(origin.y & (factor - 1), 0);
+    ASSERT_LE(origin.x, area.x - margin);
+    ASSERT_LE(origin.y, area.y - margin);
+    ASSERT_GE(origin.x + tile_image.width, area.x + area.width + margin);
+    ASSERT_GE(origin.y + tile_image.height, area.y + area.height + margin);
+
+    for (int y = area.y; y < area.y + area.height; y++)
+    {
+      for (int x = area.x; x < area.x + area.width; x++)
+      {
+        coverage.at<uint8_t>(y, x)++;
+      }
+    }
+  }
+
+  for (int y = 0; y < size.height; y++)
+  {
+    for (int x = 0; x < size.width; x++)
+    {
+      ASSERT_EQ(coverage.at<uint8_t>(y, x), 1);
+    }
+  }
+}
+
+// Stitching unprocessed tiles should give back the original image and valid area.
+TEST(Task_Tile, StitchRoundtrip) {
+  std::shared_ptr<Logger> logger = std::make_shared<Logger>();
+  const int tile_size = 200;
+  cv::Mat img(450, 520, CV_8U);
+
+  for (int y = 0; y < img.rows; y++)
+  {
+    for (int x = 0; x < img.cols; x++)
+    {
+      img.at<uint8_t>(y, x) = (uint8_t)(x * 7 + y * 13 + x * y);
+    }
+  }
+
+  cv::Rect valid(10, 20, 480, 400);
+  std::shared_ptr<ImgTask> input = std::make_shared<TestImg>(img, valid);
+  std::vector<cv::Rect> areas = Task_Tile::layout(img.size(), tile_size);
+
+  std::vector<std::shared_ptr<ImgTask> > tiles;
+  for (const cv::Rect &area: areas)
+  {
+    std::shared_ptr<Task_Tile> tile = std::make_shared<Task_Tile>(input, area, tile_size);
+    tile->run(logger);
+    ASSERT_EQ(tile->img().size(), Task_Tile::tile_image_size(tile_size));
+    tiles.push_back(tile);
+  }
+
+  std::shared_ptr<Task_Stitch> stitch = std::make_shared<Task_Stitch>(tiles, areas, tile_size);
+  stitch->run(logger);
+
+  ASSERT_EQ(stitch->img().size(), img.size());
+  ASSERT_EQ(stitch->valid_area().tl(), valid.tl());
+  ASSERT_EQ(stitch->valid_area().size(), valid.size());
+
+  for (int y = 0; y < img.rows; y++)
+  {
+    for (int x = 0; x < img.cols; x++)
+    {
+      ASSERT_EQ(stitch->img().at<uint8_t>(y, x), img.at<uint8_t>(y, x));
+    }
+  }
+}
+
+// Images where the sharpest one changes across the image
+static std::vector<cv::Mat> make_stack(cv::Size size, int count)
+{
+  std::mt19937 rng(1);
+  std::uniform_int_distribution<int> dist(0, 255);
+  cv::Mat texture(size, CV_8U);
+  for (int y = 0; y < size.height; y++)
+  {
+    for (int x = 0; x < size.width; x++)
+    {
+      texture.at<uint8_t>(y, x) = dist(rng);
+    }
+  }
+
+  std::vector<cv::Mat> result;
+  for (int i = 0; i < count; i++)
+  {
+    cv::Mat blurred;
+    cv::GaussianBlur(texture, blurred, cv::Size(0, 0), 3.0);
+
+    // Sharp band moves to the right with the image index
+    cv::Mat img = blurred.clone();
+    int x0 = i * size.width / count;
+    int x1 = (i + 1) * size.width / count;
+    texture.colRange(x0, x1).copyTo(img.colRange(x0, x1));
+    cv::GaussianBlur(img, img, cv::Size(0, 0), 1.0);
+    result.push_back(img);
+  }
+
+  return result;
+}
+
+static std::shared_ptr<ImgTask> merge_stack(std::shared_ptr<Logger> logger,
+                                            const std::vector<std::shared_ptr<ImgTask> > &inputs)
+{
+  std::vector<std::shared_ptr<ImgTask> > wavelets;
+  for (std::shared_ptr<ImgTask> input: inputs)
+  {
+    std::shared_ptr<ImgTask> wavelet = std::make_shared<Task_Wavelet>(input, false);
+    wavelet->run(logger);
+    wavelets.push_back(wavelet);
+  }
+
+  std::shared_ptr<Task_Merge> merge = std::make_shared<Task_Merge>(nullptr, wavelets, 1);
+  merge->run(logger);
+  std::shared_ptr<ImgTask> result = std::make_shared<Task_Wavelet>(merge, true);
+  result->run(logger);
+  return result;
+}
+
+// Tiled merge should give the same result as merging the full image with
+// the same number of wavelet levels. Near the image edges the results differ,
+// because tiles are mirrored and the full image wraps around.
+TEST(Task_Tile, TiledMergeMatchesUntiled) {
+  std::shared_ptr<Logger> logger = std::make_shared<Logger>();
+  cv::Size size(800, 640);
+  const int tile_size = 200;
+  std::vector<cv::Mat> stack = make_stack(size, 4);
+  std::vector<cv::Rect> areas = Task_Tile::layout(size, tile_size);
+  cv::Rect valid(0, 0, size.width, size.height);
+
+  std::vector<std::shared_ptr<ImgTask> > inputs;
+  for (size_t i = 0; i < stack.size(); i++)
+  {
+    inputs.push_back(std::make_shared<TestImg>(stack.at(i), valid, Task_Tile::tile_levels()));
+    inputs.back()->set_index(i);
+  }
+  std::shared_ptr<ImgTask> untiled = merge_stack(logger, inputs);
+
+  std::vector<std::shared_ptr<ImgTask> > merged_tiles;
+  for (const cv::Rect &area: areas)
+  {
+    std::vector<std::shared_ptr<ImgTask> > tiles;
+    for (std::shared_ptr<ImgTask> input: inputs)
+    {
+      std::shared_ptr<ImgTask> tile = std::make_shared<Task_Tile>(input, area, tile_size);
+      tile->run(logger);
+      tiles.push_back(tile);
+    }
+    merged_tiles.push_back(merge_stack(logger, tiles));
+  }
+
+  std::shared_ptr<Task_Stitch> stitch = std::make_shared<Task_Stitch>(merged_tiles, areas, tile_size);
+  stitch->run(logger);
+  ASSERT_EQ(stitch->img().size(), size);
+
+  int margin = Task_Wavelet::filter_support(Task_Tile::tile_levels());
+  for (int y = margin; y < size.height - margin; y++)
+  {
+    for (int x = margin; x < size.width - margin; x++)
+    {
+      ASSERT_NEAR(stitch->img().at<uint8_t>(y, x), untiled->img().at<uint8_t>(y, x), 1) << "at " << x << "," << y;
+    }
+  }
+}
+
+}
@@ -58,6 +58,30 @@ int Task_Wavelet::levels_for_size(cv::Size size, cv::Size *expanded_size)
   return levels;
 }
 
+int Task_Wavelet::levels_for_image(const ImgTask &img)
+{
+  if (img.wavelet_levels() > 0)
+  {
+    return img.wavelet_levels();
+  }
+
+  return levels_for_size(img.img().size());
+}
+
+int Task_Wavelet::filter_support(int levels)
+{
+  // Each level doubles the filter step, and both the decomposition and
+  // the composition extend the support by half the filter length.
+  return Wavelet<cv::Mat>::FILTER_LEN * ((1 << levels) - 1);
+}
+
+size_t Task_Wavelet::estimate_result_bytes() const
+{
+  // Forward transform produces CV_32FC2 and inverse CV_8U
+  size_t pixels = m_input->img().total();
+  return m_inverse ? pixels : pixels * 8;
+}
+
 void Task_Wavelet::task()
 {
   if (!m_inverse)
@@ -67,15 +91,21 @@ void Task_Wavelet::task()
     cv::Mat img = m_input->img();
 
     // nth level wavelet decomposition requires image width to be multiple of 2^n
-    int levels = levels_for_size(img.size());
+    int levels = levels_for_image(*m_input);
     int factor = (1 << levels);
     assert(img.rows % factor == 0 && img.cols % factor == 0);
 
-    cv::Mat tmp(img.rows, img.cols, CV_32FC2);
     m_result.create(img.rows, img.cols, CV_32FC2);
 
-    // Convert input image to complex values
+    if (img.type() == CV_8U)
     {
+      // First level reads the 8-bit image directly
+      Wavelet<cv::Mat>::decompose_multilevel(img, m_result, levels);
+    }
+    else
+    {
+      // Convert input image to complex values
+      cv::Mat tmp(img.rows, img.cols, CV_32FC2);
       cv::Mat fimg(img.rows, img.cols, CV_32F);
       cv::Mat zeros(img.rows, img.cols, CV_32F);
 
@@ -84,16 +114,16 @@ void Task_Wavelet::task()
 
       cv::Mat channels[] = {fimg, zeros};
       cv::merge(channels, 2, tmp);
-    }
 
-    Wavelet<cv::Mat>::decompose_multilevel(tmp, m_result, levels);
+      Wavelet<cv::Mat>::decompose_multilevel(tmp, m_result, levels);
+    }
   }
   else
   {
     // Perform composition from complex wavelets to real-valued image
     cv::Mat src = m_input->img();
     cv::Mat tmp(src.rows, src.cols, CV_32FC2);
-    int levels = levels_for_size(src.size());
+    int levels = levels_for_image(*m_input);
 
     Wavelet<cv::Mat>::compose_multilevel(src, tmp, levels);
 
@@ -104,6 +134,7 @@ void Task_Wavelet::task()
   }
 
   m_valid_area = m_input->valid_area();
+  m_wavelet_levels = m_input->wavelet_levels();
   m_input.reset();
 }
 
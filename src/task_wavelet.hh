@@ -14,6 +14,8 @@ class Task_Wavelet: public ImgTask
 public:
   Task_Wavelet(std::shared_ptr<ImgTask> input, bool inverse);
 
+  virtual size_t estimate_result_bytes() const;
+
   // Decide the number of decomposition levels that will be
   // used for given image size. Ideally (1 << levels) should
   // be larger than largest blur in the image, but small enough
@@ -23,6 +25,14 @@ public:
   // is equal or larger than input and divisible by (1 << levels).
   static int levels_for_size(cv::Size size, cv::Size *expanded_size = nullptr);
 
+  // Number of levels for the image, either given by its wavelet_levels()
+  // or decided by levels_for_size().
+  static int levels_for_image(const ImgTask &img);
+
+  // Number of pixels on each side of a pixel that affect its value
+  // after decomposition and composition with given number of levels.
+  static int filter_support(int levels);
+
   // Range of return values for levels_for_size().
   static const int min_levels = 5;
   static const int max_levels = 10;
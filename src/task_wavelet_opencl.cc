@@ -17,14 +17,21 @@ void Task_Wavelet_OpenCL::task()
     cv::Mat img = m_input->img();
 
     // nth level wavelet decomposition requires image width to be multiple of 2^n
-    int levels = levels_for_size(img.size());
+    int levels = levels_for_image(*m_input);
     int factor = (1 << levels);
     assert(img.rows % factor == 0 && img.cols % factor == 0);
 
-    cv::Mat tmp(img.rows, img.cols, CV_32FC2);
+    cv::UMat utmp;
 
-    // Convert input image to complex values
+    if (img.type() == CV_8U)
     {
+      // First level reads the 8-bit image directly
+      img.copyTo(utmp);
+    }
+    else
+    {
+      // Convert input image to complex values
+      cv::Mat tmp(img.rows, img.cols, CV_32FC2);
       cv::Mat fimg(img.rows, img.cols, CV_32F);
       cv::Mat zeros(img.rows, img.cols, CV_32F);
 
@@ -33,10 +40,9 @@ void Task_Wavelet_OpenCL::task()
 
       cv::Mat channels[] = {fimg, zeros};
       cv::merge(channels, 2, tmp);
-    }
 
-    cv::UMat utmp(img.rows, img.cols, CV_32FC2);
-    tmp.copyTo(utmp);
+      tmp.copyTo(utmp);
+    }
 
     cv::UMat uresult(img.rows, img.cols, CV_32FC2);
     Wavelet<cv::UMat>::decompose_multilevel(utmp, uresult, levels);
@@ -48,7 +54,7 @@ void Task_Wavelet_OpenCL::task()
     // Perform composition from complex wavelets to real-valued image
     cv::UMat usrc = m_input->img().getUMat(cv::ACCESS_READ);
     cv::UMat utmp(usrc.rows, usrc.cols, CV_32FC2);
-    int levels = levels_for_size(usrc.size());
+    int levels = levels_for_image(*m_input);
 
     Wavelet<cv::UMat>::compose_multilevel(usrc, utmp, levels);
 
@@ -59,5 +65,6 @@ void Task_Wavelet_OpenCL::task()
   }
 
   m_valid_area = m_input->valid_area();
+  m_wavelet_levels = m_input->wavelet_levels();
   m_input.reset();
 }
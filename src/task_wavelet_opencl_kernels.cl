@@ -89,6 +89,54 @@ __kernel void decompose_vertical(__global const uchar *src, int src_step, int sr
   }
 }
 
+// Vertical decomposition of CV_8U real-valued image. Gives the same result
+// as decompose_vertical() on the image converted to complex values, but
+// leaves out the products with the zero imaginary part. Contraction to
+// multiply-add is disabled so that rounding matches decompose_vertical().
+#define LOAD_REAL(x, y) convert_float(src[mad24(y, src_step, src_offset + (x))])
+
+__kernel void decompose_vertical_real(__global const uchar *src, int src_step, int src_offset,
+                                      __global uchar *dst, int dst_step, int dst_offset, int rows, int cols,
+                                      float16 lopass, float16 hipass)
+{
+#pragma OPENCL FP_CONTRACT OFF
+  const int x = get_global_id(0);
+  const int y = get_global_id(1) * 2;
+
+  if (x < cols && y < rows)
+  {
+    float2 lp, hp;
+    float v;
+
+    v = LOAD_REAL(x, WRAP(y, -3, rows));
+    lp = v * lopass.s01;
+    hp = v * hipass.s01;
+
+    v = LOAD_REAL(x, WRAP(y, -2, rows));
+    lp += v * lopass.s23;
+    hp += v * hipass.s23;
+
+    v = LOAD_REAL(x, WRAP(y, -1, rows));
+    lp += v * lopass.s45;
+    hp += v * hipass.s45;
+
+    v = LOAD_REAL(x, y);
+    lp += v * lopass.s67;
+    hp += v * hipass.s67;
+
+    v = LOAD_REAL(x, WRAP(y,  1, rows));
+    lp += v * lopass.s89;
+    hp += v * hipass.s89;
+
+    v = LOAD_REAL(x, WRAP(y,  2, rows));
+    lp += v * lopass.sAB;
+    hp += v * hipass.sAB;
+
+    STORE(x, y / 2) = lp;
+    STORE(x, y / 2 + rows / 2) = hp;
+  }
+}
+
 __kernel void compose_horizontal(__global const uchar *src, int src_step, int src_offset,
                                  __global uchar *dst, int dst_step, int dst_offset, int rows, int cols,
                                  float16 lopass, float16 hipass)
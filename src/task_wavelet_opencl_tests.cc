@@ -221,4 +221,36 @@ TEST(Task_Wavelet_OpenCL, Multilevel) {
   }
 }
 
+// Decomposing CV_8U image with OpenCL should give exactly the same
+// result as converting it to complex values first.
+TEST(Task_Wavelet_OpenCL, RealInputMatches) {
+  if (!cv::ocl::haveOpenCL()) GTEST_SKIP();
+
+  cv::Mat img(64, 96, CV_8U);
+  cv::randu(img, 0, 256);
+
+  cv::Mat fimg, zeros(img.rows, img.cols, CV_32F, cv::Scalar(0));
+  img.convertTo(fimg, CV_32F);
+  cv::Mat channels[] = {fimg, zeros};
+  cv::Mat complex;
+  cv::merge(channels, 2, complex);
+
+  cv::Mat expected, result;
+
+  {
+    cv::UMat uimg, ucomplex;
+    img.copyTo(uimg);
+    complex.copyTo(ucomplex);
+
+    cv::UMat uexpected(img.rows, img.cols, CV_32FC2);
+    cv::UMat uresult(img.rows, img.cols, CV_32FC2);
+    Wavelet<cv::UMat>::decompose_multilevel(ucomplex, uexpected, 4);
+    Wavelet<cv::UMat>::decompose_multilevel(uimg, uresult, 4);
+    uexpected.copyTo(expected);
+    uresult.copyTo(result);
+  }
+
+  ASSERT_EQ(cv::norm(expected, result, cv::NORM_INF), 0.0);
+}
+
 }
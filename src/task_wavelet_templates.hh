@@ -6,7 +6,9 @@
 #include <opencv2/core/core.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
 #include <opencv2/core/ocl.hpp>
+#include <opencv2/core/hal/intrin.hpp>
 #include <mutex>
+#include <type_traits>
 #include "task_wavelet_opencl_kernels.cl"
 
 namespace focusstack {
@@ -16,18 +18,27 @@ class Wavelet {
 public:
   static void decompose_multilevel(const M &input, M &output, int levelcount);
   static void decompose(const M &input, M &output);
+  static void decompose(const M &input, M &output, M &tmp);
+  static void decompose_fused(const M &input, M &output);
   static void decompose_1d(const M &src, M &dest, bool vertical);
 
   static void compose_multilevel(const M &input, M &output, int levelcount);
   static void compose(const M &input, M &output);
+  static void compose(const M &input, M &output, M &tmp);
+  static void compose_fused(const M &input, M &output);
   static void compose_1d(const M &src, M &dest, bool vertical);
 
+  // Plain C++ versions of decompose_1d() and compose_1d() for cv::Mat,
+  // used as reference for the vectorized versions.
+  static void decompose_1d_scalar(const M &src, M &dest, bool vertical);
+  static void compose_1d_scalar(const M &src, M &dest, bool vertical);
+
   static cv::ocl::Program &opencl_load_kernel();
 
-private:
-  // Complex Daubechies wavelets.
+  // Length of the complex Daubechies wavelet filters.
   static constexpr int FILTER_LEN = 6;
 
+private:
   static constexpr float c_lopass[16] = {
     -0.0662912607f, -0.0855816496f,
      0.1104854346f, -0.0855816496f,
@@ -48,6 +59,55 @@ private:
       0.0662912607f, -0.0855816496f,
       0.0f, 0.0f, 0.0f, 0.0f
   };
+
+  // Compute single output of 1-dimensional transform. The src pointer points
+  // to the start of a row or column, with stride floats between the pixels.
+  static void decompose_point(const float *src, int stride, int length, int y, float *lo, float *hi);
+  static void compose_point(const float *src, int stride, int length, int y, float *out);
+
+  // Transform one row of length pixels horizontally.
+  static void decompose_row(const float *src, float *dest, int length);
+  static void compose_row(const float *src, float *dest, int length);
+
+  // Compute output rows of the vertical transform that correspond to
+  // source row y. Decomposition produces lowpass and highpass rows for
+  // even y, composition produces one row for any y.
+  static void decompose_rows(const cv::Mat &src, int y, float *lo, float *hi);
+  static void compose_rows(const cv::Mat &src, int y, float *dest);
+
+  // Same as decompose_rows() for CV_8U input, which is taken as the real
+  // part of the complex values with zero imaginary part.
+  static void decompose_rows_real(const cv::Mat &src, int y, float *lo, float *hi);
+};
+
+// Runs multilevel transforms using buffers that are kept between calls,
+// so that transforming several images of the same size does not allocate.
+// The lowpass band is transformed in place through a single intermediate
+// buffer, instead of being copied between levels.
+//
+// With fused = true, the full-resolution level of cv::Mat transforms does
+// the vertical and horizontal passes row by row, so that the intermediate
+// result stays in cache. OpenCL transforms always use separate passes.
+template <typename M>
+class WaveletEngine {
+public:
+  WaveletEngine(bool fused = true);
+
+  void decompose_multilevel(const M &input, M &output, int levelcount);
+  void compose_multilevel(const M &input, M &output, int levelcount);
+
+  // Number and total size of buffer allocations done by this engine.
+  int allocations() const { return m_allocations; }
+  size_t allocated_bytes() const { return m_allocated_bytes; }
+
+private:
+  // Returns area of buffer with given size, allocating if needed.
+  M reserve(M &buffer, cv::Size size);
+
+  bool m_fused;
+  M m_tmp; // Intermediate result, or copy of input for fused composition
+  int m_allocations;
+  size_t m_allocated_bytes;
 };
 
 // These lines are needed to avoid undefined reference to the constexpr arrays.
@@ -57,75 +117,241 @@ template <typename M> constexpr float Wavelet<M>::c_hipass[];
 // Performs multiple levels of decomposition
 // Begins with whole image, then processes the upper left corner that contains
 // the downscaled image from previous step.
+// Input can be either CV_32FC2 complex image or CV_8U real-valued image.
 template <typename M>
 void Wavelet<M>::decompose_multilevel(const M &input, M &output, int levelcount)
 {
-  M tmp(input.rows, input.cols, CV_32FC2);
+  WaveletEngine<M> engine;
+  engine.decompose_multilevel(input, output, levelcount);
+}
+
+// Performs multiple levels of composition.
+// Begins with the upper left corner, composing it to the downscaled
+// image for next level.
+template <typename M>
+void Wavelet<M>::compose_multilevel(const M& input, M& output, int levelcount)
+{
+  WaveletEngine<M> engine;
+  engine.compose_multilevel(input, output, levelcount);
+}
+
+// Performs one level of decomposition.
+// Takes an input image, and outputs the complex values for downscaled / horizontal / diagonal / vertical subbands.
+// Input matrix should not alias output matrix.
+template <typename M>
+void Wavelet<M>::decompose(const M& input, M &output)
+{
+  M tmp1(input.rows, input.cols, CV_32FC2);
+  decompose(input, output, tmp1);
+}
+
+// Performs one level of decomposition through given temporary matrix of
+// same size as input. Input may be the same matrix as output.
+template <typename M>
+void Wavelet<M>::decompose(const M& input, M &output, M &tmp)
+{
+  decompose_1d(input, tmp, true);
+  decompose_1d(tmp, output, false);
+}
+
+// Performs one level of composition
+template <typename M>
+void Wavelet<M>::compose(const M& input, M &output)
+{
+  M tmp1(input.rows, input.cols, CV_32FC2);
+  compose(input, output, tmp1);
+}
+
+template <typename M>
+void Wavelet<M>::compose(const M& input, M &output, M &tmp)
+{
+  compose_1d(input, tmp, true);
+  compose_1d(tmp, output, false);
+}
+
+// Fused transforms are only implemented for cv::Mat
+template <typename M>
+void Wavelet<M>::decompose_fused(const M&, M&)
+{
+  throw std::logic_error("Fused wavelet transform is not available for this matrix type");
+}
+
+template <typename M>
+void Wavelet<M>::compose_fused(const M&, M&)
+{
+  throw std::logic_error("Fused wavelet transform is not available for this matrix type");
+}
+
+template <typename M>
+WaveletEngine<M>::WaveletEngine(bool fused):
+  m_fused(fused && std::is_same<M, cv::Mat>::value),
+  m_allocations(0), m_allocated_bytes(0)
+{
+}
+
+template <typename M>
+M WaveletEngine<M>::reserve(M &buffer, cv::Size size)
+{
+  if (buffer.rows < size.height || buffer.cols < size.width)
+  {
+    buffer.create(std::max(buffer.rows, size.height), std::max(buffer.cols, size.width), CV_32FC2);
+    m_allocations++;
+    m_allocated_bytes += buffer.total() * buffer.elemSize();
+  }
+
+  return buffer(cv::Rect(0, 0, size.width, size.height));
+}
+
+template <typename M>
+void WaveletEngine<M>::decompose_multilevel(const M &input, M &output, int levelcount)
+{
+  output.create(input.rows, input.cols, CV_32FC2);
 
   for (int i = 0; i < levelcount; i++)
   {
     int w = input.cols >> i;
     int h = input.rows >> i;
-    M srcarea;
-    M dstarea = output(cv::Rect(0, 0, w, h));
 
-    if (i == 0)
+    if (i == 0 && m_fused)
     {
-      srcarea = input(cv::Rect(0, 0, w, h));
+      Wavelet<M>::decompose_fused(input, output);
     }
     else
     {
-      srcarea = tmp(cv::Rect(0, 0, w, h));
-      dstarea.copyTo(srcarea);
-    }
+      M tmp = reserve(m_tmp, cv::Size(w, h));
+      M dstarea = output(cv::Rect(0, 0, w, h));
 
-    decompose(srcarea, dstarea);
+      if (i == 0)
+      {
+        Wavelet<M>::decompose(input, dstarea, tmp);
+      }
+      else
+      {
+        Wavelet<M>::decompose(dstarea, dstarea, tmp);
+      }
+    }
   }
 }
 
-// Performs multiple levels of composition.
-// Begins with the upper left corner, composing it to the downscaled
-// image for next level.
 template <typename M>
-void Wavelet<M>::compose_multilevel(const M& input, M& output, int levelcount)
+void WaveletEngine<M>::compose_multilevel(const M &input, M &output, int levelcount)
 {
-  M tmp(input.rows, input.cols, CV_32FC2);
+  if (levelcount <= 0)
+    return;
+
+  output.create(input.rows, input.cols, CV_32FC2);
+
+  // Fused pass cannot work in place, so the coarser levels are composed
+  // in a separate work buffer and output is used as the temporary area.
+  M work;
+  if (m_fused)
+  {
+    work = reserve(m_tmp, cv::Size(input.cols, input.rows));
+  }
+  else
+  {
+    work = output;
+  }
 
-  input.copyTo(tmp);
+  input.copyTo(work);
 
-  for (int i = levelcount - 1; i >= 0; i--)
+  int last = m_fused ? 1 : 0;
+  for (int i = levelcount - 1; i >= last; i--)
   {
     int w = input.cols >> i;
     int h = input.rows >> i;
-    M srcarea = tmp(cv::Rect(0, 0, w, h));
-    M dstarea = output(cv::Rect(0, 0, w, h));
+    M tmp = m_fused ? output(cv::Rect(0, 0, w, h)) : reserve(m_tmp, cv::Size(w, h));
+    M area = work(cv::Rect(0, 0, w, h));
 
-    compose(srcarea, dstarea);
+    Wavelet<M>::compose(area, area, tmp);
+  }
 
-    dstarea.copyTo(tmp(cv::Rect(0, 0, w, h)));
+  if (m_fused)
+  {
+    Wavelet<M>::compose_fused(work, output);
   }
 }
 
-// Performs one level of decomposition.
-// Takes an input image, and outputs the complex values for downscaled / horizontal / diagonal / vertical subbands.
-// Input matrix should not alias output matrix.
+#if CV_SIMD
+// Number of float lanes in v_float32, the API differs between OpenCV versions.
+static inline int wavelet_vlanes()
+{
+#if CV_VERSION_MAJOR > 4 || (CV_VERSION_MAJOR == 4 && CV_VERSION_MINOR >= 8)
+  return cv::VTraits<cv::v_float32>::vlanes();
+#else
+  return cv::v_float32::nlanes;
+#endif
+}
+
+// Accumulate complex product of input (re, im) and filter tap (c0, c1).
+// The filter tap is given as vectors c0, -c1 and c1.
+static inline void wavelet_cmac(const cv::v_float32 &re, const cv::v_float32 &im,
+                                const cv::v_float32 &c0, const cv::v_float32 &neg_c1, const cv::v_float32 &c1,
+                                cv::v_float32 &acc_re, cv::v_float32 &acc_im)
+{
+  acc_re = cv::v_fma(re, c0, acc_re);
+  acc_re = cv::v_fma(im, neg_c1, acc_re);
+  acc_im = cv::v_fma(im, c0, acc_im);
+  acc_im = cv::v_fma(re, c1, acc_im);
+}
+#endif
+
 template <typename M>
-void Wavelet<M>::decompose(const M& input, M &output)
+inline void Wavelet<M>::decompose_point(const float *src, int stride, int length, int y, float *lo, float *hi)
 {
-  M tmp1(input.rows, input.cols, CV_32FC2);
+  const cv::Vec2f *lopass = reinterpret_cast<const cv::Vec2f*>(c_lopass);
+  const cv::Vec2f *hipass = reinterpret_cast<const cv::Vec2f*>(c_hipass);
+  float re_lo = 0.0f;
+  float im_lo = 0.0f;
+  float re_hi = 0.0f;
+  float im_hi = 0.0f;
+
+  for (int j = 0; j < FILTER_LEN; j++)
+  {
+    int pos = y + j - FILTER_LEN / 2;
+    if (pos < 0) pos = length + pos;
+    if (pos >= length) pos = pos - length;
+
+    const float *val = src + (size_t)pos * stride;
 
-  decompose_1d(input, tmp1, true);
-  decompose_1d(tmp1, output, false);
+    re_lo += val[0] * lopass[j][0] - val[1] * lopass[j][1];
+    im_lo += val[1] * lopass[j][0] + val[0] * lopass[j][1];
+    re_hi += val[0] * hipass[j][0] - val[1] * hipass[j][1];
+    im_hi += val[1] * hipass[j][0] + val[0] * hipass[j][1];
+  }
+
+  lo[0] = re_lo;
+  lo[1] = im_lo;
+  hi[0] = re_hi;
+  hi[1] = im_hi;
 }
 
-// Performs one level of composition
 template <typename M>
-void Wavelet<M>::compose(const M& input, M &output)
+inline void Wavelet<M>::compose_point(const float *src, int stride, int length, int y, float *out)
 {
-  M tmp1(input.rows, input.cols, CV_32FC2);
+  const cv::Vec2f *lopass = reinterpret_cast<const cv::Vec2f*>(c_lopass);
+  const cv::Vec2f *hipass = reinterpret_cast<const cv::Vec2f*>(c_hipass);
+  int halflen = length / 2;
+  float re = 0.0f;
+  float im = 0.0f;
+
+  for (int j = (y + FILTER_LEN / 2) % 2; j < FILTER_LEN; j += 2)
+  {
+    int pos = (y - j + FILTER_LEN / 2) / 2;
+    if (pos < 0) pos = halflen + pos;
+    if (pos >= halflen) pos = pos - halflen;
+
+    const float *val_lo = src + (size_t)pos * stride;
+    const float *val_hi = src + (size_t)(pos + halflen) * stride;
+
+    re += val_lo[0] * lopass[j][0] + val_hi[0] * hipass[j][0];
+    re += val_lo[1] * lopass[j][1] + val_hi[1] * hipass[j][1];
+    im += val_lo[1] * lopass[j][0] + val_hi[1] * hipass[j][0];
+    im -= val_lo[0] * lopass[j][1] + val_hi[0] * hipass[j][1];
+  }
 
-  compose_1d(input, tmp1, true);
-  compose_1d(tmp1, output, false);
+  out[0] = re;
+  out[1] = im;
 }
 
 // This function performs 1-dimensional complex wavelet decomposition.
@@ -134,96 +360,522 @@ void Wavelet<M>::compose(const M& input, M &output)
 // contain the lowpass result, and second half will contain the highpass
 // result.
 template <>
-inline void Wavelet<cv::Mat>::decompose_1d(const cv::Mat &src, cv::Mat &dest, bool vertical)
+inline void Wavelet<cv::Mat>::decompose_1d_scalar(const cv::Mat &src, cv::Mat &dest, bool vertical)
 {
   int count = vertical ? src.cols : src.rows;
   int length = vertical ? src.rows : src.cols;
   int halflen = length / 2;
-  const cv::Vec2f *lopass = reinterpret_cast<const cv::Vec2f*>(c_lopass);
-  const cv::Vec2f *hipass = reinterpret_cast<const cv::Vec2f*>(c_hipass);
 
   for (int x = 0; x < count; x++)
   {
+    const float *line = vertical ? src.ptr<float>(0, x) : src.ptr<float>(x);
+    int stride = vertical ? (int)(src.step[0] / sizeof(float)) : 2;
+
     for (int y = 0; y < length; y += 2)
     {
-      float re_lo = 0.0f;
-      float im_lo = 0.0f;
-      float re_hi = 0.0f;
-      float im_hi = 0.0f;
+      float *lo = vertical ? dest.ptr<float>(y/2, x) : dest.ptr<float>(x, y/2);
+      float *hi = vertical ? dest.ptr<float>(y/2 + halflen, x) : dest.ptr<float>(x, y/2 + halflen);
+      decompose_point(line, stride, length, y, lo, hi);
+    }
+  }
+}
 
-      for (int j = 0; j < FILTER_LEN; j++)
-      {
-        int pos = y + j - FILTER_LEN / 2;
-        if (pos < 0) pos = length + pos;
-        if (pos >= length) pos = pos - length;
+// Opposite of decompose_1d.
+template <>
+inline void Wavelet<cv::Mat>::compose_1d_scalar(const cv::Mat& src, cv::Mat& dest, bool vertical)
+{
+  int count = vertical ? src.cols : src.rows;
+  int length = vertical ? src.rows : src.cols;
 
-        cv::Point xy = vertical ? cv::Point(x, pos) : cv::Point(pos, x);
-        cv::Vec2f val = src.at<cv::Vec2f>(xy);
+  for (int x = 0; x < count; x++)
+  {
+    const float *line = vertical ? src.ptr<float>(0, x) : src.ptr<float>(x);
+    int stride = vertical ? (int)(src.step[0] / sizeof(float)) : 2;
 
-        re_lo += val[0] * lopass[j][0] - val[1] * lopass[j][1];
-        im_lo += val[1] * lopass[j][0] + val[0] * lopass[j][1];
-        re_hi += val[0] * hipass[j][0] - val[1] * hipass[j][1];
-        im_hi += val[1] * hipass[j][0] + val[0] * hipass[j][1];
-      }
+    for (int y = 0; y < length; y++)
+    {
+      float *out = vertical ? dest.ptr<float>(y, x) : dest.ptr<float>(x, y);
+      compose_point(line, stride, length, y, out);
+    }
+  }
+}
+
+#if CV_SIMD
+// Filter taps broadcast to vector registers.
+struct WaveletVectorTaps
+{
+  cv::v_float32 re[6];
+  cv::v_float32 im[6];
+  cv::v_float32 neg_im[6];
+
+  explicit WaveletVectorTaps(const float *taps)
+  {
+    for (int j = 0; j < 6; j++)
+    {
+      re[j] = cv::vx_setall_f32(taps[2 * j]);
+      im[j] = cv::vx_setall_f32(taps[2 * j + 1]);
+      neg_im[j] = cv::vx_setall_f32(-taps[2 * j + 1]);
+    }
+  }
+};
+#endif
 
-      if (vertical)
+// Horizontal decomposition of one row. The outputs near the ends of the
+// row wrap around and are computed with decompose_point().
+template <typename M>
+inline void Wavelet<M>::decompose_row(const float *src, float *dest, int length)
+{
+  int halflen = length / 2;
+  int outputs = (length + 1) / 2;
+  int start = 0;
+  int end = 0;
+
+#if CV_SIMD
+  // Output k uses input pixels 2k-3 .. 2k+2. The vector loads read pixels
+  // 2k-4 .. 2k+2N+1 for block of N outputs starting at k.
+  const int N = wavelet_vlanes();
+  start = std::min(2, outputs);
+  end = start + std::max(0, ((length - 2) / 2 - start) / N * N);
+#endif
+
+  for (int k = 0; k < start; k++)
+  {
+    decompose_point(src, 2, length, 2 * k, dest + 2 * k, dest + 2 * (k + halflen));
+  }
+
+#if CV_SIMD
+  if (end > start)
+  {
+    WaveletVectorTaps lo(c_lopass);
+    WaveletVectorTaps hi(c_hipass);
+
+    for (int k = start; k < end; k += N)
+    {
+      // Even and odd pixels of the four loads give the six filter taps
+      cv::v_float32 re[8], im[8];
+      cv::v_load_deinterleave(src + 2 * (2 * k - 4), re[0], im[0], re[1], im[1]);
+      cv::v_load_deinterleave(src + 2 * (2 * k - 2), re[2], im[2], re[3], im[3]);
+      cv::v_load_deinterleave(src + 2 * (2 * k),     re[4], im[4], re[5], im[5]);
+      cv::v_load_deinterleave(src + 2 * (2 * k + 2), re[6], im[6], re[7], im[7]);
+
+      cv::v_float32 lo_re = cv::vx_setzero_f32(), lo_im = cv::vx_setzero_f32();
+      cv::v_float32 hi_re = cv::vx_setzero_f32(), hi_im = cv::vx_setzero_f32();
+      for (int j = 0; j < FILTER_LEN; j++)
       {
-        dest.at<cv::Vec2f>(cv::Point(x, y/2)) = cv::Vec2f(re_lo, im_lo);
-        dest.at<cv::Vec2f>(cv::Point(x, y/2 + halflen)) = cv::Vec2f(re_hi, im_hi);
+        wavelet_cmac(re[j + 1], im[j + 1], lo.re[j], lo.neg_im[j], lo.im[j], lo_re, lo_im);
+        wavelet_cmac(re[j + 1], im[j + 1], hi.re[j], hi.neg_im[j], hi.im[j], hi_re, hi_im);
       }
-      else
+
+      cv::v_store_interleave(dest + 2 * k, lo_re, lo_im);
+      cv::v_store_interleave(dest + 2 * (k + halflen), hi_re, hi_im);
+    }
+  }
+#endif
+
+  for (int k = end; k < outputs; k++)
+  {
+    decompose_point(src, 2, length, 2 * k, dest + 2 * k, dest + 2 * (k + halflen));
+  }
+}
+
+// Vertical decomposition processes whole rows at a time, so that memory
+// is accessed sequentially. Wrap-around only affects which rows are used.
+template <typename M>
+inline void Wavelet<M>::decompose_rows(const cv::Mat &src, int y, float *out_lo, float *out_hi)
+{
+  int length = src.rows;
+  int width = src.cols;
+  const cv::Vec2f *lopass = reinterpret_cast<const cv::Vec2f*>(c_lopass);
+  const cv::Vec2f *hipass = reinterpret_cast<const cv::Vec2f*>(c_hipass);
+
+  const float *rows[FILTER_LEN];
+  for (int j = 0; j < FILTER_LEN; j++)
+  {
+    int pos = y + j - FILTER_LEN / 2;
+    if (pos < 0) pos = length + pos;
+    if (pos >= length) pos = pos - length;
+    rows[j] = src.ptr<float>(pos);
+  }
+
+  int x = 0;
+
+#if CV_SIMD
+  const int N = wavelet_vlanes();
+  if (width >= N)
+  {
+    WaveletVectorTaps lo(c_lopass);
+    WaveletVectorTaps hi(c_hipass);
+
+    for (; x <= width - N; x += N)
+    {
+      cv::v_float32 lo_re = cv::vx_setzero_f32(), lo_im = cv::vx_setzero_f32();
+      cv::v_float32 hi_re = cv::vx_setzero_f32(), hi_im = cv::vx_setzero_f32();
+      for (int j = 0; j < FILTER_LEN; j++)
       {
-        dest.at<cv::Vec2f>(cv::Point(y/2, x)) = cv::Vec2f(re_lo, im_lo);
-        dest.at<cv::Vec2f>(cv::Point(y/2 + halflen, x)) = cv::Vec2f(re_hi, im_hi);
+        cv::v_float32 re, im;
+        cv::v_load_deinterleave(rows[j] + 2 * x, re, im);
+        wavelet_cmac(re, im, lo.re[j], lo.neg_im[j], lo.im[j], lo_re, lo_im);
+        wavelet_cmac(re, im, hi.re[j], hi.neg_im[j], hi.im[j], hi_re, hi_im);
       }
+
+      cv::v_store_interleave(out_lo + 2 * x, lo_re, lo_im);
+      cv::v_store_interleave(out_hi + 2 * x, hi_re, hi_im);
+    }
+  }
+#endif
+
+  for (; x < width; x++)
+  {
+    float re_lo = 0.0f;
+    float im_lo = 0.0f;
+    float re_hi = 0.0f;
+    float im_hi = 0.0f;
+
+    for (int j = 0; j < FILTER_LEN; j++)
+    {
+      const float *val = rows[j] + 2 * x;
+      re_lo += val[0] * lopass[j][0] - val[1] * lopass[j][1];
+      im_lo += val[1] * lopass[j][0] + val[0] * lopass[j][1];
+      re_hi += val[0] * hipass[j][0] - val[1] * hipass[j][1];
+      im_hi += val[1] * hipass[j][0] + val[0] * hipass[j][1];
     }
+
+    out_lo[2 * x] = re_lo;
+    out_lo[2 * x + 1] = im_lo;
+    out_hi[2 * x] = re_hi;
+    out_hi[2 * x + 1] = im_hi;
   }
 }
 
-// Opposite of decompose_1d.
-template <>
-inline void Wavelet<cv::Mat>::compose_1d(const cv::Mat& src, cv::Mat& dest, bool vertical)
+// Vertical decomposition of CV_8U rows. The pixel values are converted
+// to float while loading, and the products with the zero imaginary part
+// are left out. Because the omitted terms are exactly zero, the result
+// is identical to converting the image to CV_32FC2 first.
+template <typename M>
+inline void Wavelet<M>::decompose_rows_real(const cv::Mat &src, int y, float *out_lo, float *out_hi)
 {
-  int count = vertical ? src.cols : src.rows;
-  int length = vertical ? src.rows : src.cols;
-  int halflen = length / 2;
+  int length = src.rows;
+  int width = src.cols;
   const cv::Vec2f *lopass = reinterpret_cast<const cv::Vec2f*>(c_lopass);
   const cv::Vec2f *hipass = reinterpret_cast<const cv::Vec2f*>(c_hipass);
 
-  for (int x = 0; x < count; x++)
+  const uint8_t *rows[FILTER_LEN];
+  for (int j = 0; j < FILTER_LEN; j++)
   {
-    for (int y = 0; y < length; y++)
-    {
-      float re = 0.0f;
-      float im = 0.0f;
+    int pos = y + j - FILTER_LEN / 2;
+    if (pos < 0) pos = length + pos;
+    if (pos >= length) pos = pos - length;
+    rows[j] = src.ptr<uint8_t>(pos);
+  }
+
+  int x = 0;
+
+#if CV_SIMD
+  const int N = wavelet_vlanes();
+  if (width >= N)
+  {
+    WaveletVectorTaps lo(c_lopass);
+    WaveletVectorTaps hi(c_hipass);
 
-      for (int j = (y + FILTER_LEN / 2) % 2; j < FILTER_LEN; j += 2)
+    for (; x <= width - N; x += N)
+    {
+      cv::v_float32 lo_re = cv::vx_setzero_f32(), lo_im = cv::vx_setzero_f32();
+      cv::v_float32 hi_re = cv::vx_setzero_f32(), hi_im = cv::vx_setzero_f32();
+      for (int j = 0; j < FILTER_LEN; j++)
       {
-        int pos = (y - j + FILTER_LEN / 2) / 2;
-        if (pos < 0) pos = halflen + pos;
-        if (pos >= halflen) pos = pos - halflen;
+        cv::v_float32 re = cv::v_cvt_f32(cv::v_reinterpret_as_s32(cv::vx_load_expand_q(rows[j] + x)));
+        lo_re = cv::v_fma(re, lo.re[j], lo_re);
+        lo_im = cv::v_fma(re, lo.im[j], lo_im);
+        hi_re = cv::v_fma(re, hi.re[j], hi_re);
+        hi_im = cv::v_fma(re, hi.im[j], hi_im);
+      }
+
+      cv::v_store_interleave(out_lo + 2 * x, lo_re, lo_im);
+      cv::v_store_interleave(out_hi + 2 * x, hi_re, hi_im);
+    }
+  }
+#endif
+
+  for (; x < width; x++)
+  {
+    float re_lo = 0.0f;
+    float im_lo = 0.0f;
+    float re_hi = 0.0f;
+    float im_hi = 0.0f;
+
+    for (int j = 0; j < FILTER_LEN; j++)
+    {
+      float val = rows[j][x];
+      re_lo += val * lopass[j][0];
+      im_lo += val * lopass[j][1];
+      re_hi += val * hipass[j][0];
+      im_hi += val * hipass[j][1];
+    }
+
+    out_lo[2 * x] = re_lo;
+    out_lo[2 * x + 1] = im_lo;
+    out_hi[2 * x] = re_hi;
+    out_hi[2 * x + 1] = im_hi;
+  }
+}
+
+// Horizontal composition of one row. Outputs 2m and 2m+1 use lowpass and
+// highpass values m-1 .. m+2, outputs near the ends of the row wrap around.
+template <typename M>
+inline void Wavelet<M>::compose_row(const float *src, float *dest, int length)
+{
+  int start = 0;
+  int end = 0;
+
+#if CV_SIMD
+  int halflen = length / 2;
+  const int N = wavelet_vlanes();
+  start = std::min(1, halflen);
+  end = start + std::max(0, (halflen - 2 - start) / N * N);
+#endif
+
+  for (int y = 0; y < 2 * start; y++)
+  {
+    compose_point(src, 2, length, y, dest + 2 * y);
+  }
 
-        cv::Vec2f val_lo = src.at<cv::Vec2f>(vertical ? cv::Point(x, pos) : cv::Point(pos, x));
-        cv::Vec2f val_hi = src.at<cv::Vec2f>(vertical ? cv::Point(x, pos + halflen) : cv::Point(pos + halflen, x));
+#if CV_SIMD
+  if (end > start)
+  {
+    WaveletVectorTaps lo(c_lopass);
+    WaveletVectorTaps hi(c_hipass);
 
-        re += val_lo[0] * lopass[j][0] + val_hi[0] * hipass[j][0];
-        re += val_lo[1] * lopass[j][1] + val_hi[1] * hipass[j][1];
-        im += val_lo[1] * lopass[j][0] + val_hi[1] * hipass[j][0];
-        im -= val_lo[0] * lopass[j][1] + val_hi[0] * hipass[j][1];
+    for (int m = start; m < end; m += N)
+    {
+      cv::v_float32 lo_re[4], lo_im[4], hi_re[4], hi_im[4];
+      for (int i = 0; i < 4; i++)
+      {
+        cv::v_load_deinterleave(src + 2 * (m - 1 + i), lo_re[i], lo_im[i]);
+        cv::v_load_deinterleave(src + 2 * (m - 1 + i + halflen), hi_re[i], hi_im[i]);
       }
 
-      if (vertical)
+      cv::v_float32 re[2], im[2];
+      for (int odd = 0; odd < 2; odd++)
       {
-        dest.at<cv::Vec2f>(cv::Point(x, y)) = cv::Vec2f(re, im);
+        re[odd] = cv::vx_setzero_f32();
+        im[odd] = cv::vx_setzero_f32();
+
+        for (int i = 0; i < 3; i++)
+        {
+          // Even outputs use taps 5, 3, 1 and odd outputs taps 4, 2, 0
+          // on values m-1, m, m+1 and m, m+1, m+2 respectively.
+          int v = odd + i;
+          int j = 5 - odd - 2 * i;
+          re[odd] = cv::v_fma(lo_re[v], lo.re[j], re[odd]);
+          re[odd] = cv::v_fma(hi_re[v], hi.re[j], re[odd]);
+          re[odd] = cv::v_fma(lo_im[v], lo.im[j], re[odd]);
+          re[odd] = cv::v_fma(hi_im[v], hi.im[j], re[odd]);
+          im[odd] = cv::v_fma(lo_im[v], lo.re[j], im[odd]);
+          im[odd] = cv::v_fma(hi_im[v], hi.re[j], im[odd]);
+          im[odd] = cv::v_fma(lo_re[v], lo.neg_im[j], im[odd]);
+          im[odd] = cv::v_fma(hi_re[v], hi.neg_im[j], im[odd]);
+        }
       }
-      else
+
+      cv::v_store_interleave(dest + 4 * m, re[0], im[0], re[1], im[1]);
+    }
+  }
+#endif
+
+  for (int y = 2 * end; y < length; y++)
+  {
+    compose_point(src, 2, length, y, dest + 2 * y);
+  }
+}
+
+// Vertical composition of one row.
+template <typename M>
+inline void Wavelet<M>::compose_rows(const cv::Mat &src, int y, float *out)
+{
+  int length = src.rows;
+  int halflen = length / 2;
+  int width = src.cols;
+  const cv::Vec2f *lopass = reinterpret_cast<const cv::Vec2f*>(c_lopass);
+  const cv::Vec2f *hipass = reinterpret_cast<const cv::Vec2f*>(c_hipass);
+
+  const float *rows_lo[3];
+  const float *rows_hi[3];
+  int taps[3];
+  int count = 0;
+
+  for (int j = (y + FILTER_LEN / 2) % 2; j < FILTER_LEN; j += 2)
+  {
+    int pos = (y - j + FILTER_LEN / 2) / 2;
+    if (pos < 0) pos = halflen + pos;
+    if (pos >= halflen) pos = pos - halflen;
+    rows_lo[count] = src.ptr<float>(pos);
+    rows_hi[count] = src.ptr<float>(pos + halflen);
+    taps[count] = j;
+    count++;
+  }
+
+  int x = 0;
+
+#if CV_SIMD
+  const int N = wavelet_vlanes();
+  if (width >= N)
+  {
+    WaveletVectorTaps lo(c_lopass);
+    WaveletVectorTaps hi(c_hipass);
+
+    for (; x <= width - N; x += N)
+    {
+      cv::v_float32 re = cv::vx_setzero_f32(), im = cv::vx_setzero_f32();
+      for (int i = 0; i < count; i++)
       {
-        dest.at<cv::Vec2f>(cv::Point(y, x)) = cv::Vec2f(re, im);
+        int j = taps[i];
+        cv::v_float32 lo_re, lo_im, hi_re, hi_im;
+        cv::v_load_deinterleave(rows_lo[i] + 2 * x, lo_re, lo_im);
+        cv::v_load_deinterleave(rows_hi[i] + 2 * x, hi_re, hi_im);
+        re = cv::v_fma(lo_re, lo.re[j], re);
+        re = cv::v_fma(hi_re, hi.re[j], re);
+        re = cv::v_fma(lo_im, lo.im[j], re);
+        re = cv::v_fma(hi_im, hi.im[j], re);
+        im = cv::v_fma(lo_im, lo.re[j], im);
+        im = cv::v_fma(hi_im, hi.re[j], im);
+        im = cv::v_fma(lo_re, lo.neg_im[j], im);
+        im = cv::v_fma(hi_re, hi.neg_im[j], im);
       }
+
+      cv::v_store_interleave(out + 2 * x, re, im);
+    }
+  }
+#endif
+
+  for (; x < width; x++)
+  {
+    float re = 0.0f;
+    float im = 0.0f;
+
+    for (int i = 0; i < count; i++)
+    {
+      int j = taps[i];
+      const float *val_lo = rows_lo[i] + 2 * x;
+      const float *val_hi = rows_hi[i] + 2 * x;
+      re += val_lo[0] * lopass[j][0] + val_hi[0] * hipass[j][0];
+      re += val_lo[1] * lopass[j][1] + val_hi[1] * hipass[j][1];
+      im += val_lo[1] * lopass[j][0] + val_hi[1] * hipass[j][0];
+      im -= val_lo[0] * lopass[j][1] + val_hi[0] * hipass[j][1];
     }
+
+    out[2 * x] = re;
+    out[2 * x + 1] = im;
   }
 }
 
+// Vectorized 1-dimensional decomposition, gives the same results as
+// decompose_1d_scalar() up to floating point rounding.
+// For the vertical pass, src can also be a CV_8U real-valued image.
+template <>
+inline void Wavelet<cv::Mat>::decompose_1d(const cv::Mat &src, cv::Mat &dest, bool vertical)
+{
+  if (vertical)
+  {
+    int halflen = src.rows / 2;
+    bool real = (src.type() == CV_8U);
+    for (int y = 0; y < src.rows; y += 2)
+    {
+      float *lo = dest.ptr<float>(y / 2);
+      float *hi = dest.ptr<float>(y / 2 + halflen);
+
+      if (real)
+        decompose_rows_real(src, y, lo, hi);
+      else
+        decompose_rows(src, y, lo, hi);
+    }
+  }
+  else
+  {
+    if (src.type() != CV_32FC2)
+    {
+      throw std::logic_error("Horizontal wavelet decomposition requires CV_32FC2 input");
+    }
+
+    for (int x = 0; x < src.rows; x++)
+    {
+      decompose_row(src.ptr<float>(x), dest.ptr<float>(x), src.cols);
+    }
+  }
+
+#if CV_SIMD
+  cv::vx_cleanup();
+#endif
+}
+
+// Opposite of decompose_1d.
+template <>
+inline void Wavelet<cv::Mat>::compose_1d(const cv::Mat& src, cv::Mat& dest, bool vertical)
+{
+  if (vertical)
+  {
+    for (int y = 0; y < src.rows; y++)
+    {
+      compose_rows(src, y, dest.ptr<float>(y));
+    }
+  }
+  else
+  {
+    for (int x = 0; x < src.rows; x++)
+    {
+      compose_row(src.ptr<float>(x), dest.ptr<float>(x), src.cols);
+    }
+  }
+
+#if CV_SIMD
+  cv::vx_cleanup();
+#endif
+}
+
+// One level of decomposition, where each pair of rows from the vertical
+// pass is immediately transformed horizontally. Gives the same result as
+// decompose(), but input must not alias output.
+template <>
+inline void Wavelet<cv::Mat>::decompose_fused(const cv::Mat &input, cv::Mat &output)
+{
+  cv::Mat rows(2, input.cols, CV_32FC2);
+  float *lo = rows.ptr<float>(0);
+  float *hi = rows.ptr<float>(1);
+  int halflen = input.rows / 2;
+  bool real = (input.type() == CV_8U);
+
+  for (int y = 0; y < input.rows; y += 2)
+  {
+    if (real)
+      decompose_rows_real(input, y, lo, hi);
+    else
+      decompose_rows(input, y, lo, hi);
+
+    decompose_row(lo, output.ptr<float>(y / 2), input.cols);
+    decompose_row(hi, output.ptr<float>(y / 2 + halflen), input.cols);
+  }
+
+#if CV_SIMD
+  cv::vx_cleanup();
+#endif
+}
+
+// Opposite of decompose_fused.
+template <>
+inline void Wavelet<cv::Mat>::compose_fused(const cv::Mat &input, cv::Mat &output)
+{
+  cv::Mat row(1, input.cols, CV_32FC2);
+  float *tmp = row.ptr<float>(0);
+
+  for (int y = 0; y < input.rows; y++)
+  {
+    compose_rows(input, y, tmp);
+    compose_row(tmp, output.ptr<float>(y), input.cols);
+  }
+
+#if CV_SIMD
+  cv::vx_cleanup();
+#endif
+}
 
 template<typename M>
 cv::ocl::Program &Wavelet<M>::opencl_load_kernel()
@@ -251,12 +903,17 @@ inline void Wavelet<cv::UMat>::decompose_1d(const cv::UMat &src, cv::UMat &dest,
 
   if (vertical)
   {
-    kernel.create("decompose_vertical", prog);
+    kernel.create((src.type() == CV_8U) ? "decompose_vertical_real" : "decompose_vertical", prog);
     globalThreads[0] = dest.cols;
     globalThreads[1] = dest.rows / 2;
   }
   else
   {
+    if (src.type() != CV_32FC2)
+    {
+      throw std::logic_error("Horizontal wavelet decomposition requires CV_32FC2 input");
+    }
+
     kernel.create("decompose_horizontal", prog);
     globalThreads[0] = dest.cols / 2;
     globalThreads[1] = dest.rows;
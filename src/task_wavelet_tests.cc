@@ -1,4 +1,6 @@
 #include <gtest/gtest.h>
+#include <chrono>
+#include <random>
 #include "task_wavelet_templates.hh"
 
 namespace focusstack {
@@ -144,4 +146,307 @@ TEST(Task_Wavelet, Multilevel) {
   }
 }
 
+static void fill_random(cv::Mat &mat, int seed)
+{
+  std::mt19937 rng(seed);
+  std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+
+  for (int y = 0; y < mat.rows; y++)
+  {
+    for (int x = 0; x < mat.cols; x++)
+    {
+      mat.at<cv::Vec2f>(y, x) = cv::Vec2f(dist(rng), dist(rng));
+    }
+  }
+}
+
+static float max_difference(const cv::Mat &a, const cv::Mat &b)
+{
+  float result = 0.0f;
+  for (int y = 0; y < a.rows; y++)
+  {
+    for (int x = 0; x < a.cols; x++)
+    {
+      result = std::max(result, std::abs(a.at<cv::Vec2f>(y, x)[0] - b.at<cv::Vec2f>(y, x)[0]));
+      result = std::max(result, std::abs(a.at<cv::Vec2f>(y, x)[1] - b.at<cv::Vec2f>(y, x)[1]));
+    }
+  }
+  return result;
+}
+
+// Vectorized decompose_1d() and compose_1d() should match the scalar
+// reference implementation, including border handling and odd sizes.
+TEST(Task_Wavelet, MatchesScalar) {
+  const cv::Size sizes[] = {
+    cv::Size(2, 2), cv::Size(6, 4), cv::Size(8, 8), cv::Size(13, 7),
+    cv::Size(16, 16), cv::Size(37, 21), cv::Size(64, 10), cv::Size(101, 67)
+  };
+
+  for (cv::Size size: sizes)
+  {
+    for (int vertical = 0; vertical < 2; vertical++)
+    {
+      // Use a ROI of a larger image to verify that row step is respected
+      cv::Mat parent(size.height + 2, size.width + 3, CV_32FC2);
+      fill_random(parent, size.width * 100 + size.height);
+      cv::Mat input = parent(cv::Rect(1, 1, size.width, size.height));
+
+      cv::Mat expected(size, CV_32FC2, cv::Scalar(0, 0));
+      cv::Mat result(size, CV_32FC2, cv::Scalar(0, 0));
+      Wavelet<cv::Mat>::decompose_1d_scalar(input, expected, vertical);
+      Wavelet<cv::Mat>::decompose_1d(input, result, vertical);
+      ASSERT_LE(max_difference(expected, result), 1e-5f) << size << " vertical " << vertical;
+
+      expected = cv::Scalar(0, 0);
+      result = cv::Scalar(0, 0);
+      Wavelet<cv::Mat>::compose_1d_scalar(input, expected, vertical);
+      Wavelet<cv::Mat>::compose_1d(input, result, vertical);
+      ASSERT_LE(max_difference(expected, result), 1e-5f) << size << " vertical " << vertical;
+    }
+  }
+}
+
+TEST(Task_Wavelet, RoundtripLarge) {
+  cv::Mat input(96, 160, CV_32FC2);
+  cv::Mat wavelet(96, 160, CV_32FC2);
+  cv::Mat output(96, 160, CV_32FC2);
+  fill_random(input, 1);
+
+  Wavelet<cv::Mat>::decompose_multilevel(input, wavelet, 4);
+  Wavelet<cv::Mat>::compose_multilevel(wavelet, output, 4);
+
+  ASSERT_LE(max_difference(input, output), 0.002f);
+}
+
+TEST(Task_Wavelet, DISABLED_Benchmark1D) {
+  const int width = 2048;
+  const int height = 1024;
+  const int rounds = 4;
+  cv::Mat input(height, width, CV_32FC2);
+  cv::Mat output(height, width, CV_32FC2);
+  fill_random(input, 2);
+
+  typedef void (*func_t)(const cv::Mat&, cv::Mat&, bool);
+  const struct { const char *name; func_t func; } funcs[] = {
+    {"decompose_1d_scalar", &Wavelet<cv::Mat>::decompose_1d_scalar},
+    {"decompose_1d",        &Wavelet<cv::Mat>::decompose_1d},
+    {"compose_1d_scalar",   &Wavelet<cv::Mat>::compose_1d_scalar},
+    {"compose_1d",          &Wavelet<cv::Mat>::compose_1d},
+  };
+
+  for (auto f: funcs)
+  {
+    for (int vertical = 0; vertical < 2; vertical++)
+    {
+      auto start = std::chrono::steady_clock::now();
+      for (int i = 0; i < rounds; i++)
+      {
+        f.func(input, output, vertical);
+      }
+      double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+      std::printf("%-20s %-10s %0.1f MP/s\n", f.name, vertical ? "vertical" : "horizontal",
+                  rounds * (double)width * height / seconds / 1e6);
+    }
+  }
+}
+
+static void fill_random_u8(cv::Mat &mat, int seed)
+{
+  std::mt19937 rng(seed);
+  std::uniform_int_distribution<int> dist(0, 255);
+
+  for (int y = 0; y < mat.rows; y++)
+  {
+    for (int x = 0; x < mat.cols; x++)
+    {
+      mat.at<uint8_t>(y, x) = dist(rng);
+    }
+  }
+}
+
+// Convert CV_8U image to complex values with zero imaginary part
+static cv::Mat to_complex(const cv::Mat &img)
+{
+  cv::Mat result(img.rows, img.cols, CV_32FC2);
+  for (int y = 0; y < img.rows; y++)
+  {
+    for (int x = 0; x < img.cols; x++)
+    {
+      result.at<cv::Vec2f>(y, x) = cv::Vec2f(img.at<uint8_t>(y, x), 0.0f);
+    }
+  }
+  return result;
+}
+
+// Decomposing CV_8U image directly should give exactly the same result
+// as converting it to complex values first.
+TEST(Task_Wavelet, RealInputMatches) {
+  const cv::Size sizes[] = {
+    cv::Size(32, 32), cv::Size(96, 64), cv::Size(37, 22), cv::Size(5, 6)
+  };
+
+  for (cv::Size size: sizes)
+  {
+    cv::Mat parent(size.height + 2, size.width + 3, CV_8U);
+    fill_random_u8(parent, size.width + size.height);
+    cv::Mat img = parent(cv::Rect(2, 1, size.width, size.height));
+    cv::Mat complex = to_complex(img);
+
+    cv::Mat expected(size, CV_32FC2, cv::Scalar(0, 0));
+    cv::Mat result(size, CV_32FC2, cv::Scalar(0, 0));
+    Wavelet<cv::Mat>::decompose_1d(complex, expected, true);
+    Wavelet<cv::Mat>::decompose_1d(img, result, true);
+    ASSERT_EQ(max_difference(expected, result), 0.0f) << size;
+
+    Wavelet<cv::Mat>::decompose(complex, expected);
+    Wavelet<cv::Mat>::decompose_fused(img, result);
+    ASSERT_EQ(max_difference(expected, result), 0.0f) << size;
+  }
+
+  cv::Mat img(128, 96, CV_8U);
+  fill_random_u8(img, 6);
+  cv::Mat expected(128, 96, CV_32FC2);
+  cv::Mat result(128, 96, CV_32FC2);
+  Wavelet<cv::Mat>::decompose_multilevel(to_complex(img), expected, 5);
+
+  for (int fused = 0; fused < 2; fused++)
+  {
+    WaveletEngine<cv::Mat> engine(fused);
+    engine.decompose_multilevel(img, result, 5);
+    ASSERT_EQ(max_difference(expected, result), 0.0f) << "fused " << fused;
+  }
+}
+
+// Multilevel decomposition done level by level with copies, the way
+// it was done before WaveletEngine.
+static void decompose_levels(const cv::Mat &input, cv::Mat &output, int levelcount)
+{
+  cv::Mat tmp(input.rows, input.cols, CV_32FC2);
+  for (int i = 0; i < levelcount; i++)
+  {
+    cv::Rect area(0, 0, input.cols >> i, input.rows >> i);
+    if (i == 0)
+    {
+      input.copyTo(tmp);
+    }
+    else
+    {
+      output(area).copyTo(tmp(area));
+    }
+
+    cv::Mat dstarea = output(area);
+    Wavelet<cv::Mat>::decompose(tmp(area), dstarea);
+  }
+}
+
+static void compose_levels(const cv::Mat &input, cv::Mat &output, int levelcount)
+{
+  cv::Mat tmp = input.clone();
+  for (int i = levelcount - 1; i >= 0; i--)
+  {
+    cv::Rect area(0, 0, input.cols >> i, input.rows >> i);
+    cv::Mat dstarea = output(area);
+    Wavelet<cv::Mat>::compose(tmp(area), dstarea);
+    dstarea.copyTo(tmp(area));
+  }
+}
+
+TEST(Task_Wavelet, EngineMatchesLevels) {
+  cv::Mat input(64, 96, CV_32FC2);
+  cv::Mat expected(64, 96, CV_32FC2);
+  fill_random(input, 3);
+  decompose_levels(input, expected, 4);
+
+  cv::Mat expected_inv(64, 96, CV_32FC2);
+  compose_levels(input, expected_inv, 4);
+
+  for (int fused = 0; fused < 2; fused++)
+  {
+    WaveletEngine<cv::Mat> engine(fused);
+    cv::Mat result(64, 96, CV_32FC2);
+    engine.decompose_multilevel(input, result, 4);
+    ASSERT_LE(max_difference(expected, result), 1e-6f) << "fused " << fused;
+
+    engine.compose_multilevel(input, result, 4);
+    ASSERT_LE(max_difference(expected_inv, result), 1e-6f) << "fused " << fused;
+  }
+}
+
+TEST(Task_Wavelet, EngineReusesBuffers) {
+  cv::Mat input(64, 96, CV_32FC2);
+  cv::Mat wavelet(64, 96, CV_32FC2);
+  cv::Mat output(64, 96, CV_32FC2);
+  fill_random(input, 4);
+
+  WaveletEngine<cv::Mat> engine;
+  engine.decompose_multilevel(input, wavelet, 4);
+  engine.compose_multilevel(wavelet, output, 4);
+  int allocations = engine.allocations();
+
+  engine.decompose_multilevel(input, wavelet, 4);
+  engine.compose_multilevel(wavelet, output, 4);
+  ASSERT_EQ(allocations, engine.allocations());
+  ASSERT_LE(max_difference(input, output), 0.002f);
+}
+
+TEST(Task_Wavelet, DISABLED_BenchmarkLevels) {
+  const int width = 2048;
+  const int height = 1536;
+  const int levels = 5;
+  const int rounds = 2;
+  cv::Mat input(height, width, CV_32FC2);
+  cv::Mat output(height, width, CV_32FC2);
+  cv::Mat tmp(height, width, CV_32FC2);
+  fill_random(input, 5);
+
+  // Allocations for complete forward and inverse transform
+  for (int fused = 0; fused < 2; fused++)
+  {
+    WaveletEngine<cv::Mat> engine(fused);
+    engine.decompose_multilevel(input, output, levels);
+    engine.compose_multilevel(input, output, levels);
+    int first = engine.allocations();
+    size_t bytes = engine.allocated_bytes();
+    engine.decompose_multilevel(input, output, levels);
+    engine.compose_multilevel(input, output, levels);
+
+    std::printf("%-10s first call %d allocations (%0.1f MB), second call %d allocations\n",
+                fused ? "fused" : "two-pass", first, bytes / 1e6, engine.allocations() - first);
+  }
+
+  // Throughput of each level, counting one read of input and one write of
+  // output as the useful memory traffic.
+  for (int i = 0; i < levels; i++)
+  {
+    cv::Rect area(0, 0, width >> i, height >> i);
+    cv::Mat src = input(area);
+    cv::Mat dst = output(area);
+    cv::Mat tmparea = tmp(area);
+    double bytes = 2.0 * area.area() * sizeof(cv::Vec2f);
+
+    for (int fused = 0; fused < 2; fused++)
+    {
+      double seconds[2];
+      for (int inverse = 0; inverse < 2; inverse++)
+      {
+        auto start = std::chrono::steady_clock::now();
+        for (int r = 0; r < rounds << (2 * i); r++)
+        {
+          if (fused && !inverse) Wavelet<cv::Mat>::decompose_fused(src, dst);
+          if (fused && inverse)  Wavelet<cv::Mat>::compose_fused(src, dst);
+          if (!fused && !inverse) Wavelet<cv::Mat>::decompose(src, dst, tmparea);
+          if (!fused && inverse)  Wavelet<cv::Mat>::compose(src, dst, tmparea);
+        }
+        seconds[inverse] = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+      }
+
+      double n = rounds << (2 * i);
+      std::printf("Level %d %4dx%-4d %-10s decompose %5.2f GB/s, compose %5.2f GB/s\n",
+                  i, area.width, area.height, fused ? "fused" : "two-pass",
+                  n * bytes / seconds[0] / 1e9, n * bytes / seconds[1] / 1e9);
+    }
+  }
+}
+
 }
@@ -1,19 +1,35 @@
 #include "worker.hh"
 #include <cstdio>
+#include <algorithm>
+#include <opencv2/imgproc.hpp>
 
-#ifdef USE_MALLINFO
-#include <malloc.h>
+#include <ctime>
+#include <cstdlib>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#endif
+
+#ifdef __GNUG__
+#include <cxxabi.h>
 #endif
 
 using namespace focusstack;
 
-Task::Task(): m_filename("unknown"), m_index(0), m_name("Base task"), m_running(false), m_done(false)
+Task::Task(): m_filename("unknown"), m_index(0), m_name("Base task"), m_running(false), m_done(false),
+  m_unfinished_deps(0), m_prepended(false), m_priority(0), m_queued(false), m_queue_seq(0),
+  m_record(nullptr), m_released(false), m_memory_charged(0)
 {
 
 }
 
 Task::~Task()
 {
+  if (m_memory)
+  {
+    m_memory->add(-m_memory_charged);
+  }
 }
 
 // Check whether all dependencies of this task have been completed
@@ -35,7 +51,32 @@ bool Task::ready_to_run()
   return true;
 }
 
-void Task::run(std::shared_ptr<Logger> logger)
+// CPU time used by the current thread, in seconds
+static double thread_cpu_time()
+{
+#ifdef _WIN32
+  FILETIME creation, exit, kernel, user;
+  if (!GetThreadTimes(GetCurrentThread(), &creation, &exit, &kernel, &user))
+  {
+    return 0;
+  }
+
+  // Times are in units of 100 ns
+  uint64_t k = ((uint64_t)kernel.dwHighDateTime << 32) | kernel.dwLowDateTime;
+  uint64_t u = ((uint64_t)user.dwHighDateTime << 32) | user.dwLowDateTime;
+  return (k + u) * 1e-7;
+#else
+  struct timespec ts;
+  if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0)
+  {
+    return 0;
+  }
+
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+#endif
+}
+
+void Task::run(std::shared_ptr<Logger> logger, std::shared_ptr<TaskStatistics> statistics)
 {
   std::unique_lock<std::mutex> lock(m_mutex);
 
@@ -57,8 +98,16 @@ void Task::run(std::shared_ptr<Logger> logger)
 
   try {
     // Run the subclass implementation
+    auto wall_start = std::chrono::steady_clock::now();
+    double cpu_start = thread_cpu_time();
     this->task();
 
+    if (statistics)
+    {
+      double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - wall_start).count();
+      statistics->add(*this, wall, thread_cpu_time() - cpu_start);
+    }
+
     // Release memory we no longer need
     m_depends_on.clear();
 
@@ -90,274 +139,1106 @@ std::string Task::basename() const
   return basename;
 }
 
-void Task::wait()
+bool Task::wait(int timeout_ms)
 {
   std::unique_lock<std::mutex> lock(m_mutex);
+  auto timeout = std::chrono::system_clock::now() + std::chrono::milliseconds(timeout_ms);
 
   while (!m_done)
   {
-    m_wakeup.wait(lock);
+    if (timeout_ms < 0)
+    {
+      m_wakeup.wait(lock);
+    }
+    else if (m_wakeup.wait_until(lock, timeout) == std::cv_status::timeout)
+    {
+      return m_done;
+    }
   }
+
+  return true;
 }
 
-Worker::Worker(int max_threads, std::shared_ptr<Logger> logger):
-  m_logger(logger), m_closed(false), m_tasks_started(0), m_total_tasks(0),
-  m_completed_tasks(0), m_opencl_users(0), m_failed(false)
+cv::Mat ImgTask::img_downscaled(int max_resolution, float *scale_ratio) const
 {
-  m_start_time = std::chrono::steady_clock::now();
-  m_wait_count = 0;
+  const cv::Mat &full = img();
+  int resolution = std::max(full.cols, full.rows);
 
-  for (int i = 0; i < max_threads; i++)
+  if (resolution <= max_resolution)
   {
-    m_threads.emplace_back([this, i](){ this->worker(i); });
+    if (scale_ratio) *scale_ratio = 1.0f;
+    return full;
+  }
+
+  float ratio = max_resolution / (float)resolution;
+  if (scale_ratio) *scale_ratio = ratio;
+
+  // Holding the lock while resizing avoids computing the same scale twice
+  // when several tasks need it at the same time.
+  std::unique_lock<std::mutex> lock(m_downscaled_mutex);
+  cv::Mat &result = m_downscaled[max_resolution];
+  if (result.empty())
+  {
+    cv::resize(full, result, cv::Size(), ratio, ratio, cv::INTER_AREA);
   }
+
+  return result;
 }
 
-Worker::~Worker()
+// Readable class name of the task, without namespace
+static std::string task_type_name(const Task &task)
 {
+  std::string name = typeid(task).name();
+
+#ifdef __GNUG__
+  int status = 0;
+  char *demangled = abi::__cxa_demangle(name.c_str(), nullptr, nullptr, &status);
+  if (status == 0 && demangled)
   {
-    std::unique_lock<std::mutex> lock(m_mutex);
-    m_tasks.clear();
-    m_closed = true;
+    name = demangled;
   }
+  free(demangled);
+#endif
 
-  m_wakeup.notify_all();
-
-  for (std::thread &thread: m_threads)
+  size_t pos = name.rfind("::");
+  if (pos != std::string::npos)
   {
-    thread.join();
+    name = name.substr(pos + 2);
   }
+
+  return name;
 }
 
-void Worker::add(std::shared_ptr<Task> task)
+void TaskStatistics::add(const Task &task, double wall, double cpu)
 {
+  std::type_index type(typeid(task));
+  cv::Size size = task.result_size();
+  int64_t bytes = task.result_bytes();
+
   std::unique_lock<std::mutex> lock(m_mutex);
-  assert(task);
-  m_tasks.emplace_back(task);
-  m_total_tasks++;
-  m_wakeup.notify_all();
+  auto iter = m_stages.find(type);
+  if (iter == m_stages.end())
+  {
+    FocusStack::stage_statistics_t stage{task_type_name(task), 0, 0, 0, 0, 0, 0};
+    iter = m_stages.emplace(type, stage).first;
+  }
+
+  FocusStack::stage_statistics_t &stage = iter->second;
+  stage.count++;
+  stage.wall_total += wall;
+  stage.wall_max = std::max(stage.wall_max, wall);
+  stage.cpu_total += cpu;
+  stage.result_bytes += bytes;
+  stage.megapixels += size.area() / 1e6;
 }
 
-void Worker::prepend(std::shared_ptr<Task> task)
+std::vector<FocusStack::stage_statistics_t> TaskStatistics::get() const
 {
-  std::unique_lock<std::mutex> lock(m_mutex);
-  m_tasks.emplace_front(task);
-  m_total_tasks++;
-  m_wakeup.notify_all();
+  std::vector<FocusStack::stage_statistics_t> result;
+
+  {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    for (const auto &item: m_stages)
+    {
+      result.push_back(item.second);
+    }
+  }
+
+  std::stable_sort(result.begin(), result.end(),
+    [](const FocusStack::stage_statistics_t &a, const FocusStack::stage_statistics_t &b) {
+      return a.wall_total > b.wall_total;
+    });
+
+  return result;
 }
 
-bool Worker::wait_all(int timeout_ms)
+void MemoryTracker::add(int64_t bytes)
+{
+  int64_t used = (m_used += bytes);
+  int64_t peak = m_peak;
+  while (used > peak && !m_peak.compare_exchange_weak(peak, used));
+}
+
+int64_t MemoryTracker::estimate(const Task &task)
+{
+  int64_t estimate = task.estimate_result_bytes();
+
+  if (estimate == 0)
+  {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    auto iter = m_sizes.find(std::type_index(typeid(task)));
+    if (iter != m_sizes.end())
+    {
+      estimate = iter->second;
+    }
+  }
+
+  return estimate;
+}
+
+void MemoryTracker::learn(const Task &task, int64_t bytes)
 {
   std::unique_lock<std::mutex> lock(m_mutex);
+  int64_t &size = m_sizes[std::type_index(typeid(task))];
+  size = std::max(size, bytes);
+}
 
-  auto timeout = std::chrono::system_clock::now();
+// Returns true if this entry should run after the other one
+bool ReadyQueue::entry_t::operator<(const entry_t &other) const
+{
+  if (prepended != other.prepended)
+  {
+    return !prepended;
+  }
 
-  if (timeout_ms >= 0)
+  if (priority != other.priority)
   {
-   timeout += std::chrono::milliseconds(timeout_ms);
+    return priority < other.priority;
   }
-  else
+
+  // Prepended tasks are run newest first, others oldest first
+  return prepended ? (seq < other.seq) : (seq > other.seq);
+}
+
+void ReadyQueue::push(const std::shared_ptr<Task> &task)
+{
+  assert(!task->m_queued);
+  task->m_queued = true;
+  task->m_queue_seq = m_seq++;
+  m_count++;
+  update(task);
+}
+
+// Add new entry for task with its current priority.
+// The old entry is left in the heap and skipped by pop(), until there
+// are enough of them to make it worth rebuilding the heap.
+void ReadyQueue::update(const std::shared_ptr<Task> &task)
+{
+  m_heap.push_back(entry_t{task->m_prepended, task->m_priority, task->m_queue_seq, task});
+  std::push_heap(m_heap.begin(), m_heap.end());
+
+  if (m_heap.size() > 64 + 2 * m_count)
   {
-    // Check for deadlocks after every 10 seconds
-    timeout += std::chrono::seconds(10);
+    m_heap.erase(std::remove_if(m_heap.begin(), m_heap.end(), [](const entry_t &e) {
+                   return !e.task->m_queued || e.seq != e.task->m_queue_seq || e.priority != e.task->m_priority;
+                 }), m_heap.end());
+    std::make_heap(m_heap.begin(), m_heap.end());
   }
+}
 
-  while ((m_tasks.size() || m_running.size()) && !m_failed)
+std::shared_ptr<Task> ReadyQueue::pop()
+{
+  while (!m_heap.empty())
   {
-    if (m_wakeup.wait_until(lock, timeout) == std::cv_status::timeout)
+    std::pop_heap(m_heap.begin(), m_heap.end());
+    entry_t entry = std::move(m_heap.back());
+    m_heap.pop_back();
+
+    if (entry.task->m_queued && entry.priority == entry.task->m_priority)
     {
-      // Check if we are waiting on an unscheduled task
-      for (std::shared_ptr<Task> task: m_tasks)
-      {
-        for (std::shared_ptr<Task> dependency: task->get_depends())
-        {
-          assert(dependency);
-          if (!dependency->is_completed() && !m_running.count(dependency))
-          {
-            if (std::find(m_tasks.begin(), m_tasks.end(), dependency) == m_tasks.end())
-            {
-              m_logger->error("Task %s is waiting on unscheduled task %s\n",
-                              task->name().c_str(), dependency->name().c_str());
-            }
-          }
-        }
-      }
+      entry.task->m_queued = false;
+      m_count--;
 
-      if (timeout_ms >= 0)
-      {
-        return false; // Return with timeout
-      }
-      else
+      if (m_count == 0)
       {
-        timeout = std::chrono::system_clock::now() + std::chrono::seconds(10);
+        m_heap.clear(); // Drop any outdated entries
       }
+
+      return entry.task;
     }
   }
 
-  return true; // Everything completed
+  return nullptr;
 }
 
-void Worker::get_status(int &total_tasks, int &completed_tasks, std::string &running_task_name)
+Worker::Worker(int max_threads, std::shared_ptr<Logger> logger, scheduler_t scheduler):
+  m_logger(logger), m_scheduler(scheduler), m_reported_tasks(0), m_shared_count(0), m_closed(false),
+  m_tasks_started(0), m_total_tasks(0), m_completed_tasks(0), m_pending_tasks(0),
+  m_running_tasks(0), m_sleeping_threads(0), m_held_count(0), m_opencl_users(0), m_wait_count(0),
+  m_memory(std::make_shared<MemoryTracker>()), m_max_memory(0),
+  m_statistics(std::make_shared<TaskStatistics>()), m_trace(false), m_failed(false)
 {
-  std::unique_lock<std::mutex> lock(m_mutex);
-  total_tasks = m_total_tasks;
-  completed_tasks = m_completed_tasks;
+  m_start_time = std::chrono::steady_clock::now();
+  m_deferred_time = m_start_time;
 
-  if (m_running.size())
+  for (int i = 0; i < max_threads; i++)
   {
-    running_task_name = (*m_running.begin())->name();
+    m_thread_states.emplace_back(new thread_state_t());
   }
-  else
+
+  for (int i = 0; i < max_threads; i++)
   {
-    running_task_name = "";
+    m_threads.emplace_back([this, i](){ this->worker(i); });
   }
 }
 
-float Worker::seconds_passed() const
+Worker::~Worker()
 {
-  std::chrono::time_point<std::chrono::steady_clock> now = std::chrono::steady_clock::now();
-  auto delta = now - m_start_time;
-  return std::chrono::duration_cast<std::chrono::milliseconds>(delta).count() / 1000.0f;
+  {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_closed = true;
+  }
+
+  m_wakeup.notify_all();
+
+  for (std::thread &thread: m_threads)
+  {
+    thread.join();
+  }
+
+  // Drop the self-references of tasks left in the work-stealing deques
+  for (std::unique_ptr<thread_state_t> &state: m_thread_states)
+  {
+    while (Task *task = state->deque.pop())
+    {
+      task->m_self.reset();
+    }
+  }
+
+  // Unfinished tasks reference their dependents, which in turn reference
+  // the tasks through m_depends_on. Break the cycles so that memory is freed.
+  for (const std::weak_ptr<Task> &ref: m_tasks)
+  {
+    std::shared_ptr<Task> task = ref.lock();
+    if (task)
+    {
+      std::unique_lock<std::mutex> lock(task->m_dependents_mutex);
+      task->m_dependents.clear();
+    }
+  }
 }
 
-// This is the worker thread; it is run in multiple copies in separate threads.
-// Each thread will take the first runnable task from the queue and execute it.
-void Worker::worker(int thread_idx)
+void Worker::add(std::shared_ptr<Task> task)
 {
-  while (!m_closed)
+  enqueue(task, false);
+}
+
+void Worker::prepend(std::shared_ptr<Task> task)
+{
+  enqueue(task, true);
+}
+
+// Register the task with its uncompleted dependencies, or put it directly
+// to the ready queue if there are none.
+void Worker::enqueue(std::shared_ptr<Task> task, bool prepend)
+{
+  assert(task);
+  task->m_prepended = prepend;
+
+  // Hold one extra count while registering, so that the task cannot become
+  // ready before all the dependencies have been processed.
+  task->m_unfinished_deps = 1;
+  const TaskRecord *gating = nullptr;
+
+  for (const std::shared_ptr<Task> &dependency: task->get_depends())
   {
-    std::shared_ptr<Task> task = nullptr;
+    if (!dependency)
+    {
+      throw std::logic_error("Task " + task->name() + " depends on nullptr");
+    }
 
+    std::unique_lock<std::mutex> lock(dependency->m_dependents_mutex);
+    if (!dependency->m_released && !dependency->is_completed())
     {
-      std::unique_lock<std::mutex> lock(m_mutex);
+      dependency->m_dependents.push_back(task);
+      task->m_unfinished_deps++;
+    }
+    else if (dependency->m_record && (!gating || dependency->m_record->finished > gating->finished))
+    {
+      gating = dependency->m_record;
+    }
+  }
 
-      // Search for next runnable task
-      for (int i = 0; i < m_tasks.size(); i++)
-      {
-        if (m_opencl_users > 0 && m_tasks.at(i)->uses_opencl())
-        {
-          continue;
-        }
 
-        if (m_tasks.at(i)->ready_to_run())
-        {
-          task = m_tasks.at(i);
-          m_tasks.erase(m_tasks.begin() + i);
-          m_running.insert(task);
-          m_wait_count = 0;
-          break;
-        }
-      }
+  m_total_tasks++;
+  m_pending_tasks++;
 
-      if (task && task->uses_opencl())
-        m_opencl_users++;
-    }
+  {
+    std::unique_lock<std::mutex> lock(m_mutex);
 
-    if (task)
+    if (m_tasks.size() > 1024 + 2 * (size_t)m_pending_tasks)
     {
-      float start = seconds_passed();
-      int taskidx = 0;
+      // Forget about tasks that have already finished
+      m_tasks.erase(std::remove_if(m_tasks.begin(), m_tasks.end(),
+                      [](const std::weak_ptr<Task> &t) { return t.expired() || t.lock()->m_released; }),
+                    m_tasks.end());
+    }
+
+    m_tasks.emplace_back(task);
+    task->m_sched_depends.assign(task->get_depends().begin(), task->get_depends().end());
+
+    m_records.emplace_back();
+    TaskRecord &record = m_records.back();
+    record.name = task->name();
+    record.priority = task->m_priority;
+    record.thread = -1;
+    record.queued = seconds_passed();
+    record.ready = record.started = record.finished = -1;
+    record.gating = gating;
+    record.id = m_records.size() - 1;
+    record.opencl = false;
+    task->m_record = &record;
+
+    raise_priorities(task);
+  }
+
+  if (--task->m_unfinished_deps == 0)
+  {
+    make_ready(task, -1);
+  }
+}
+
+// Raise the priority of the dependencies of a new task, so that each task has
+// higher priority than any task depending on it. The propagation is limited to
+// a fixed depth, which keeps adding tasks cheap when there are long chains of
+// pending tasks. Priorities beyond the limit would not change the order anyway.
+void Worker::raise_priorities(const std::shared_ptr<Task> &task)
+{
+  const int max_depth = 16;
+  std::vector<std::pair<Task*, int> > stack;
+  stack.emplace_back(task.get(), 0);
+
+  while (!stack.empty())
+  {
+    Task *t = stack.back().first;
+    int depth = stack.back().second;
+    stack.pop_back();
 
+    for (const std::weak_ptr<Task> &ref: t->m_sched_depends)
+    {
+      std::shared_ptr<Task> dependency = ref.lock();
+      if (dependency && !dependency->m_released && dependency->m_priority <= t->m_priority)
       {
-        std::unique_lock<std::mutex> lock(m_mutex);
-        taskidx = ++m_tasks_started;
+        dependency->m_priority = t->m_priority + 1;
+        if (dependency->m_record) dependency->m_record->priority = dependency->m_priority;
 
-        if (m_logger->get_level() <= Logger::LOG_VERBOSE)
+        if (dependency->m_queued)
         {
-          m_logger->verbose("%6.3f [%3d/%3d] T%d Starting task: %s\n",
-                      seconds_passed(), m_tasks_started, m_total_tasks, thread_idx, task->name().c_str());
+          (dependency->uses_opencl() ? m_ready_opencl : m_ready).update(dependency);
         }
-        else
+
+        if (depth + 1 < max_depth)
         {
-          m_logger->progress("[%3d/%3d] %-40.40s\r", m_tasks_started, m_total_tasks, task->name().c_str());
+          stack.emplace_back(dependency.get(), depth + 1);
         }
       }
+    }
+  }
+}
 
-      try
-      {
-        task->run(m_logger);
-      }
-      catch (std::exception &e)
-      {
-        m_error = "Task " + task->name() + " on thread " + std::to_string(thread_idx)
-                  + " failed with exception:\n" + e.what();
-        m_logger->error("\n\n%s\n", m_error.c_str());
-        m_failed = true;
-        m_wakeup.notify_all();
-        return;
-      }
+// Add task to the shared ready queue. Requires m_mutex.
+void Worker::push_shared(const std::shared_ptr<Task> &task)
+{
+  (task->uses_opencl() ? m_ready_opencl : m_ready).push(task);
+  m_shared_count++;
+}
 
-      if (m_logger->get_level() <= Logger::LOG_VERBOSE)
-      {
-        std::unique_lock<std::mutex> lock(m_mutex);
-        m_logger->verbose("%6.3f           T%d Finished task %d in %0.3f s.\n",
-                          seconds_passed(), thread_idx, taskidx, seconds_passed() - start);
+void Worker::poll_deferred()
+{
+  std::unique_lock<std::mutex> lock(m_mutex);
+  for (const std::shared_ptr<Task> &task: m_deferred)
+  {
+    push_shared(task);
+  }
+  m_deferred.clear();
+  m_wakeup.notify_all();
+}
 
-#ifdef USE_MALLINFO
-        struct mallinfo mem = mallinfo();
-        m_logger->verbose("%6.3f           Memory use: %0.3f MB.\n", seconds_passed(), mem.uordblks / 1e6);
-#endif
-      }
+// Put task that has all its dependencies completed to a ready queue.
+// The thread_idx is the worker thread that completed the last dependency, or -1.
+void Worker::make_ready(const std::shared_ptr<Task> &task, int thread_idx)
+{
+  task->m_record->ready = seconds_passed();
+
+  if (m_scheduler == FocusStack::SCHEDULER_STEALING && thread_idx >= 0 && !task->uses_opencl())
+  {
+    task->m_self = task;
+    m_thread_states.at(thread_idx)->deque.push(task.get());
+
+    // Order the push before reading the sleeper count. Pairs with the fence in
+    // wait_task(), so that either we see the sleeper or it sees our task.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (m_sleeping_threads > 0)
+    {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      m_wakeup.notify_one();
+    }
+  }
+  else
+  {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    push_shared(task);
+    m_wakeup.notify_one();
+  }
+}
+
+// Called when task has completed, moves the tasks that were waiting only
+// for it to the ready queue.
+void Worker::release_dependents(const std::shared_ptr<Task> &task, int thread_idx)
+{
+  std::vector<std::shared_ptr<Task> > dependents;
+
+  {
+    std::unique_lock<std::mutex> lock(task->m_dependents_mutex);
+    task->m_released = true;
+    dependents.swap(task->m_dependents);
+  }
 
-      if (task->uses_opencl())
+  if (m_scheduler == FocusStack::SCHEDULER_STEALING)
+  {
+    std::vector<std::shared_ptr<Task> > ready;
+    for (const std::shared_ptr<Task> &dependent: dependents)
+    {
+      if (--dependent->m_unfinished_deps == 0)
       {
-        std::unique_lock<std::mutex> lock(m_mutex);
-        m_opencl_users--;
+        dependent->m_record->gating = task->m_record;
+        ready.push_back(dependent);
       }
+    }
+
+    // Own deque is popped newest first, so push in reverse order to run
+    // prepended tasks first, then by priority and then in the order added.
+    std::stable_sort(ready.begin(), ready.end(),
+      [](const std::shared_ptr<Task> &a, const std::shared_ptr<Task> &b) {
+        if (a->m_prepended != b->m_prepended) return a->m_prepended;
+        return a->m_priority > b->m_priority;
+      });
 
+    for (auto it = ready.rbegin(); it != ready.rend(); ++it)
+    {
+      make_ready(*it, thread_idx);
+    }
+  }
+  else
+  {
+    for (const std::shared_ptr<Task> &dependent: dependents)
+    {
+      if (--dependent->m_unfinished_deps == 0)
       {
-        std::unique_lock<std::mutex> lock(m_mutex);
-        m_completed_tasks++;
-        m_running.erase(task);
+        dependent->m_record->gating = task->m_record;
+        make_ready(dependent, thread_idx);
       }
+    }
+  }
+}
+
+// Take next task from the shared queues. Requires m_mutex.
+std::shared_ptr<Task> Worker::take_shared_task()
+{
+  std::shared_ptr<Task> task;
+
+  if (m_opencl_users == 0 && !m_ready_opencl.empty())
+  {
+    // Keep the GPU busy whenever there is something for it to do
+    task = m_ready_opencl.pop();
+    m_opencl_users++;
+    m_shared_count--;
+  }
+  else
+  {
+    while (!task && !m_ready.empty())
+    {
+      task = m_ready.pop();
+      m_shared_count--;
 
-      if (m_running.size())
+      if (!reserve_memory(task, false))
       {
-        // Report one of the remaining running tasks
-        if (m_logger->get_level() > Logger::LOG_VERBOSE)
+        if (m_held.empty())
         {
-          m_logger->progress("[%3d/%3d] %-40.40s\r", m_tasks_started, m_total_tasks, (*m_running.begin())->name().c_str());
+          m_logger->verbose("%6.3f           Memory use %0.1f MB, holding back %s\n",
+                            seconds_passed(), m_memory->used() / 1e6, task->name().c_str());
         }
-      }
 
-      // Wake all threads to re-check dependencies
-      m_wakeup.notify_all();
+        m_held.push_back(task);
+        m_held_count++;
+        task = nullptr;
+      }
     }
-    else
-    {
-      std::unique_lock<std::mutex> lock(m_mutex);
 
-      if (m_closed)
+    if (!task && !m_held.empty() && m_running_tasks == 0)
+    {
+      // Nothing is running that could release memory, so let one task
+      // exceed the budget rather than stall.
+      task = m_held.front();
+      m_held.pop_front();
+      m_held_count--;
+      reserve_memory(task, true);
+    }
+  }
+
+  if (task)
+  {
+    m_running_tasks++;
+  }
+
+  return task;
+}
+
+// Check memory budget for tasks that bring new data into processing, and charge
+// the estimated result size. Returns false if task should be held back.
+bool Worker::reserve_memory(const std::shared_ptr<Task> &task, bool force)
+{
+  if (m_max_memory == 0 || task->m_memory || !task->get_depends().empty())
+  {
+    return true; // Not limited, or charged later in run_task()
+  }
+
+  int64_t estimate = m_memory->estimate(*task);
+
+  // If the size is not known, wait for the first task of the type to complete.
+  if (!force && (estimate == 0 || m_memory->used() + estimate > (int64_t)m_max_memory))
+  {
+    return false;
+  }
+
+  task->m_memory = m_memory;
+  task->m_memory_charged = estimate;
+  m_memory->add(estimate);
+  return true;
+}
+
+// Give held back tasks a new chance after memory has been released.
+void Worker::release_held()
+{
+  for (const std::shared_ptr<Task> &task: m_held)
+  {
+    m_ready.push(task);
+    m_shared_count++;
+  }
+  m_held.clear();
+
+  m_held_count = 0;
+  m_wakeup.notify_all();
+}
+
+// Take next task from own deque, the shared queues or other threads, without blocking.
+std::shared_ptr<Task> Worker::take_task(int thread_idx)
+{
+  bool stealing = (m_scheduler == FocusStack::SCHEDULER_STEALING);
+  std::shared_ptr<Task> task;
+
+  if (stealing)
+  {
+    Task *t = m_thread_states.at(thread_idx)->deque.pop();
+    if (t)
+    {
+      task = std::move(t->m_self);
+      m_running_tasks++;
+    }
+  }
+
+  if (!task && m_shared_count > 0)
+  {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    task = take_shared_task();
+  }
+
+  if (!task && stealing)
+  {
+    int count = m_thread_states.size();
+    for (int i = 1; i < count && !task; i++)
+    {
+      Task *t = m_thread_states.at((thread_idx + i) % count)->deque.steal();
+      if (t)
       {
-        break;
+        task = std::move(t->m_self);
+        m_running_tasks++;
       }
+    }
+  }
 
-      if (m_running.size() != 0 || m_tasks.size() == 0)
+  return task;
+}
+
+// Check if there is anything that a sleeping thread could take. Requires m_mutex.
+bool Worker::have_work()
+{
+  if (m_closed || !m_ready.empty() || (m_opencl_users == 0 && !m_ready_opencl.empty()))
+  {
+    return true;
+  }
+
+  if (m_scheduler == FocusStack::SCHEDULER_STEALING)
+  {
+    for (std::unique_ptr<thread_state_t> &state: m_thread_states)
+    {
+      if (!state->deque.empty())
       {
-        m_wait_count = 0;
+        return true;
       }
-      else
+    }
+  }
+
+  return false;
+}
+
+// Wait until a runnable task is available, or return nullptr if worker is closed.
+std::shared_ptr<Task> Worker::wait_task(int thread_idx)
+{
+  while (!m_closed)
+  {
+    std::shared_ptr<Task> task = take_task(thread_idx);
+
+    if (task)
+    {
+      if (task->ready_to_run())
       {
-        m_wait_count++;
+        return task;
       }
 
-      if (m_wait_count == 10)
+      // Task has additional conditions, such as waiting for the input file
+      // to appear. Those have to be polled.
+      std::unique_lock<std::mutex> lock(m_mutex);
+      if (task->uses_opencl()) m_opencl_users--;
+      m_running_tasks--;
+      m_deferred.push_back(task);
+      continue;
+    }
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_sleeping_threads++;
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    if (!have_work())
+    {
+      if (m_deferred.empty())
       {
-        if (m_logger->get_level() > Logger::LOG_VERBOSE)
+        // Nothing to do until some running task completes or new tasks are added
+        m_wait_count = 0;
+        m_wakeup.wait(lock);
+      }
+      else
+      {
+        if (m_running_tasks > 0)
         {
-          m_logger->progress("[%3d/%3d] Waiting %-30.30s\r", m_tasks_started, m_total_tasks,
-            m_tasks.at(0)->name().c_str());
+          m_wait_count = 0;
         }
-        else
+        else if (++m_wait_count == 10)
         {
-          m_logger->verbose("%6.3f [%3d/%3d] T%d Waiting for task to become runnable: %s\n",
-                      seconds_passed(), m_tasks_started, m_total_tasks, thread_idx,
-                      m_tasks.at(0)->name().c_str());
+          if (m_logger->get_level() > Logger::LOG_VERBOSE)
+          {
+            m_logger->progress("[%3d/%3d] Waiting %-30.30s\r", (int)m_tasks_started, (int)m_total_tasks,
+              m_deferred.at(0)->name().c_str());
+          }
+          else
+          {
+            m_logger->verbose("%6.3f [%3d/%3d] T%d Waiting for task to become runnable: %s\n",
+                        seconds_passed(), (int)m_tasks_started, (int)m_total_tasks, thread_idx,
+                        m_deferred.at(0)->name().c_str());
+          }
+        }
+
+        // Poll every 100 ms for new image files
+        m_wakeup.wait_for(lock, std::chrono::milliseconds(100));
+
+        auto now = std::chrono::steady_clock::now();
+        if (now - m_deferred_time >= std::chrono::milliseconds(100))
+        {
+          m_deferred_time = now;
+          for (const std::shared_ptr<Task> &t: m_deferred)
+          {
+            push_shared(t);
+          }
+          m_deferred.clear();
         }
       }
+    }
+
+    m_sleeping_threads--;
+  }
+
+  return nullptr;
+}
 
-      // Poll every 100 ms for new image files
-      m_wakeup.wait_for(lock, std::chrono::milliseconds(100));
+// Name of one of the currently running tasks, or empty string.
+std::string Worker::running_task_name()
+{
+  for (std::unique_ptr<thread_state_t> &state: m_thread_states)
+  {
+    std::unique_lock<std::mutex> lock(state->mutex);
+    if (state->running)
+    {
+      return state->running->name();
     }
   }
+
+  return "";
+}
+
+// Report tasks that wait for dependencies that have never been added.
+// Requires m_mutex.
+void Worker::check_deadlock()
+{
+  if (m_running_tasks > 0 || !m_deferred.empty())
+  {
+    return; // Still making progress
+  }
+
+  std::unordered_set<Task*> added;
+  std::vector<std::shared_ptr<Task> > waiting;
+  for (const std::weak_ptr<Task> &ref: m_tasks)
+  {
+    std::shared_ptr<Task> task = ref.lock();
+    if (task)
+    {
+      added.insert(task.get());
+      if (!task->m_released && task->m_unfinished_deps > 0)
+      {
+        waiting.push_back(task);
+      }
+    }
+  }
+
+  for (const std::shared_ptr<Task> &task: waiting)
+  {
+    for (const std::shared_ptr<Task> &dependency: task->get_depends())
+    {
+      assert(dependency);
+      if (!dependency->is_completed() && !added.count(dependency.get()))
+      {
+        m_logger->error("Task %s is waiting on unscheduled task %s\n",
+                        task->name().c_str(), dependency->name().c_str());
+      }
+    }
+  }
+}
+
+bool Worker::wait_all(int timeout_ms)
+{
+  std::unique_lock<std::mutex> lock(m_mutex);
+
+  auto timeout = std::chrono::system_clock::now();
+
+  if (timeout_ms >= 0)
+  {
+   timeout += std::chrono::milliseconds(timeout_ms);
+  }
+  else
+  {
+    // Check for deadlocks after every 10 seconds
+    timeout += std::chrono::seconds(10);
+  }
+
+  while (m_pending_tasks > 0 && !m_failed)
+  {
+    if (m_finished.wait_until(lock, timeout) == std::cv_status::timeout)
+    {
+      check_deadlock();
+
+      if (timeout_ms >= 0)
+      {
+        return false; // Return with timeout
+      }
+      else
+      {
+        timeout = std::chrono::system_clock::now() + std::chrono::seconds(10);
+      }
+    }
+  }
+
+  if (!m_failed && m_reported_tasks != m_completed_tasks &&
+      m_logger->get_level() <= Logger::LOG_VERBOSE)
+  {
+    m_reported_tasks = m_completed_tasks;
+    report_critical_path();
+  }
+
+  return true; // Everything completed
+}
+
+// Print the chain of tasks that determined the total run time. Starting from
+// the task that finished last, follow the dependency that completed last.
+void Worker::report_critical_path()
+{
+  const TaskRecord *last = nullptr;
+  for (const TaskRecord &record: m_records)
+  {
+    if (record.finished >= 0 && (!last || record.finished > last->finished))
+    {
+      last = &record;
+    }
+  }
+
+  if (!last) return;
+
+  std::vector<const TaskRecord*> path;
+  double busy = 0;
+  for (const TaskRecord *record = last; record; record = record->gating)
+  {
+    path.push_back(record);
+    busy += record->finished - record->started;
+  }
+
+  m_logger->verbose("Critical path of %d tasks, %0.3f s running and %0.3f s waiting:\n",
+                    (int)path.size(), busy, last->finished - path.back()->queued - busy);
+
+  for (auto iter = path.rbegin(); iter != path.rend(); ++iter)
+  {
+    const TaskRecord *record = *iter;
+    m_logger->verbose("%6.3f - %6.3f T%-2d priority %3d, waited %0.3f s: %s\n",
+                      record->started, record->finished, record->thread, record->priority,
+                      record->started - record->ready, record->name.c_str());
+  }
+}
+
+FocusStack::statistics_t Worker::get_statistics()
+{
+  FocusStack::statistics_t result;
+  result.wall_time = 0;
+  result.peak_memory = m_memory->peak();
+  result.stages = m_statistics->get();
+
+  std::unique_lock<std::mutex> lock(m_mutex);
+  for (const TaskRecord &record: m_records)
+  {
+    result.wall_time = std::max(result.wall_time, record.finished);
+  }
+
+  return result;
+}
+
+// Quote special characters for a JSON string
+static std::string json_escape(const std::string &str)
+{
+  std::string result;
+  for (char c: str)
+  {
+    if (c == '"' || c == '\\')
+    {
+      result += '\\';
+      result += c;
+    }
+    else if ((unsigned char)c < 0x20)
+    {
+      char buf[8];
+      snprintf(buf, sizeof(buf), "\\u%04x", c);
+      result += buf;
+    }
+    else
+    {
+      result += c;
+    }
+  }
+  return result;
+}
+
+bool Worker::write_trace(const std::string &filename)
+{
+  FILE *f = fopen(filename.c_str(), "w");
+  if (!f)
+  {
+    return false;
+  }
+
+  std::unique_lock<std::mutex> lock(m_mutex);
+
+  // Every event after the first one starts with a comma
+  fprintf(f, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+  fprintf(f, "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, \"args\": {\"name\": \"focus-stack\"}}");
+
+  for (size_t i = 0; i < m_threads.size(); i++)
+  {
+    fprintf(f, ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, "
+               "\"args\": {\"name\": \"T%d\"}}", (int)i, (int)i);
+  }
+
+  // Each task is shown as a slice on the thread that ran it, with flow
+  // arrows from the dependencies. Times are in microseconds.
+  int flow_id = 0;
+  for (const TaskRecord &record: m_records)
+  {
+    if (record.finished < 0)
+    {
+      continue; // Did not run
+    }
+
+    fprintf(f, ",\n{\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, "
+               "\"ts\": %0.1f, \"dur\": %0.1f, \"args\": {\"id\": %d, \"priority\": %d, "
+               "\"queued_ms\": %0.3f, \"ready_ms\": %0.3f, \"wait_ms\": %0.3f, \"opencl\": %s, "
+               "\"output\": \"%dx%d\", \"inputs\": [",
+            json_escape(record.name).c_str(), record.opencl ? "opencl" : "cpu", record.thread,
+            record.started * 1e6, (record.finished - record.started) * 1e6, record.id, record.priority,
+            record.queued * 1e3, record.ready * 1e3, (record.started - record.ready) * 1e3,
+            record.opencl ? "true" : "false", record.size.width, record.size.height);
+
+    for (size_t j = 0; j < record.depends.size(); j++)
+    {
+      fprintf(f, "%s\"%dx%d\"", j ? ", " : "", record.depends[j]->size.width, record.depends[j]->size.height);
+    }
+
+    fprintf(f, "], \"depends\": [");
+
+    for (size_t j = 0; j < record.depends.size(); j++)
+    {
+      fprintf(f, "%s%d", j ? ", " : "", record.depends[j]->id);
+    }
+
+    fprintf(f, "]}}");
+
+    for (const TaskRecord *dependency: record.depends)
+    {
+      if (dependency->finished < 0) continue;
+
+      // Flow arrow starts from inside the dependency slice, just before its end
+      flow_id++;
+      fprintf(f, ",\n{\"name\": \"dependency\", \"cat\": \"flow\", \"ph\": \"s\", \"id\": %d, \"pid\": 1, "
+                 "\"tid\": %d, \"ts\": %0.1f}",
+              flow_id, dependency->thread, dependency->finished * 1e6 - 0.1);
+      fprintf(f, ",\n{\"name\": \"dependency\", \"cat\": \"flow\", \"ph\": \"f\", \"bp\": \"e\", \"id\": %d, "
+                 "\"pid\": 1, \"tid\": %d, \"ts\": %0.1f}",
+              flow_id, record.thread, record.started * 1e6);
+    }
+  }
+
+  fprintf(f, "\n]}\n");
+
+  bool ok = !ferror(f);
+  return (fclose(f) == 0) && ok;
+}
+
+void Worker::get_status(int &total_tasks, int &completed_tasks, std::string &running_task_name)
+{
+  total_tasks = m_total_tasks;
+  completed_tasks = m_completed_tasks;
+  running_task_name = this->running_task_name();
+}
+
+double Worker::seconds_passed() const
+{
+  std::chrono::time_point<std::chrono::steady_clock> now = std::chrono::steady_clock::now();
+  return std::chrono::duration<double>(now - m_start_time).count();
+}
+
+// This is the worker thread; it is run in multiple copies in separate threads.
+void Worker::worker(int thread_idx)
+{
+  for (;;)
+  {
+    std::shared_ptr<Task> task = wait_task(thread_idx);
+
+    if (!task || !run_task(task, thread_idx))
+    {
+      return;
+    }
+  }
+}
+
+// Run task in the current thread. Returns false if it failed.
+bool Worker::run_task(const std::shared_ptr<Task> &task, int thread_idx)
+{
+  thread_state_t &state = *m_thread_states.at(thread_idx);
+
+  {
+    std::unique_lock<std::mutex> lock(state.mutex);
+    state.running = task;
+  }
+
+  if (!task->m_memory)
+  {
+    // Charge estimated memory use while the task is running
+    task->m_memory = m_memory;
+    task->m_memory_charged = m_memory->estimate(*task);
+    m_memory->add(task->m_memory_charged);
+  }
+
+  bool opencl = task->uses_opencl();
+  double start = seconds_passed();
+  task->m_record->thread = thread_idx;
+  task->m_record->started = start;
+
+  if (m_trace)
+  {
+    // Dependencies are cleared when the task runs, so record them now
+    task->m_record->opencl = opencl;
+    for (const std::shared_ptr<Task> &dependency: task->get_depends())
+    {
+      if (dependency->m_record) task->m_record->depends.push_back(dependency->m_record);
+    }
+  }
+  int taskidx = ++m_tasks_started;
+
+  if (m_logger->get_level() <= Logger::LOG_VERBOSE)
+  {
+    m_logger->verbose("%6.3f [%3d/%3d] T%d Starting task: %s\n",
+                seconds_passed(), taskidx, (int)m_total_tasks, thread_idx, task->name().c_str());
+  }
+  else
+  {
+    m_logger->progress("[%3d/%3d] %-40.40s\r", taskidx, (int)m_total_tasks, task->name().c_str());
+  }
+
+  try
+  {
+    task->run(m_logger, m_statistics);
+  }
+  catch (std::exception &e)
+  {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_error = "Task " + task->name() + " on thread " + std::to_string(thread_idx)
+              + " failed with exception:\n" + e.what();
+    m_logger->error("\n\n%s\n", m_error.c_str());
+    m_failed = true;
+    m_finished.notify_all();
+    return false;
+  }
+
+  // Replace the estimate with actual result size
+  int64_t result_bytes = task->result_bytes();
+  m_memory->add(result_bytes - task->m_memory_charged);
+  task->m_memory_charged = result_bytes;
+  m_memory->learn(*task, result_bytes);
+
+  task->m_record->finished = seconds_passed();
+  if (m_trace) task->m_record->size = task->result_size();
+
+  if (m_logger->get_level() <= Logger::LOG_VERBOSE)
+  {
+    m_logger->verbose("%6.3f           T%d Finished task %d in %0.3f s.\n",
+                      seconds_passed(), thread_idx, taskidx, seconds_passed() - start);
+    m_logger->verbose("%6.3f           Memory use: %0.3f MB.\n", seconds_passed(), m_memory->used() / 1e6);
+  }
+
+  if (opencl)
+  {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_opencl_users--;
+
+    if (!m_ready_opencl.empty())
+    {
+      m_wakeup.notify_one();
+    }
+  }
+
+  {
+    std::unique_lock<std::mutex> lock(state.mutex);
+    state.running = nullptr;
+  }
+
+  m_running_tasks--;
+  m_completed_tasks++;
+  release_dependents(task, thread_idx);
+
+  if (m_held_count > 0)
+  {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    release_held();
+  }
+
+  if (m_logger->get_level() > Logger::LOG_VERBOSE)
+  {
+    // Report one of the remaining running tasks
+    std::string name = running_task_name();
+    if (name != "")
+    {
+      m_logger->progress("[%3d/%3d] %-40.40s\r", (int)m_tasks_started, (int)m_total_tasks, name.c_str());
+    }
+  }
+
+  if (--m_pending_tasks == 0)
+  {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_finished.notify_all();
+  }
+
+  return true;
 }
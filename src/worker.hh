@@ -9,12 +9,76 @@
 #include <mutex>
 #include <condition_variable>
 #include <chrono>
+#include <unordered_map>
+#include <typeindex>
+#include <cstdint>
+#include <atomic>
 #include <exception>
+#include <cassert>
 #include <opencv2/core/core.hpp>
 #include "logger.hh"
+#include "stealing_deque.hh"
 
 namespace focusstack {
 
+class Task;
+
+// Scheduling history of one task, kept by Worker for reporting.
+// Times are in seconds since start of the worker.
+struct TaskRecord
+{
+  std::string name;
+  int priority;
+  int thread;
+  double queued;
+  double ready;
+  double started;
+  double finished;
+  const TaskRecord *gating; // Dependency that completed last, or nullptr
+
+  // Collected only when tracing is enabled
+  int id;
+  bool opencl;
+  cv::Size size; // Size of the result image
+  std::vector<const TaskRecord*> depends;
+};
+
+// Keeps count of memory used by task results. Shared between the worker and
+// the tasks, because tasks may outlive the worker that ran them.
+class MemoryTracker
+{
+public:
+  MemoryTracker(): m_used(0), m_peak(0) {}
+
+  void add(int64_t bytes);
+  int64_t used() const { return m_used; }
+  int64_t peak() const { return m_peak; }
+
+  // Estimate result size of task, either from Task::estimate_result_bytes()
+  // or from the previous results of the same task type.
+  // Returns 0 if no estimate is available.
+  int64_t estimate(const Task &task);
+  void learn(const Task &task, int64_t bytes);
+
+private:
+  std::atomic<int64_t> m_used;
+  std::atomic<int64_t> m_peak;
+  std::mutex m_mutex;
+  std::unordered_map<std::type_index, int64_t> m_sizes;
+};
+
+// Collects run time statistics of completed tasks, grouped by task type.
+class TaskStatistics
+{
+public:
+  void add(const Task &task, double wall, double cpu);
+  std::vector<FocusStack::stage_statistics_t> get() const;
+
+private:
+  mutable std::mutex m_mutex;
+  std::unordered_map<std::type_index, FocusStack::stage_statistics_t> m_stages;
+};
+
 // Generic runnable task, optionally with some dependencies on other tasks
 class Task
 {
@@ -24,9 +88,21 @@ public:
 
   virtual bool ready_to_run();
   virtual bool uses_opencl() { return false; }
+
+  // Estimated size of the result in bytes, used for the memory budget.
+  // Called just before the task runs, when dependencies have completed.
+  // Return 0 if the size is not known beforehand.
+  virtual size_t estimate_result_bytes() const { return 0; }
+
+  // Actual size of the result in bytes, after the task has completed.
+  virtual size_t result_bytes() const { return 0; }
+
+  // Size of the result image, for tracing.
+  virtual cv::Size result_size() const { return cv::Size(); }
+
   bool is_running() const { return m_running; }
   bool is_completed() const { return m_done; }
-  void run(std::shared_ptr<Logger> logger = nullptr);
+  void run(std::shared_ptr<Logger> logger = nullptr, std::shared_ptr<TaskStatistics> statistics = nullptr);
   std::string filename() const { return m_filename; }
   std::string name() const { return m_name; }
   std::string basename() const;
@@ -34,7 +110,8 @@ public:
   void set_index(int index) { m_index = index; }
   const std::vector<std::shared_ptr<Task> > &get_depends() const { return m_depends_on; }
 
-  void wait();
+  // Wait for the task to complete. Returns false on timeout.
+  bool wait(int timeout_ms = -1);
 
 protected:
   virtual void task() { };
@@ -48,18 +125,39 @@ protected:
   std::vector<std::shared_ptr<Task> > m_depends_on; // List of tasks this task needs as inputs
 
   std::condition_variable m_wakeup;
-  bool m_running;
-  bool m_done;
+  std::atomic<bool> m_running;
+  std::atomic<bool> m_done;
+
+private:
+  // Scheduling state, managed by Worker.
+  friend class Worker;
+  friend class ReadyQueue;
+  std::atomic<int> m_unfinished_deps; // Number of dependencies that have not completed yet
+  bool m_prepended; // Run before other ready tasks
+  std::atomic<int> m_priority; // Length of the longest chain of tasks depending on this one
+  bool m_queued; // Task is in a ReadyQueue
+  uint64_t m_queue_seq; // Order of insertion in ReadyQueue
+  std::vector<std::weak_ptr<Task> > m_sched_depends; // Copy of m_depends_on for priority updates
+  TaskRecord *m_record;
+  std::mutex m_dependents_mutex;
+  std::atomic<bool> m_released; // Dependents have been released after completion
+  std::vector<std::shared_ptr<Task> > m_dependents; // Tasks waiting for this task to complete
+  std::shared_ptr<Task> m_self; // Keeps task alive while it is in a work-stealing deque
+  std::shared_ptr<MemoryTracker> m_memory; // Memory charged for the result is released on destruction
+  int64_t m_memory_charged;
 };
 
 // Task that has image as a result.
 class ImgTask: public Task
 {
 public:
-  ImgTask() {};
-  ImgTask(cv::Mat result): m_result(result) {}
+  ImgTask(): m_wavelet_levels(0) {};
+  ImgTask(cv::Mat result): m_result(result), m_wavelet_levels(0) {}
   virtual const cv::Mat &img() const { return m_result; }
 
+  virtual size_t result_bytes() const { return m_result.total() * m_result.elemSize(); }
+  virtual cv::Size result_size() const { return m_result.size(); }
+
   bool has_valid_area() const { return m_valid_area.width != 0 && m_valid_area.height != 0; }
   cv::Rect valid_area() const {
     if (!has_valid_area())
@@ -73,6 +171,16 @@ public:
     }
   }
 
+  // Number of wavelet levels used for the image, or 0 if it is decided
+  // from the image size. Tiles are decomposed to a fixed number of levels.
+  int wavelet_levels() const { return m_wavelet_levels; }
+
+  // Image downscaled with INTER_AREA so that its larger dimension is at most
+  // max_resolution, or img() if it is already small enough. The downscaled
+  // images are cached, so that all tasks using this image share them and
+  // they must not be modified. Stores the scale factor in scale_ratio if given.
+  cv::Mat img_downscaled(int max_resolution, float *scale_ratio = nullptr) const;
+
   cv::Mat img_cropped() const {
     cv::Mat result = img();
     if (has_valid_area() && m_valid_area.size() != result.size())
@@ -87,6 +195,7 @@ public:
 protected:
   cv::Mat m_result;
   cv::Rect m_valid_area;
+  int m_wavelet_levels;
 
   // Limit valid area by intersection
   void limit_valid_area(cv::Rect other)
@@ -97,13 +206,69 @@ protected:
     int y1 = std::min(m_valid_area.y + m_valid_area.height, other.y + other.height);
     m_valid_area = cv::Rect(x0, y0, x1 - x0, y1 - y0);
   }
+
+private:
+  mutable std::mutex m_downscaled_mutex;
+  mutable std::unordered_map<int, cv::Mat> m_downscaled; // Cached results of img_downscaled()
+};
+
+// Queue of ready tasks, ordered by prepend flag, priority and insertion order.
+// Priority of a queued task can be raised afterwards by calling update().
+// Requires external locking.
+class ReadyQueue
+{
+public:
+  ReadyQueue(): m_count(0), m_seq(0) {}
+
+  void push(const std::shared_ptr<Task> &task);
+  void update(const std::shared_ptr<Task> &task);
+  std::shared_ptr<Task> pop();
+  bool empty() const { return m_count == 0; }
+
+private:
+  struct entry_t {
+    bool prepended;
+    int priority;
+    uint64_t seq;
+    std::shared_ptr<Task> task;
+
+    bool operator<(const entry_t &other) const;
+  };
+
+  // Binary heap, with possibly outdated entries for tasks whose priority was raised
+  std::vector<entry_t> m_heap;
+  size_t m_count;
+  uint64_t m_seq;
 };
 
 // Work queue class that distributes tasks to threads.
+//
+// Tasks are held back until all their dependencies have completed, after which
+// they are placed in a ready queue. Two scheduling strategies are available:
+//
+// SCHEDULER_SHARED:   All threads take tasks from one shared priority queue.
+// SCHEDULER_STEALING: Each thread has its own lock-free deque. Tasks readied by
+//                     a completing task go to the deque of the same thread, so
+//                     that a chain of processing steps for one image tends to
+//                     stay on one core. Idle threads steal from the others.
+//
+// Tasks that use OpenCL and tasks added from outside the worker threads always
+// go through the shared queue.
+//
+// The priority of a task is the length of the longest chain of tasks that
+// depend on it, so that tasks on the critical path, such as the merge chain,
+// run before tasks that have plenty of slack. Prepended tasks run first.
+//
+// If a memory limit is set, tasks without dependencies (such as image loading)
+// are held back while the results of earlier tasks take up the memory budget.
+// The rest of the tasks are not limited, as they are needed to release memory.
 class Worker
 {
 public:
-  Worker(int max_threads, std::shared_ptr<Logger> logger);
+  using scheduler_t = FocusStack::scheduler_t;
+
+  Worker(int max_threads, std::shared_ptr<Logger> logger,
+         scheduler_t scheduler = FocusStack::SCHEDULER_SHARED);
   ~Worker();
 
   // Add task to the end of the queue
@@ -121,29 +286,91 @@ public:
 
   void get_status(int &total_tasks, int &completed_tasks, std::string &running_task_name);
 
+  // Check tasks that were not ready to run again, without waiting for the
+  // next poll. Used when the condition in Task::ready_to_run() has changed.
+  void poll_deferred();
+
+  // Set limit for memory used by task results, 0 for unlimited.
+  void set_max_memory(size_t bytes) { m_max_memory = bytes; }
+
+  const MemoryTracker &memory() const { return *m_memory; }
+
+  // Collect the additional task information needed by write_trace().
+  // Must be called before adding tasks.
+  void set_trace(bool enable) { m_trace = enable; }
+
+  FocusStack::statistics_t get_statistics();
+
+  // Write timeline of all tasks in Chrome trace event format.
+  // Call after wait_all(). Returns false if the file could not be written.
+  bool write_trace(const std::string &filename);
+
 private:
   std::shared_ptr<Logger> m_logger;
+  scheduler_t m_scheduler;
   std::vector<std::thread> m_threads;
-  std::deque<std::shared_ptr<Task> > m_tasks;
-  std::unordered_set<std::shared_ptr<Task> > m_running;
 
-  bool m_closed;
-  int m_tasks_started;
-  int m_total_tasks;
-  int m_completed_tasks;
+  struct thread_state_t {
+    StealingDeque<Task> deque; // Used only with SCHEDULER_STEALING
+    std::mutex mutex;
+    std::shared_ptr<Task> running; // Protected by mutex
+  };
+  std::vector<std::unique_ptr<thread_state_t> > m_thread_states;
+
+  // Shared queues, protected by m_mutex
+  ReadyQueue m_ready; // All dependencies completed
+  ReadyQueue m_ready_opencl; // Ready, but can run only when OpenCL is free
+  std::vector<std::shared_ptr<Task> > m_deferred; // Task::ready_to_run() returned false, poll again later
+  std::deque<std::shared_ptr<Task> > m_held; // Held back because of memory limit
+  std::vector<std::weak_ptr<Task> > m_tasks; // All added tasks, for diagnostics
+  std::deque<TaskRecord> m_records; // Records of all added tasks, for reporting
+  int m_reported_tasks;
+  std::atomic<int> m_shared_count; // Number of tasks in m_ready and m_ready_opencl
+
+  std::atomic<bool> m_closed;
+  std::atomic<int> m_tasks_started;
+  std::atomic<int> m_total_tasks;
+  std::atomic<int> m_completed_tasks;
+  std::atomic<int> m_pending_tasks; // Added but not yet completed
+  std::atomic<int> m_running_tasks; // Taken from queue and not yet completed
+  std::atomic<int> m_sleeping_threads;
+  std::atomic<int> m_held_count;
   int m_opencl_users;
   int m_wait_count;
 
-  bool m_failed;
+  std::shared_ptr<MemoryTracker> m_memory;
+  size_t m_max_memory;
+  std::shared_ptr<TaskStatistics> m_statistics;
+  bool m_trace;
+
+  std::atomic<bool> m_failed;
   std::string m_error;
 
   std::mutex m_mutex;
-  std::condition_variable m_wakeup;
+  std::condition_variable m_wakeup; // Signals worker threads that tasks are ready to run
+  std::condition_variable m_finished; // Signals wait_all() that tasks have finished
 
   std::chrono::time_point<std::chrono::steady_clock> m_start_time;
-  float seconds_passed() const;
+  std::chrono::time_point<std::chrono::steady_clock> m_deferred_time;
+  double seconds_passed() const;
+
+  void enqueue(std::shared_ptr<Task> task, bool prepend);
+  void push_shared(const std::shared_ptr<Task> &task); // Requires m_mutex
+  void make_ready(const std::shared_ptr<Task> &task, int thread_idx);
+  void release_dependents(const std::shared_ptr<Task> &task, int thread_idx);
+  std::shared_ptr<Task> take_shared_task(); // Requires m_mutex
+  bool reserve_memory(const std::shared_ptr<Task> &task, bool force); // Requires m_mutex
+  void release_held(); // Requires m_mutex
+  std::shared_ptr<Task> take_task(int thread_idx);
+  std::shared_ptr<Task> wait_task(int thread_idx);
+  bool have_work(); // Requires m_mutex
+  void check_deadlock(); // Requires m_mutex
+  void raise_priorities(const std::shared_ptr<Task> &task); // Requires m_mutex
+  void report_critical_path(); // Requires m_mutex
+  std::string running_task_name();
 
   void worker(int thread_idx);
+  bool run_task(const std::shared_ptr<Task> &task, int thread_idx);
 };
 
 
@@ -0,0 +1,516 @@
+#include <gtest/gtest.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <fstream>
+#include <iterator>
+#include <thread>
+#include "worker.hh"
+#include "logger.hh"
+
+namespace focusstack {
+
+// Task that only records the order in which it ran
+class Task_Order: public Task
+{
+public:
+  Task_Order(std::atomic<int> *counter, std::vector<std::shared_ptr<Task> > depends_on = {}):
+    m_counter(counter), m_order(-1)
+  {
+    m_name = "Order task";
+    m_depends_on = depends_on;
+  }
+
+  int order() const { return m_order; }
+
+private:
+  virtual void task()
+  {
+    m_order = (*m_counter)++;
+  }
+
+  std::atomic<int> *m_counter;
+  int m_order;
+};
+
+static std::shared_ptr<Logger> quiet_logger()
+{
+  std::shared_ptr<Logger> logger = std::make_shared<Logger>();
+  logger->set_level(Logger::LOG_ERROR);
+  return logger;
+}
+
+static const FocusStack::scheduler_t g_schedulers[] = {
+  FocusStack::SCHEDULER_SHARED, FocusStack::SCHEDULER_STEALING
+};
+
+static const char *scheduler_name(FocusStack::scheduler_t scheduler)
+{
+  return (scheduler == FocusStack::SCHEDULER_STEALING) ? "stealing" : "shared";
+}
+
+static void check_dependencies(FocusStack::scheduler_t scheduler)
+{
+  std::atomic<int> counter(0);
+  Worker worker(4, quiet_logger(), scheduler);
+
+  // Diamond shaped graph a -> (b, c) -> d
+  std::shared_ptr<Task_Order> a = std::make_shared<Task_Order>(&counter);
+  std::shared_ptr<Task_Order> b = std::make_shared<Task_Order>(&counter, std::vector<std::shared_ptr<Task> >{a});
+  std::shared_ptr<Task_Order> c = std::make_shared<Task_Order>(&counter, std::vector<std::shared_ptr<Task> >{a});
+  std::shared_ptr<Task_Order> d = std::make_shared<Task_Order>(&counter, std::vector<std::shared_ptr<Task> >{b, c, c});
+
+  // Add dependents first to check that later added dependencies are tracked
+  worker.add(d);
+  worker.add(c);
+  worker.add(b);
+  worker.add(a);
+  ASSERT_TRUE(worker.wait_all());
+
+  ASSERT_EQ(counter, 4);
+  ASSERT_EQ(a->order(), 0);
+  ASSERT_LT(b->order(), d->order());
+  ASSERT_LT(c->order(), d->order());
+  ASSERT_EQ(d->order(), 3);
+}
+
+TEST(Worker, Dependencies) {
+  for (FocusStack::scheduler_t scheduler: g_schedulers)
+  {
+    SCOPED_TRACE(scheduler_name(scheduler));
+    check_dependencies(scheduler);
+  }
+}
+
+static void check_completed_dependency(FocusStack::scheduler_t scheduler)
+{
+  std::atomic<int> counter(0);
+  Worker worker(2, quiet_logger(), scheduler);
+
+  std::shared_ptr<Task_Order> a = std::make_shared<Task_Order>(&counter);
+  worker.add(a);
+  ASSERT_TRUE(worker.wait_all());
+
+  std::shared_ptr<Task_Order> b = std::make_shared<Task_Order>(&counter, std::vector<std::shared_ptr<Task> >{a});
+  worker.add(b);
+  ASSERT_TRUE(worker.wait_all());
+  ASSERT_EQ(b->order(), 1);
+}
+
+TEST(Worker, CompletedDependency) {
+  for (FocusStack::scheduler_t scheduler: g_schedulers)
+  {
+    SCOPED_TRACE(scheduler_name(scheduler));
+    check_completed_dependency(scheduler);
+  }
+}
+
+static void check_prepend(FocusStack::scheduler_t scheduler)
+{
+  std::atomic<int> counter(0);
+  std::shared_ptr<Task_Order> first, last;
+
+  {
+    // With single thread the ready queue order is fully deterministic.
+    // Block the thread until all tasks have been queued.
+    std::shared_ptr<Task_Order> gate = std::make_shared<Task_Order>(&counter);
+    Worker worker(1, quiet_logger(), scheduler);
+    last = std::make_shared<Task_Order>(&counter, std::vector<std::shared_ptr<Task> >{gate});
+    first = std::make_shared<Task_Order>(&counter, std::vector<std::shared_ptr<Task> >{gate});
+    worker.add(last);
+    worker.prepend(first);
+    worker.add(gate);
+    ASSERT_TRUE(worker.wait_all());
+  }
+
+  ASSERT_EQ(first->order(), 1);
+  ASSERT_EQ(last->order(), 2);
+}
+
+TEST(Worker, Prepend) {
+  for (FocusStack::scheduler_t scheduler: g_schedulers)
+  {
+    SCOPED_TRACE(scheduler_name(scheduler));
+    check_prepend(scheduler);
+  }
+}
+
+static void check_priority(FocusStack::scheduler_t scheduler)
+{
+  std::atomic<int> counter(0);
+  std::shared_ptr<Task_Order> independent, head, tail;
+
+  {
+    // The head of a longer chain should run before a task that was added
+    // earlier but has nothing depending on it.
+    std::shared_ptr<Task_Order> gate = std::make_shared<Task_Order>(&counter);
+    Worker worker(1, quiet_logger(), scheduler);
+    independent = std::make_shared<Task_Order>(&counter, std::vector<std::shared_ptr<Task> >{gate});
+    head = std::make_shared<Task_Order>(&counter, std::vector<std::shared_ptr<Task> >{gate});
+    tail = std::make_shared<Task_Order>(&counter, std::vector<std::shared_ptr<Task> >{head});
+    worker.add(independent);
+    worker.add(head);
+    worker.add(tail);
+    worker.add(gate);
+    ASSERT_TRUE(worker.wait_all());
+  }
+
+  ASSERT_EQ(head->order(), 1);
+  ASSERT_LT(head->order(), independent->order());
+}
+
+TEST(Worker, Priority) {
+  for (FocusStack::scheduler_t scheduler: g_schedulers)
+  {
+    SCOPED_TRACE(scheduler_name(scheduler));
+    check_priority(scheduler);
+  }
+}
+
+// Chains of tasks mostly stay on the thread that readied them when work
+// stealing is enabled, as long as every thread has its own chain to work on.
+// Idle threads may still occasionally steal a task.
+class Task_Thread: public Task
+{
+public:
+  Task_Thread(std::shared_ptr<Task> dependency)
+  {
+    m_name = "Thread task";
+    if (dependency) m_depends_on.push_back(dependency);
+  }
+
+  std::thread::id thread() const { return m_thread; }
+
+private:
+  virtual void task() { m_thread = std::this_thread::get_id(); }
+  std::thread::id m_thread;
+};
+
+TEST(Worker, StealingLocality) {
+  const int chains = 4;
+  const int length = 100;
+  std::vector<std::vector<std::shared_ptr<Task_Thread> > > tasks(chains);
+
+  {
+    Worker worker(chains, quiet_logger(), FocusStack::SCHEDULER_STEALING);
+    for (int i = 0; i < length; i++)
+    {
+      for (int j = 0; j < chains; j++)
+      {
+        tasks.at(j).push_back(std::make_shared<Task_Thread>(i > 0 ? tasks.at(j).back() : nullptr));
+        worker.add(tasks.at(j).back());
+      }
+    }
+    ASSERT_TRUE(worker.wait_all());
+  }
+
+  int same_thread = 0;
+  for (int j = 0; j < chains; j++)
+  {
+    for (int i = 1; i < length; i++)
+    {
+      if (tasks.at(j).at(i)->thread() == tasks.at(j).at(i - 1)->thread())
+      {
+        same_thread++;
+      }
+    }
+  }
+
+  ASSERT_GT(same_thread, chains * (length - 1) / 2);
+}
+
+// Task without dependencies that produces a fixed size result, like image loading
+class Task_Source: public Task
+{
+public:
+  Task_Source(std::atomic<int> *alive, std::atomic<int> *max_alive):
+    m_alive(alive), m_max_alive(max_alive), m_has_result(false)
+  {
+    m_name = "Source task";
+  }
+
+  ~Task_Source()
+  {
+    if (m_has_result) (*m_alive)--;
+  }
+
+  virtual size_t result_bytes() const { return 1000; }
+
+private:
+  virtual void task()
+  {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    m_has_result = true;
+    int alive = ++(*m_alive);
+    int max_alive = *m_max_alive;
+    while (alive > max_alive && !m_max_alive->compare_exchange_weak(max_alive, alive));
+  }
+
+  std::atomic<int> *m_alive;
+  std::atomic<int> *m_max_alive;
+  bool m_has_result;
+};
+
+// Task that consumes the source result, which is then released
+class Task_Sink: public Task
+{
+public:
+  Task_Sink(std::shared_ptr<Task> source)
+  {
+    m_name = "Sink task";
+    m_depends_on.push_back(source);
+  }
+
+private:
+  virtual void task()
+  {
+    std::this_thread::sleep_for(std::chrono::milliseconds(2));
+  }
+};
+
+TEST(Worker, MemoryLimit) {
+  for (FocusStack::scheduler_t scheduler: g_schedulers)
+  {
+    SCOPED_TRACE(scheduler_name(scheduler));
+    std::atomic<int> alive(0), max_alive(0);
+    std::vector<std::shared_ptr<Task> > sinks;
+
+    {
+      Worker worker(4, quiet_logger(), scheduler);
+      worker.set_max_memory(3000);
+
+      for (int i = 0; i < 50; i++)
+      {
+        std::shared_ptr<Task> source = std::make_shared<Task_Source>(&alive, &max_alive);
+        sinks.push_back(std::make_shared<Task_Sink>(source));
+        worker.add(source);
+        worker.add(sinks.back());
+      }
+
+      ASSERT_TRUE(worker.wait_all());
+      ASSERT_LE(worker.memory().peak(), 3000);
+      ASSERT_EQ(worker.memory().used(), 0);
+    }
+
+    ASSERT_LE(max_alive, 3);
+    ASSERT_EQ(alive, 0);
+  }
+}
+
+TEST(Worker, Trace) {
+  const char *filename = "worker_tests_trace.json";
+  std::atomic<int> counter(0);
+
+  {
+    Worker worker(2, quiet_logger());
+    worker.set_trace(true);
+
+    std::shared_ptr<Task_Order> a = std::make_shared<Task_Order>(&counter);
+    std::shared_ptr<Task_Order> b = std::make_shared<Task_Order>(&counter, std::vector<std::shared_ptr<Task> >{a});
+    std::shared_ptr<Task_Order> c = std::make_shared<Task_Order>(&counter, std::vector<std::shared_ptr<Task> >{a, b});
+    worker.add(a);
+    worker.add(b);
+    worker.add(c);
+    ASSERT_TRUE(worker.wait_all());
+    ASSERT_TRUE(worker.write_trace(filename));
+  }
+
+  std::ifstream file(filename);
+  std::string trace((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+  std::remove(filename);
+
+  auto count = [&](const std::string &str) {
+    int n = 0;
+    for (size_t pos = trace.find(str); pos != std::string::npos; pos = trace.find(str, pos + 1)) n++;
+    return n;
+  };
+
+  ASSERT_EQ(trace.find("{\"displayTimeUnit\": \"ms\", \"traceEvents\": ["), 0u);
+  ASSERT_EQ(count("\"ph\": \"X\""), 3);
+  ASSERT_EQ(count("\"ph\": \"s\""), 3);
+  ASSERT_EQ(count("\"ph\": \"f\""), 3);
+  ASSERT_EQ(count("\"depends\": [0, 1]"), 1);
+  ASSERT_EQ(count("{"), count("}"));
+  ASSERT_EQ(count(",\n]"), 0);
+}
+
+TEST(Worker, Statistics) {
+  std::atomic<int> counter(0);
+  Worker worker(2, quiet_logger());
+
+  for (int i = 0; i < 10; i++)
+  {
+    worker.add(std::make_shared<Task_Order>(&counter));
+  }
+
+  ASSERT_TRUE(worker.wait_all());
+
+  FocusStack::statistics_t stats = worker.get_statistics();
+  ASSERT_EQ(stats.stages.size(), 1u);
+  ASSERT_EQ(stats.stages.at(0).name, "Task_Order");
+  ASSERT_EQ(stats.stages.at(0).count, 10);
+  ASSERT_LE(stats.stages.at(0).wall_max, stats.stages.at(0).wall_total);
+  ASSERT_GE(stats.wall_time, stats.stages.at(0).wall_max);
+}
+
+// Downscaled images should be computed once and shared between users.
+TEST(ImgTask, DownscaledCached) {
+  cv::Mat img(300, 400, CV_8U);
+  img = 100;
+  ImgTask task(img);
+
+  float ratio = 0.0f;
+  ASSERT_EQ(task.img_downscaled(1000, &ratio).data, img.data);
+  ASSERT_EQ(ratio, 1.0f);
+
+  std::vector<cv::Mat> results(4);
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 4; i++)
+  {
+    threads.emplace_back([&task, &results, i]() { results.at(i) = task.img_downscaled(100); });
+  }
+
+  for (std::thread &t: threads)
+  {
+    t.join();
+  }
+
+  ASSERT_EQ(results.at(0).cols, 100);
+  ASSERT_EQ(results.at(0).rows, 75);
+  ASSERT_EQ(results.at(0).at<uint8_t>(10, 10), 100);
+
+  for (int i = 0; i < 4; i++)
+  {
+    ASSERT_EQ(results.at(i).data, results.at(0).data);
+  }
+
+  ASSERT_EQ(task.img_downscaled(100, &ratio).data, results.at(0).data);
+  ASSERT_EQ(ratio, 0.25f);
+  ASSERT_NE(task.img_downscaled(200).data, results.at(0).data);
+}
+
+// The scheduler that the dependency counting replaced, as a baseline for the
+// benchmarks. Each thread scans the whole queue under the lock for the first
+// task whose dependencies have completed, and wakes all threads after each task.
+static void run_queue_scan(const std::vector<std::shared_ptr<Task> > &tasks, int threads)
+{
+  std::mutex mutex;
+  std::condition_variable wakeup;
+  std::deque<std::shared_ptr<Task> > queue(tasks.begin(), tasks.end());
+  std::vector<std::thread> workers;
+
+  for (int t = 0; t < threads; t++)
+  {
+    workers.emplace_back([&]() {
+      std::unique_lock<std::mutex> lock(mutex);
+      while (!queue.empty())
+      {
+        std::shared_ptr<Task> task;
+        for (size_t i = 0; i < queue.size(); i++)
+        {
+          if (queue.at(i)->ready_to_run())
+          {
+            task = queue.at(i);
+            queue.erase(queue.begin() + i);
+            break;
+          }
+        }
+
+        if (!task)
+        {
+          wakeup.wait(lock);
+          continue;
+        }
+
+        lock.unlock();
+        task->run();
+        lock.lock();
+        wakeup.notify_all();
+      }
+      wakeup.notify_all();
+    });
+  }
+
+  for (std::thread &thread: workers)
+  {
+    thread.join();
+  }
+}
+
+// Microbenchmark of the scheduling overhead with a large number of trivial tasks.
+// Every task depends on the task 16 steps before it in the dependency chain,
+// so that there are always plenty of both waiting and ready tasks.
+// If consumers_first is set, the tasks are added in reverse order so that
+// the runnable tasks are at the end of the queue.
+// If baseline is set, the tasks are run with run_queue_scan() instead of Worker.
+static void benchmark_trivial_tasks(FocusStack::scheduler_t scheduler, bool consumers_first, bool baseline,
+                                    int count = 100000)
+{
+  const int stride = 16;
+  const int threads = 4;
+  std::atomic<int> counter(0);
+  std::vector<std::shared_ptr<Task_Order> > tasks(count);
+
+  for (int i = 0; i < count; i++)
+  {
+    std::vector<std::shared_ptr<Task> > deps;
+    if (i >= stride) deps.push_back(tasks.at(i - stride));
+    tasks.at(i) = std::make_shared<Task_Order>(&counter, deps);
+  }
+
+  std::vector<std::shared_ptr<Task> > order;
+  for (int i = 0; i < count; i++)
+  {
+    order.push_back(tasks.at(consumers_first ? count - 1 - i : i));
+  }
+
+  auto start = std::chrono::steady_clock::now();
+
+  if (baseline)
+  {
+    run_queue_scan(order, threads);
+  }
+  else
+  {
+    Worker worker(threads, quiet_logger(), scheduler);
+    for (std::shared_ptr<Task> task: order)
+    {
+      worker.add(task);
+    }
+
+    ASSERT_TRUE(worker.wait_all());
+  }
+
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  std::printf("%d trivial tasks on %d threads, %s, %s: %0.3f s, %0.0f tasks/s\n",
+              count, threads, baseline ? "queue scan" : scheduler_name(scheduler),
+              consumers_first ? "consumers first" : "producers first",
+              seconds, count / seconds);
+
+  ASSERT_EQ(counter, count);
+  for (int i = stride; i < count; i++)
+  {
+    ASSERT_LT(tasks.at(i - stride)->order(), tasks.at(i)->order());
+  }
+}
+
+TEST(Worker, DISABLED_Benchmark100kTasks) {
+  benchmark_trivial_tasks(FocusStack::SCHEDULER_SHARED, false, true);
+  for (FocusStack::scheduler_t scheduler: g_schedulers)
+  {
+    benchmark_trivial_tasks(scheduler, false, false);
+  }
+}
+
+TEST(Worker, DISABLED_Benchmark100kTasksReverse) {
+  // Queue scan takes quadratic time here, 100k tasks would take minutes
+  benchmark_trivial_tasks(FocusStack::SCHEDULER_SHARED, true, true, 20000);
+  for (FocusStack::scheduler_t scheduler: g_schedulers)
+  {
+    benchmark_trivial_tasks(scheduler, true, false);
+  }
+}
+
+}